@@ -0,0 +1,94 @@
+/*
+ * bmp.h - In-memory image API of the BMP image processor.
+ *
+ * Purpose:
+ *   Lets other programs run the processor's filters on pixels they already
+ *   hold, without writing files. Images are non-owning views: a struct
+ *   Image only describes where the pixels are, so decoding a BMP buffer,
+ *   taking a sub-rectangle or filtering never copies or allocates pixels.
+ *   The command line program in prog6.c is built on the same functions.
+ *
+ * Building:
+ *   Compile prog6.c with -DBMP_LIBRARY to leave out main, and link the
+ *   object with -lm -pthread:
+ *      gcc -c -O2 -std=c99 -DBMP_LIBRARY prog6.c -o bmp.o
+ *   The header can be included from C or C++.
+ *
+ * Assumptions:
+ *   - Pixels are 8-bit BGR or BGRA, as in uncompressed 24-bit and 32-bit
+ *     BMP files. Filters never change alpha.
+ *   - A filter's source and destination must have the same size and format
+ *     and must not overlap.
+ *   - Functions return 0 (or a size) on success and print a message to
+ *     stderr on error.
+ */
+
+#ifndef BMP_H
+#define BMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pixel formats. The value is the number of bytes per pixel.
+enum PixelFormat { PIXEL_BGR = 3, PIXEL_BGRA = 4 };
+
+// View of an image held somewhere else in memory. Row y (0 is the top row)
+// starts at data + y * stride. The stride may be larger than a row, for
+// padding or for a sub-rectangle of a wider image, and is negative for
+// rows stored bottom-up as in most BMP files.
+struct Image {
+    int width;                 // Pixels per row
+    int height;                // Rows
+    ptrdiff_t stride;          // Bytes from the start of one row to the next
+    int format;                // PixelFormat
+    unsigned char *data;       // First (blue) byte of the top row
+};
+
+// Thread pool the filters run on. A NULL pool runs them on the calling
+// thread. threads counts the calling thread, so it must be at least 1.
+struct ThreadPool;
+struct ThreadPool *poolCreate(int threads);
+void poolDestroy(struct ThreadPool *pool);
+
+// imageInit - Picks the fastest SIMD kernels the CPU supports. Call once
+// before using the filters; without it they run portable code.
+void imageInit(void);
+
+// imageDecode - Fills in a view of the pixels of the BMP file held in
+// buffer. Nothing is copied: the view points into buffer, which must stay
+// valid while it is used, and must not be written through when buffer is
+// read-only.
+int imageDecode(const void *buffer, size_t size, struct Image *image);
+
+// imageEncodedSize - Returns the size of the BMP file imageEncode writes.
+size_t imageEncodedSize(const struct Image *image);
+
+// imageEncode - Writes image as an uncompressed bottom-up BMP file into
+// buffer. Returns the number of bytes written, or 0 if buffer is too small.
+size_t imageEncode(const struct Image *image, void *buffer, size_t size);
+
+// imageView - Fills in a view of the width x height pixels of image whose
+// top left pixel is (x, y).
+int imageView(const struct Image *image, int x, int y, int width, int height,
+              struct Image *view);
+
+// imageEdge - Applies the Laplacian edge filter of the edge operation to
+// src and stores the result in dst. The outermost pixels of the view are
+// copied unchanged.
+int imageEdge(const struct Image *src, const struct Image *dst, struct ThreadPool *pool);
+
+// imageNoise - Adds Gaussian noise to src and stores the result in dst.
+// Noise is keyed by seed and by the position of each value in the view,
+// so the same view always gets the same noise at any thread count.
+int imageNoise(const struct Image *src, const struct Image *dst, uint64_t seed,
+               double stddev, struct ThreadPool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
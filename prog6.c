@@ -16,13 +16,86 @@
  *                 image named "<original>-noise.bmp".
  *
  * Assumptions:
- *   - The input .bmp file is a 24-bit color image (no compression).
+ *   - The input .bmp file is an uncompressed 24-bit BGR or 32-bit BGRA image
+ *     (BI_RGB, or BI_BITFIELDS with BGRA masks) with a 40-byte or V2-V5 info
+ *     header, stored bottom-up or top-down (negative height). Pixels are read
+ *     from the offset in the file header, the whole header is copied to the
+ *     output unchanged, and alpha is never modified.
+ *     BI_RLE8 and BI_RLE4 files are also accepted by the operations that
+ *     map their input: they are expanded to 24-bit pixels when loaded.
  *   - For "read", the program is invoked with: p6 read <input.bmp> <output.txt>
+ *     [--format text|csv|bin] [--rows a:b | --rect x,y,w,h]. The output is
+ *     produced by a buffered formatter; a region selects rows and columns
+ *     directly in the mapped file without scanning the rest.
  *   - For "edge" or "noise", the program is invoked with: p6 edge <input.bmp>
- *     or p6 noise <input.bmp>.
- *   - The user is prompted for standard deviation (5 to 20) when performing the
- *     noise operation.
+ *     or p6 noise <input.bmp>. "edge" also accepts --stream to filter with a
+ *     rolling window of three rows so memory stays O(width) at any height,
+ *     and --threads N to filter horizontal bands in parallel (default: all
+ *     online cores). The filter kernel uses SSE2, AVX2 or AVX-512 when the
+ *     CPU supports it; --isa scalar|sse2|avx2|avx512 caps the choice.
+ *     edge and noise accept --overlap to read, filter and write bands of
+ *     the image at the same time with a bounded number of bands in memory.
+ *   - The user is prompted for standard deviation (5 to 20) when performing
+ *     the noise operation, unless it is given with --stddev S. Noise comes
+ *     from a counter-based generator keyed by --seed N and the sample
+ *     position, so a given seed gives identical output at any --threads
+ *     count.
+ *   - For "batch", the program is invoked with:
+ *     p6 batch <manifest.txt | directory> <edge | noise> [--out DIR] [--jobs N]
+ *     and processes every listed image without prompting.
+ *   - For "serve", the program is invoked with: p6 serve <socket> [--jobs N]
+ *     and answers one-line requests such as "edge in.bmp out.bmp" on a Unix
+ *     domain socket until a client sends "quit".
+ *   - For "pipe", the program is invoked with:
+ *     p6 pipe <input.bmp> <stage,stage,...> [-o output.bmp]
+ *     e.g. p6 pipe in.bmp edge,noise:sigma=10 -o out.bmp. The image is
+ *     decoded once, every stage runs in memory, and the result is encoded
+ *     once. Per-pixel stages (noise) are fused into the row loop of the
+ *     stage before them.
+ *   - For "bench", the program is invoked with:
+ *     p6 bench [--sizes 1,2,4,8] [--reps N] [--warmup N] [--dir DIR] [-o out.json]
+ *     and reports read/edge/noise throughput on synthetic images as JSON.
+ *   - For "conv", the program is invoked with:
+ *     p6 conv <input.bmp> <kernel> [-o output.bmp] [--scale S] [--bias B]
+ *     where kernel is a preset (box3/5/7, blur3/5/7, sharpen, edge, sobelx,
+ *     sobely), a file of weights, or weights such as "0,-1,0;-1,4,-1;0,-1,0".
+ *     The weights are normalized to sum to 1 unless --scale is given.
+ *   - For "canny", the program is invoked with: p6 canny <input.bmp>
+ *     [-o output.bmp] [--sigma S] [--low T] [--high T] [--bits 1|8] [--rle].
+ *     --rle writes the 8-bit edge map compressed with RLE8.
+ *   - For "denoise", the program is invoked with: p6 denoise <input.bmp>
+ *     [-o output.bmp] [--radius R]; 3x3 and 5x5 medians use sorting
+ *     networks and larger windows use sliding histograms.
+ *   - For "blur", the program is invoked with: p6 blur <input.bmp>
+ *     [-o output.bmp] [--radius R]; a box blur read from an integral image
+ *     in constant time per pixel. canny, denoise and blur take
+ *     --border replicate|reflect for pixels outside the image.
+ *   - For "pyramid", the program is invoked with: p6 pyramid <input.bmp>
+ *     [--levels N] and writes successive 2x downsamples, built in one pass
+ *     over the rows, to "<original>-1.bmp", "<original>-2.bmp" and so on.
+ *   - For "resize", the program is invoked with: p6 resize <input.bmp>
+ *     --size WxH | --factor F [-o output.bmp] and resamples by area
+ *     averaging to any size.
+ *   - For "stats", the program is invoked with: p6 stats <input.bmp>
+ *     [--ref reference.bmp] [-o output.json] and writes per-channel
+ *     histograms, min/max, mean and variance, and PSNR and SSIM against
+ *     the reference, as JSON.
+ *   - read, edge, noise, pipe and batch accept --stats (or --stats=json) to
+ *     print decode/compute/encode timings, bytes read and written, buffer
+ *     allocations and peak RSS to stderr.
+ *   - Output images and scratch rows are carved from a 64-byte-aligned arena
+ *     that is reset between images; --hugepages asks for transparent huge
+ *     pages for large buffers.
+ *   - --cache DIR keeps results keyed by a hash of the input file and the
+ *     operation's parameters; hits are reflinked or hard-linked into place.
+ *   - Output rows are written with pwrite by the band that computed them;
+ *     --direct preallocates the file and writes whole pages with O_DIRECT.
+ *   - The filters also run on in-memory image views through the API in
+ *     bmp.h; compiling with -DBMP_LIBRARY leaves out main so the file can
+ *     be linked into other programs.
  *   - Header fields are read field-by-field to avoid structure alignment issues.
+ *   - Input files are memory-mapped once by loadBMP; operations read pixel rows
+ *     in place through the mapping rather than with per-pixel fread calls.
  *
  * Known Bugs:
  *   - The edge-detection or noise operations may need extra checks for
@@ -31,11 +104,51 @@
  *     manner; additional formatting or printing might be needed.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <stdint.h>
 #include <math.h>
 #include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "bmp.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+// Size of the BMP file header plus the BITMAPINFOHEADER
+#define BMP_HEADER_SIZE 54
+
+// Range of noise standard deviations every entry point accepts, and the
+// one pipe, serve and bench use when none is given.
+#define NOISE_MIN_STDDEV 5
+#define NOISE_MAX_STDDEV 20
+#define NOISE_DEFAULT_STDDEV 10
+
+// Marks the command line operations, which only main calls. The library
+// build leaves main out, and everything outside bmp.h is static.
+#ifdef BMP_LIBRARY
+#define CLI_ONLY __attribute__((unused))
+#else
+#define CLI_ONLY
+#endif
 
 // Structure to represent the first BMP header (14 bytes)
 struct Header {
@@ -61,27 +174,472 @@ struct InfoHeader {
     unsigned int importantColors; // Number of important colors
 };
 
-// Structure to represent a pixel with RGB components.
-struct PIXEL {
-    unsigned char red;
-    unsigned char green;
-    unsigned char blue;
+// Structure describing a BMP file mapped into memory. The pixel rows are
+// exposed in place as a strided view: row i starts at pixels + i * stride,
+// and stride already accounts for the padding at the end of each row. Rows
+// are indexed in the order they are stored, which is bottom row first unless
+// topDown is set.
+struct BMPImage {
+    struct Header header;
+    struct InfoHeader info;
+    unsigned char *map;        // Start of the mapped file (header bytes)
+    size_t mapSize;            // Size of the mapping in bytes
+    unsigned char *pixels;     // First byte of the first stored row
+    size_t stride;             // Bytes per stored row, including padding
+    int width;                 // Image width in pixels
+    int height;                // Image height in pixels
+    int padding;               // Padding bytes at the end of each row
+    int pixelBytes;            // 3 for BGR pixels, 4 for BGRA
+    int topDown;               // Rows are stored top first (negative height)
+    int decoded;               // map holds a decoded RLE file, not a mapping
+};
+
+// bmpRow - Returns a pointer to the first (blue) byte of stored row i.
+static inline const unsigned char *bmpRow(const struct BMPImage *image, int i)
+{
+    return image->pixels + (size_t)i * image->stride;
+}
+
+// imageRow - Returns a pointer to the first (blue) byte of row y of a view.
+static inline unsigned char *imageRow(const struct Image *image, int y)
+{
+    return image->data + (ptrdiff_t)y * image->stride;
+}
+
+// bmpView - Fills in a view of pixels laid out like the rows of image, in
+// the order they are stored. The command line filters these views, so
+// row numbers (and noise keys) are the stored row numbers.
+static inline void bmpView(const struct BMPImage *image, unsigned char *pixels,
+                           struct Image *view)
+{
+    view->width = image->width;
+    view->height = image->height;
+    view->stride = (ptrdiff_t)image->stride;
+    view->format = image->pixelBytes;
+    view->data = pixels;
+}
+
+// flipView - Reverses the row order of a view: its last row becomes row 0.
+static inline void flipView(struct Image *view)
+{
+    view->data += (ptrdiff_t)(view->height - 1) * view->stride;
+    view->stride = -view->stride;
+}
+
+// Command line options that may follow the input file name.
+struct Options {
+    int stream;                // --stream: edge with a rolling three-row window
+    int overlap;               // --overlap: read, filter and write bands concurrently
+    int threads;               // --threads N: worker threads (default: all cores)
+    int isa;                   // --isa NAME: highest SIMD level to use
+    uint64_t seed;             // --seed N: noise generator key
+    double stddev;             // --stddev S: noise level (0 = prompt for it)
+    const char *outDir;        // --out DIR: batch output directory
+    const char *outFile;       // -o FILE: pipe output file
+    int format;                // --format: read output format (DumpFormat)
+    int regionX, regionY;      // --rows/--rect: first column and row to read
+    int regionW, regionH;      // --rows/--rect: columns and rows (-1 = to the end)
+    const char *sizes;         // --sizes LIST: benchmark image sizes in megapixels
+    int reps;                  // --reps N: timed benchmark runs
+    int warmup;                // --warmup N: untimed benchmark runs
+    int jobs;                  // --jobs N: images processed at once in batch
+    int stats;                 // --stats[=json]: StatsFormat to report in
+    double scale;              // --scale S: conv weight multiplier (0 = normalize)
+    double bias;               // --bias B: conv value added after scaling
+    int hugePages;             // --hugepages: back image buffers with huge pages
+    int direct;                // --direct: preallocate outputs and write with O_DIRECT
+    const char *cacheDir;      // --cache DIR: result cache directory
+    unsigned long long cacheLimit; // --cache-size MB: bytes the cache may hold
+    double sigma;              // --sigma S: canny smoothing
+    int low, high;             // --low/--high T: canny hysteresis thresholds
+    int border;                // --border replicate|reflect: canny Border policy
+    int bits;                  // --bits 1|8: canny output bits per pixel
+    int radius;                // --radius R: denoise and blur window radius
+    int rle;                   // --rle: canny output compressed with RLE8
+    int levels;                // --levels N: pyramid levels (0 = down to 1x1)
+    int resizeWidth, resizeHeight; // --size WxH: resize output size (0 = use factor)
+    double factor;             // --factor F: resize scale
+    const char *refFile;       // --ref FILE: stats reference image
+};
+
+// How filters treat pixels outside the image. Replicate repeats the edge
+// pixel; reflect mirrors about it, so index -1 reads index 1.
+enum Border { BORDER_REPLICATE, BORDER_REFLECT };
+
+// How --stats output is printed.
+enum StatsFormat { STATS_OFF, STATS_TEXT, STATS_JSON };
+
+// Phases timed by --stats.
+enum Phase { PHASE_DECODE, PHASE_COMPUTE, PHASE_ENCODE, PHASES };
+
+// Alignment of arena allocations: a cache line, and the widest vector.
+#define ARENA_ALIGN 64
+
+// Most levels a pyramid can have: enough to halve any image down to 1x1.
+#define PYRAMID_LEVELS 31
+
+// Size of a transparent huge page, and the smallest block that asks for them.
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// Block allocated when an arena ran out of room. The header takes the first
+// ARENA_ALIGN bytes so the memory after it stays aligned.
+struct ArenaBlock {
+    struct ArenaBlock *next;
+};
+
+// Bump allocator for the buffers of one image. arenaAlloc hands out
+// 64-byte-aligned pieces of one contiguous block and arenaReset takes them
+// all back at once. A request that does not fit gets a block of its own,
+// and the next reset replaces the main block with one large enough for
+// everything, so once the largest image has been seen no further
+// allocations are made.
+struct Arena {
+    unsigned char *base;       // Main block
+    size_t size;               // Bytes in the main block
+    size_t used;               // Bytes of the main block handed out
+    size_t needed;             // Bytes requested since the last reset
+    struct ArenaBlock *overflow; // Blocks allocated since the last reset
+    int hugePages;             // --hugepages: ask for transparent huge pages
+};
+
+// Buffers reused from one image to the next, plus I/O counters.
+struct Workspace {
+    struct Arena arena;        // Output rows and per-worker scratch
+    unsigned long long bytesRead;
+    unsigned long long bytesWritten;
+    int timed;                 // Record phase timings (--stats)
+    double seconds[PHASES];    // Time spent in each Phase while timed
+    int direct;                // Write outputs with O_DIRECT (--direct)
+    const char *cacheDir;      // Result cache directory (--cache), or NULL
+    unsigned long long cacheLimit; // Bytes the cache may hold
+    unsigned long long cacheUsed;  // Bytes at the last scan plus those stored since
+    int cacheScanned;          // cacheUsed has been counted by cacheEvict
+    unsigned long cacheHits;   // Results taken from the cache
+    unsigned long cacheMisses; // Results computed and added to the cache
+};
+
+// Alignment O_DIRECT needs for file offsets, lengths and buffer addresses.
+#define DIRECT_ALIGN 4096
+
+// Output image written band by band: each band task writes its finished
+// rows with pwrite at their offset in the file. Bands cover disjoint byte
+// ranges, so workers write at the same time without locking.
+struct BandWriter {
+    int fd;                    // Output file
+    int directFd;              // The same file opened with O_DIRECT, or -1
+    const unsigned char *pixels; // First pixel row in memory
+    size_t headerSize;         // File offset of the first pixel row
+    size_t stride;             // Bytes per row, in memory and in the file
+    size_t size;               // Bytes in the whole file
+    int error;                 // errno of the first failed write, or 0
+};
+
+// Bands in flight in an --overlap run, and the size each band aims for.
+#define OVERLAP_SLOTS 4
+#define OVERLAP_BAND_BYTES ((size_t)4 << 20)
+
+// Stages a band goes through in an --overlap run. A slot is handed from the
+// reader to the filter to the writer and then back to the reader.
+enum SlotState { SLOT_FREE, SLOT_READ, SLOT_FILTERED };
+
+// Buffers for one band in flight.
+struct OverlapSlot {
+    int state;                 // SlotState
+    unsigned char *in;         // Source rows first-1 .. last, stride bytes apart
+    unsigned char *outBase;    // Page-aligned room for the filtered rows
+    unsigned char *out;        // Filtered rows first .. last-1 within outBase
+};
+
+// Shared state of an --overlap run: a reader thread, the thread pool and a
+// writer thread work on different bands at the same time, passing them
+// through a fixed ring of slots so memory stays bounded.
+struct OverlapJob {
+    const struct BMPImage *layout; // Geometry of the image (no pixels)
+    int fd;                    // Input file
+    int edge;                  // 1 for the edge filter, 0 for noise
+    uint64_t seed;             // Noise generator key
+    double stddev;             // Noise standard deviation
+    int bandRows;              // Rows per band (the last band may be shorter)
+    int bands;                 // Number of bands
+    struct OverlapSlot slots[OVERLAP_SLOTS];
+    struct BandWriter writer;  // Output file
+    double *samples;           // One row of noise samples per worker
+    size_t rowSamples;         // Samples per worker in samples
+    int band;                  // Band being filtered
+    int taskRows;              // Rows per pool task within the band
+    pthread_mutex_t lock;      // Protects the slot states and failed
+    pthread_cond_t changed;    // Signalled when a slot changes state
+    int failed;                // Set to stop every stage after an error
+    int timed;                 // Time the reader and writer (--stats)
+    double readSeconds;        // Time the reader spent reading
+    double writeSeconds;       // Time the writer spent writing
+};
+
+
+// SIMD instruction set levels, in increasing order of capability.
+enum SimdLevel { ISA_SCALAR, ISA_SSE2, ISA_AVX2, ISA_AVX512 };
+
+// Kernel computing the edge filter for bytes [begin, end) of a row.
+typedef void (*EdgeSpan)(const unsigned char *above, const unsigned char *row,
+                         const unsigned char *below, unsigned char *out,
+                         int begin, int end);
+
+// Kernel computing the median of a 3x3 or 5x5 window for bytes [begin, end)
+// of a row. rows[y] is the source row under window row y, and horizontal
+// neighbours are pitch bytes apart.
+typedef void (*MedianSpan)(const unsigned char *const *rows, unsigned char *out,
+                           int begin, int end, int pitch);
+
+// Kernel averaging 2x2 blocks for bytes [begin, end) of a pair of rows a
+// and b: each output byte is the rounded mean of a byte, the byte one pixel
+// (pitch bytes) to its right, and the two bytes below them.
+typedef void (*HalveSpan)(const unsigned char *a, const unsigned char *b,
+                          unsigned char *out, int begin, int end, int pitch);
+
+// Task function run by a thread pool: index is the task number and worker
+// identifies the thread running it (0 .. threads-1).
+typedef void (*PoolTask)(void *arg, int index, int worker);
+
+// Range of task indices owned by one worker. The owner takes tasks from the
+// front; idle workers steal the back half.
+struct WorkQueue {
+    pthread_mutex_t lock;
+    int next;                  // Next task the owner will run
+    int end;                   // One past the last task in the range
+    struct ThreadPool *pool;   // Pool the owning worker belongs to
+    int worker;                // Index of the owning worker
+};
+
+// Persistent pool of worker threads. The thread calling poolRun takes part
+// as worker 0, so a pool of one thread runs everything inline.
+struct ThreadPool {
+    int threads;               // Number of workers including the caller
+    pthread_t *workers;        // threads - 1 helper threads
+    struct WorkQueue *queues;  // One queue per worker
+    pthread_mutex_t lock;      // Protects the fields below
+    pthread_cond_t start;      // Signalled when a new job is posted
+    pthread_cond_t done;       // Signalled when the last helper finishes
+    PoolTask task;             // Task function of the current job
+    void *arg;                 // Argument of the current job
+    unsigned long generation;  // Incremented for every job
+    int active;                // Helpers still working on the current job
+    int shutdown;              // Set to stop the helpers
+};
+
+// Output formats of the read operation.
+enum DumpFormat { DUMP_TEXT, DUMP_CSV, DUMP_BINARY };
+
+// Buffered output for the read operation. Numbers are formatted by hand
+// into a large buffer that is written out with one fwrite when it fills.
+struct OutBuffer {
+    FILE *fp;
+    char *data;
+    size_t used;               // Bytes waiting in data
+    size_t size;               // Capacity of data
+};
+
+// Longest request line serve accepts, and descriptors passed per request.
+#define SERVE_LINE 8192
+#define SERVE_FDS 4
+
+// Arena every serve worker starts with, so small images allocate nothing.
+#define SERVE_ARENA_BYTES ((size_t)8 << 20)
+
+// Shared state of the serve operation. Each worker accepts connections on
+// the listening socket and runs their requests with its own single-thread
+// pool and warm workspace.
+struct ServeJob {
+    int listener;              // Listening Unix domain socket
+    const struct Options *opts;
+    struct ThreadPool **inlinePools; // One single-thread pool per worker
+    struct Workspace *workspaces;    // One workspace per worker
+    int workers;               // Threads of the serving pool
+    int *connections;          // Connection each worker serves, or -1
+    pthread_mutex_t lock;      // Protects connections
+    int stopping;              // Set by a quit request
+};
+
+// Largest Gaussian radius canny uses: 3 sigma for sigma up to 5.
+#define CANNY_RADIUS 15
+
+// Passes of the canny operation. Each runs band-parallel over the image and
+// finishes before the next starts, since every pass reads the rows around
+// its band from the pass before.
+enum CannyPass {
+    CANNY_BLUR_ROWS,           // Luma and horizontal Gaussian
+    CANNY_BLUR_COLUMNS,        // Vertical Gaussian
+    CANNY_GRADIENT,            // Sobel magnitude and direction sector
+    CANNY_SUPPRESS,            // Non-maximum suppression and thresholds
+    CANNY_TRACE,               // Hysteresis within each band
+    CANNY_LINK,                // Hysteresis across band boundaries
+    CANNY_PACK,                // Edge map to output rows, written per band
+    CANNY_RLE                  // Output rows to RLE8, encoded per band
+};
+
+// Kinds of stage a pipe can run.
+enum StageKind { STAGE_EDGE, STAGE_NOISE };
+
+// One stage of a pipe, as parsed from "name[:key=value...]".
+struct Stage {
+    int kind;                  // STAGE_EDGE or STAGE_NOISE
+    double sigma;              // Noise standard deviation
+    uint64_t seed;             // Noise generator key for this stage
+};
+
+// Largest kernel width and height accepted by conv.
+#define MAX_KERNEL 15
+
+// Convolution kernel of odd size, applied to each channel as
+// clamp(scale * sum(weight * pixel) + bias).
+struct Kernel {
+    int size;                  // Width and height
+    float weights[MAX_KERNEL * MAX_KERNEL]; // Row-major, top row first
+    float scale;
+    float bias;
+    int separable;             // weights[y][x] == column[y] * row[x]
+    float column[MAX_KERNEL];  // Vertical factor of a separable kernel
+    float row[MAX_KERNEL];     // Horizontal factor of a separable kernel
 };
 
 // Function prototypes
-int readOperation(const char *inputFile, const char *outputFile);
-int edgeOperation(const char *inputFile);
-int noiseOperation(const char *inputFile);
-double generateGaussian(double mean, double stddev);
-unsigned char clamp(int value);
+static CLI_ONLY int parseOptions(int argc, char *argv[], int first, struct Options *opts);
+static void decodeHeader(const unsigned char *buffer, struct Header *header,
+                         struct InfoHeader *info);
+static int validateHeader(const unsigned char *buffer, size_t size,
+                          const struct Header *header, const struct InfoHeader *info,
+                          const char *fileName);
+static void bmpLayout(struct BMPImage *image);
+static int loadBMP(const char *fileName, struct BMPImage *image);
+static void unloadBMP(struct BMPImage *image);
+static void outputFileName(const char *inputFile, const char *suffix,
+                           char *outFilename, size_t size);
+static long peakRSS(void);
+static double monotonicSeconds(void);
+static void *arenaAlloc(struct Arena *arena, size_t size);
+static void arenaReset(struct Arena *arena);
+static void arenaFree(struct Arena *arena);
+static void initWorkspace(struct Workspace *ws, const struct Options *opts);
+static void freeWorkspace(struct Workspace *ws);
+static void printStats(const char *operation, const struct Workspace *ws, int count,
+                       int format);
+static unsigned char *outputPixels(struct Workspace *ws, const unsigned char *header,
+                                   size_t headerSize, size_t size);
+static int openBandWriter(struct BandWriter *writer, const char *outFilename,
+                          const unsigned char *header, size_t headerSize,
+                          const unsigned char *pixels, size_t stride, int height,
+                          int direct);
+static void writeRows(struct BandWriter *writer, const unsigned char *rows, int first,
+                      int last);
+static void writeBand(struct BandWriter *writer, int first, int last);
+static int closeBandWriter(struct BandWriter *writer, struct Workspace *ws);
+static uint64_t hashBytes(const void *data, size_t size, uint64_t seed);
+static int cacheFetch(struct Workspace *ws, const struct BMPImage *image, uint64_t params,
+                      const char *outFilename, uint64_t *key);
+static void cacheStore(struct Workspace *ws, uint64_t key, const char *outFilename);
+static int readOperation(const char *inputFile, const char *outputFile,
+                         const struct Options *opts);
+static CLI_ONLY int edgeOperation(const char *inputFile, const struct Options *opts,
+                                  struct ThreadPool *pool);
+static int edgeFile(const char *inputFile, const char *outFilename,
+                    struct ThreadPool *pool, struct Workspace *ws);
+static int edgeStreamOperation(const char *inputFile, struct Workspace *ws);
+static int overlapFile(const char *inputFile, const char *outFilename, int edge,
+                       uint64_t seed, double stddev, struct ThreadPool *pool,
+                       struct Workspace *ws);
+static void edgeRow(const unsigned char *above, const unsigned char *row,
+                    const unsigned char *below, unsigned char *out, int width,
+                    int pixelBytes);
+static int selectKernels(int limit);
+
+static void edgeSpanScalar(const unsigned char *above, const unsigned char *row,
+                           const unsigned char *below, unsigned char *out,
+                           int begin, int end);
+
+static void edgeSpan32Scalar(const unsigned char *above, const unsigned char *row,
+                             const unsigned char *below, unsigned char *out,
+                             int begin, int end);
+
+static void medianSpan3Scalar(const unsigned char *const *rows, unsigned char *out,
+                              int begin, int end, int pitch);
+
+static void medianSpan5Scalar(const unsigned char *const *rows, unsigned char *out,
+                              int begin, int end, int pitch);
+
+// Edge kernels chosen by selectKernels, for BGR and BGRA rows.
+static EdgeSpan edgeSpan = edgeSpanScalar;
+static EdgeSpan edgeSpan32 = edgeSpan32Scalar;
+
+// Median kernels chosen by selectKernels, for 3x3 and 5x5 windows.
+static MedianSpan medianSpan3 = medianSpan3Scalar;
+static MedianSpan medianSpan5 = medianSpan5Scalar;
+
+static void halveSpanScalar(const unsigned char *a, const unsigned char *b,
+                            unsigned char *out, int begin, int end, int pitch);
+
+// 2x2 averaging kernel chosen by selectKernels.
+static HalveSpan halveSpan = halveSpanScalar;
+
+static CLI_ONLY int noiseOperation(const char *inputFile, const struct Options *opts,
+                                   struct ThreadPool *pool);
+static int noiseFile(const char *inputFile, const char *outFilename, uint64_t seed,
+                     double stddev, struct ThreadPool *pool, struct Workspace *ws);
+static CLI_ONLY int batchOperation(const char *list, const char *operation,
+                                   const struct Options *opts);
+static CLI_ONLY int serveOperation(const char *socketPath, const struct Options *opts);
+static int parseStages(const char *spec, uint64_t seed, struct Stage *stages, int max);
+static CLI_ONLY int pipeOperation(const char *inputFile, const char *spec,
+                                  const struct Options *opts, struct ThreadPool *pool);
+static int parseKernel(const char *spec, double scale, double bias, struct Kernel *kernel);
+static CLI_ONLY int convolveOperation(const char *inputFile, const char *spec,
+                                      const struct Options *opts, struct ThreadPool *pool);
+static int convolveFile(const char *inputFile, const char *outFilename,
+                        const struct Kernel *kernel, struct ThreadPool *pool,
+                        struct Workspace *ws);
+static CLI_ONLY int cannyOperation(const char *inputFile, const struct Options *opts,
+                                   struct ThreadPool *pool);
+static CLI_ONLY int denoiseOperation(const char *inputFile, const struct Options *opts,
+                                     struct ThreadPool *pool);
+static CLI_ONLY int blurOperation(const char *inputFile, const struct Options *opts,
+                                  struct ThreadPool *pool);
+static CLI_ONLY int pyramidOperation(const char *inputFile, const struct Options *opts);
+static CLI_ONLY int resizeOperation(const char *inputFile, const struct Options *opts,
+                                    struct ThreadPool *pool);
+static CLI_ONLY int statsOperation(const char *inputFile, const struct Options *opts,
+                                   struct ThreadPool *pool);
+static void encodeHeader(unsigned char *buffer, int width, int height, int pixelBytes);
+static CLI_ONLY int benchOperation(const struct Options *opts, struct ThreadPool *pool,
+                                   int isa);
+static void philox4x32(uint64_t counter, uint64_t seed, uint32_t out[4]);
+static void noiseRow(const unsigned char *src, unsigned char *dst, int count,
+                     uint64_t first, uint64_t seed, double stddev, double *scratch,
+                     int pixelBytes);
+static void poolRun(struct ThreadPool *pool, int count, PoolTask task, void *arg);
+static unsigned char clamp(int value);
 
 //
 // main - Parses command line arguments and calls the appropriate operation
 //
+#ifndef BMP_LIBRARY
 int main(int argc, char *argv[])
 {
-    // Seed the random number generator (used for noise generation)
-    srand((unsigned)time(NULL));
+    // The benchmark is the only operation without an input file.
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 2, &opts) != 0) {
+            fprintf(stderr, "Usage for bench: %s bench [--sizes 1,2,4,8] [--reps N]"
+                    " [--warmup N] [--dir DIR] [-o results.json] [--threads N]"
+                    " [--isa NAME]\n", argv[0]);
+            exit(1);
+        }
+        int isa = selectKernels(opts.isa);
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = benchOperation(&opts, pool, isa);
+        poolDestroy(pool);
+        return status;
+    }
 
     // Check for at least 3 arguments (operation and input file).
     if (argc < 3) {
@@ -89,519 +647,7013 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
-    // Determine which operation to perform (read, edge, or noise)
-    if (strcmp(argv[1], "read") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Usage for read: %s read <input.bmp> <output.txt>\n", argv[0]);
-            exit(1);
+    // Determine which operation to perform (read, edge, or noise)
+    if (strcmp(argv[1], "read") == 0) {
+        struct Options opts;
+        if (argc < 4 || parseOptions(argc, argv, 4, &opts) != 0) {
+            fprintf(stderr, "Usage for read: %s read <input.bmp> <output.txt>"
+                    " [--format text|csv|bin] [--rows a:b | --rect x,y,w,h] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        return readOperation(argv[2], argv[3], &opts);
+    }
+    else if (strcmp(argv[1], "edge") == 0 || strcmp(argv[1], "noise") == 0) {
+        int edge = strcmp(argv[1], "edge") == 0;
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0) {
+            if (edge) {
+                fprintf(stderr, "Usage for edge: %s edge <input.bmp> [--stream | --overlap]"
+                        " [--threads N] [--isa NAME] [--stats[=json]]\n", argv[0]);
+            }
+            else {
+                fprintf(stderr, "Usage for noise: %s noise <input.bmp> [--stddev S] [--seed N]"
+                        " [--overlap] [--threads N] [--stats[=json]]\n", argv[0]);
+            }
+            exit(1);
+        }
+        selectKernels(opts.isa);
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = edge ? edgeOperation(argv[2], &opts, pool)
+                          : noiseOperation(argv[2], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "pipe") == 0) {
+        struct Options opts;
+        if (argc < 4 || parseOptions(argc, argv, 4, &opts) != 0) {
+            fprintf(stderr, "Usage for pipe: %s pipe <input.bmp> <stage,stage,...>"
+                    " [-o output.bmp] [--seed N] [--threads N] [--stats[=json]]\n"
+                    "Stages: edge, noise[:sigma=S]\n", argv[0]);
+            exit(1);
+        }
+        selectKernels(opts.isa);
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = pipeOperation(argv[2], argv[3], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "conv") == 0) {
+        struct Options opts;
+        if (argc < 4 || parseOptions(argc, argv, 4, &opts) != 0) {
+            fprintf(stderr, "Usage for conv: %s conv <input.bmp> <kernel> [-o output.bmp]"
+                    " [--scale S] [--bias B] [--threads N] [--stats[=json]]\n"
+                    "Kernels: box3, box5, box7, blur3, blur5, blur7, sharpen, edge,"
+                    " sobelx, sobely, a file of weights, or \"a,b,c;d,e,f;g,h,i\"\n",
+                    argv[0]);
+            exit(1);
+        }
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = convolveOperation(argv[2], argv[3], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "canny") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0) {
+            fprintf(stderr, "Usage for canny: %s canny <input.bmp> [-o output.bmp]"
+                    " [--sigma S] [--low T] [--high T] [--border replicate|reflect]"
+                    " [--bits 1|8] [--rle] [--threads N] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = cannyOperation(argv[2], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "denoise") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0) {
+            fprintf(stderr, "Usage for denoise: %s denoise <input.bmp> [-o output.bmp]"
+                    " [--radius R] [--border replicate|reflect] [--threads N]"
+                    " [--isa NAME] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        selectKernels(opts.isa);
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = denoiseOperation(argv[2], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "blur") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0) {
+            fprintf(stderr, "Usage for blur: %s blur <input.bmp> [-o output.bmp]"
+                    " [--radius R] [--border replicate|reflect] [--threads N]"
+                    " [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = blurOperation(argv[2], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "pyramid") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0) {
+            fprintf(stderr, "Usage for pyramid: %s pyramid <input.bmp> [--levels N]"
+                    " [--isa NAME] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        selectKernels(opts.isa);
+        return pyramidOperation(argv[2], &opts);
+    }
+    else if (strcmp(argv[1], "resize") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0 ||
+            (opts.resizeWidth == 0) == (opts.factor == 0)) {
+            fprintf(stderr, "Usage for resize: %s resize <input.bmp> --size WxH | --factor F"
+                    " [-o output.bmp] [--threads N] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = resizeOperation(argv[2], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "stats") == 0) {
+        struct Options opts;
+        if (parseOptions(argc, argv, 3, &opts) != 0) {
+            fprintf(stderr, "Usage for stats: %s stats <input.bmp> [--ref reference.bmp]"
+                    " [-o output.json] [--threads N] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        struct ThreadPool *pool = poolCreate(opts.threads);
+        if (pool == NULL) {
+            exit(1);
+        }
+        int status = statsOperation(argv[2], &opts, pool);
+        poolDestroy(pool);
+        return status;
+    }
+    else if (strcmp(argv[1], "batch") == 0) {
+        struct Options opts;
+        if (argc < 4 || parseOptions(argc, argv, 4, &opts) != 0) {
+            fprintf(stderr, "Usage for batch: %s batch <manifest.txt | directory> <edge | noise>"
+                    " [--out DIR] [--jobs N] [--stddev S] [--seed N] [--stats[=json]]\n", argv[0]);
+            exit(1);
+        }
+        selectKernels(opts.isa);
+        return batchOperation(argv[2], argv[3], &opts);
+    }
+    else if (strcmp(argv[1], "serve") == 0) {
+        struct Options opts;
+        if (argc < 3 || parseOptions(argc, argv, 3, &opts) != 0) {
+            fprintf(stderr, "Usage for serve: %s serve <socket> [--jobs N] [--seed N]\n"
+                    "Requests, one per line: edge IN OUT | noise IN OUT [stddev=S] [seed=N]"
+                    " | conv IN OUT kernel=K [scale=S] [bias=B] | ping | quit\n", argv[0]);
+            exit(1);
+        }
+        selectKernels(opts.isa);
+        return serveOperation(argv[2], &opts);
+    }
+    else {
+        fprintf(stderr, "Invalid operation: %s\n", argv[1]);
+        exit(1);
+    }
+    return 0;
+}
+#endif
+
+//
+// parseOptions - Parses the optional flags in argv[first..argc-1] into opts.
+// Returns 0 on success, 1 if an unknown option is found.
+//
+static int parseOptions(int argc, char *argv[], int first, struct Options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    opts->threads = cores > 0 ? (int)cores : 1;
+    opts->jobs = opts->threads;
+    opts->regionW = -1;
+    opts->regionH = -1;
+    opts->sizes = "1,2,4,8";
+    opts->reps = 5;
+    opts->warmup = 1;
+    opts->stats = STATS_OFF;
+    opts->cacheLimit = 1ull << 30;
+    opts->sigma = 1.4;
+    opts->low = 50;
+    opts->high = 150;
+    opts->border = BORDER_REPLICATE;
+    opts->bits = 8;
+    opts->radius = 1;
+    opts->isa = ISA_AVX512;
+    opts->seed = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--stream") == 0) {
+            opts->stream = 1;
+        }
+        else if (strcmp(argv[i], "--overlap") == 0) {
+            opts->overlap = 1;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            char *end;
+            long threads = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || threads < 1 || threads > 1024) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[i]);
+                return 1;
+            }
+            opts->threads = (int)threads;
+        }
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            char *end;
+            long jobs = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || jobs < 1 || jobs > 1024) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[i]);
+                return 1;
+            }
+            opts->jobs = (int)jobs;
+        }
+        else if (strcmp(argv[i], "--stddev") == 0 && i + 1 < argc) {
+            char *end;
+            opts->stddev = strtod(argv[++i], &end);
+            if (*end != '\0' ||
+                !(opts->stddev >= NOISE_MIN_STDDEV && opts->stddev <= NOISE_MAX_STDDEV)) {
+                fprintf(stderr, "Standard deviation must be from %d to %d: %s\n",
+                        NOISE_MIN_STDDEV, NOISE_MAX_STDDEV, argv[i]);
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "--scale") == 0 || strcmp(argv[i], "--bias") == 0) &&
+                 i + 1 < argc) {
+            double *value = strcmp(argv[i], "--scale") == 0 ? &opts->scale : &opts->bias;
+            char *end;
+            *value = strtod(argv[++i], &end);
+            if (*end != '\0' || argv[i][0] == '\0' || !isfinite(*value)) {
+                fprintf(stderr, "Invalid number: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--rle") == 0) {
+            opts->rle = 1;
+        }
+        else if (strcmp(argv[i], "--hugepages") == 0) {
+            opts->hugePages = 1;
+        }
+        else if (strcmp(argv[i], "--direct") == 0) {
+            opts->direct = 1;
+        }
+        else if (strcmp(argv[i], "--sigma") == 0 && i + 1 < argc) {
+            char *end;
+            opts->sigma = strtod(argv[++i], &end);
+            if (*end != '\0' || !(opts->sigma >= 0.5 && opts->sigma <= 5)) {
+                fprintf(stderr, "Sigma must be from 0.5 to 5: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[i], "--low") == 0 || strcmp(argv[i], "--high") == 0) &&
+                 i + 1 < argc) {
+            int *threshold = strcmp(argv[i], "--low") == 0 ? &opts->low : &opts->high;
+            char *end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 1 || value > 2040) {
+                fprintf(stderr, "Threshold must be from 1 to 2040: %s\n", argv[i]);
+                return 1;
+            }
+            *threshold = (int)value;
+        }
+        else if (strcmp(argv[i], "--border") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "replicate") == 0) {
+                opts->border = BORDER_REPLICATE;
+            }
+            else if (strcmp(argv[i], "reflect") == 0) {
+                opts->border = BORDER_REFLECT;
+            }
+            else {
+                fprintf(stderr, "Unknown border policy: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--radius") == 0 && i + 1 < argc) {
+            char *end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 1 || value > 1000) {
+                fprintf(stderr, "Radius must be from 1 to 1000: %s\n", argv[i]);
+                return 1;
+            }
+            opts->radius = (int)value;
+        }
+        else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+            char *end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 1 || value > PYRAMID_LEVELS) {
+                fprintf(stderr, "Levels must be from 1 to %d: %s\n", PYRAMID_LEVELS, argv[i]);
+                return 1;
+            }
+            opts->levels = (int)value;
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            char *end;
+            long width = strtol(argv[++i], &end, 10);
+            long height = *end == 'x' ? strtol(end + 1, &end, 10) : 0;
+            if (*end != '\0' || width < 1 || width > 65536 || height < 1 || height > 65536) {
+                fprintf(stderr, "Size must be WxH, each from 1 to 65536: %s\n", argv[i]);
+                return 1;
+            }
+            opts->resizeWidth = (int)width;
+            opts->resizeHeight = (int)height;
+        }
+        else if (strcmp(argv[i], "--factor") == 0 && i + 1 < argc) {
+            char *end;
+            opts->factor = strtod(argv[++i], &end);
+            if (*end != '\0' || !(opts->factor >= 0.001 && opts->factor <= 64)) {
+                fprintf(stderr, "Factor must be from 0.001 to 64: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--bits") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "1") != 0 && strcmp(argv[i], "8") != 0) {
+                fprintf(stderr, "Output bits must be 1 or 8: %s\n", argv[i]);
+                return 1;
+            }
+            opts->bits = atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            opts->cacheDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            char *end;
+            unsigned long long megabytes = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || megabytes < 1 || megabytes > (1ull << 30)) {
+                fprintf(stderr, "Invalid cache size: %s\n", argv[i]);
+                return 1;
+            }
+            opts->cacheLimit = megabytes << 20;
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            opts->outDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0 || strcmp(argv[i], "--stats=text") == 0) {
+            opts->stats = STATS_TEXT;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0) {
+            opts->stats = STATS_JSON;
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            opts->outDir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            opts->sizes = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--reps") == 0 || strcmp(argv[i], "--warmup") == 0) &&
+                 i + 1 < argc) {
+            int *count = strcmp(argv[i], "--reps") == 0 ? &opts->reps : &opts->warmup;
+            char *end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < (count == &opts->reps) || value > 1000) {
+                fprintf(stderr, "Invalid run count: %s\n", argv[i]);
+                return 1;
+            }
+            *count = (int)value;
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            opts->outFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--ref") == 0 && i + 1 < argc) {
+            opts->refFile = argv[++i];
+        }
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "text") == 0) {
+                opts->format = DUMP_TEXT;
+            }
+            else if (strcmp(argv[i], "csv") == 0) {
+                opts->format = DUMP_CSV;
+            }
+            else if (strcmp(argv[i], "bin") == 0) {
+                opts->format = DUMP_BINARY;
+            }
+            else {
+                fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--rows") == 0 && i + 1 < argc) {
+            int first, last, used = 0;
+            if (sscanf(argv[++i], "%d:%d%n", &first, &last, &used) != 2 ||
+                argv[i][used] != '\0' || first < 0 || last < first) {
+                fprintf(stderr, "Invalid row range (expected a:b): %s\n", argv[i]);
+                return 1;
+            }
+            opts->regionX = 0;
+            opts->regionW = -1;
+            opts->regionY = first;
+            opts->regionH = last - first;
+        }
+        else if (strcmp(argv[i], "--rect") == 0 && i + 1 < argc) {
+            int used = 0;
+            if (sscanf(argv[++i], "%d,%d,%d,%d%n", &opts->regionX, &opts->regionY,
+                       &opts->regionW, &opts->regionH, &used) != 4 || argv[i][used] != '\0' ||
+                opts->regionX < 0 || opts->regionY < 0 ||
+                opts->regionW < 0 || opts->regionH < 0) {
+                fprintf(stderr, "Invalid rectangle (expected x,y,w,h): %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            char *end;
+            opts->seed = strtoull(argv[++i], &end, 0);
+            if (*end != '\0' || argv[i][0] == '\0') {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--isa") == 0 && i + 1 < argc) {
+            static const char *names[] = { "scalar", "sse2", "avx2", "avx512" };
+            opts->isa = -1;
+            i++;
+            for (int k = 0; k < 4; k++) {
+                if (strcmp(argv[i], names[k]) == 0) {
+                    opts->isa = k;
+                }
+            }
+            if (opts->isa < 0) {
+                fprintf(stderr, "Unknown instruction set: %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//
+// decodeHeader - Decodes the 54-byte BMP header (file header followed by the
+// info header) field-by-field from little-endian bytes.
+//
+static void decodeHeader(const unsigned char *buffer, struct Header *header,
+                         struct InfoHeader *info)
+{
+    // Decode the BMP Header fields from the buffer (little endian)
+    header->type = buffer[0] | (buffer[1] << 8);
+    header->size = buffer[2] | (buffer[3] << 8) |
+                   (buffer[4] << 16) | ((unsigned)buffer[5] << 24);
+    header->reserved1 = buffer[6] | (buffer[7] << 8);
+    header->reserved2 = buffer[8] | (buffer[9] << 8);
+    header->offset = buffer[10] | (buffer[11] << 8) |
+                     (buffer[12] << 16) | ((unsigned)buffer[13] << 24);
+
+    // Decode the BMP InfoHeader fields
+    info->size = buffer[14] | (buffer[15] << 8) |
+                 (buffer[16] << 16) | ((unsigned)buffer[17] << 24);
+    info->width = buffer[18] | (buffer[19] << 8) |
+                  (buffer[20] << 16) | ((unsigned)buffer[21] << 24);
+    info->height = buffer[22] | (buffer[23] << 8) |
+                   (buffer[24] << 16) | ((unsigned)buffer[25] << 24);
+    info->planes = buffer[26] | (buffer[27] << 8);
+    info->bits = buffer[28] | (buffer[29] << 8);
+    info->compression = buffer[30] | (buffer[31] << 8) |
+                        (buffer[32] << 16) | ((unsigned)buffer[33] << 24);
+    info->imageSize = buffer[34] | (buffer[35] << 8) |
+                      (buffer[36] << 16) | ((unsigned)buffer[37] << 24);
+    info->xResolution = buffer[38] | (buffer[39] << 8) |
+                        (buffer[40] << 16) | ((unsigned)buffer[41] << 24);
+    info->yResolution = buffer[42] | (buffer[43] << 8) |
+                        (buffer[44] << 16) | ((unsigned)buffer[45] << 24);
+    info->colors = buffer[46] | (buffer[47] << 8) |
+                   (buffer[48] << 16) | ((unsigned)buffer[49] << 24);
+    info->importantColors = buffer[50] | (buffer[51] << 8) |
+                            (buffer[52] << 16) | ((unsigned)buffer[53] << 24);
+}
+
+//
+// readLE32 - Reads a little-endian 32-bit value.
+//
+static uint32_t readLE32(const unsigned char *bytes)
+{
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+//
+// writeLE32 - Writes a little-endian 32-bit value.
+//
+static void writeLE32(unsigned char *bytes, uint32_t value)
+{
+    for (int b = 0; b < 4; b++) {
+        bytes[b] = (unsigned char)(value >> (8 * b));
+    }
+}
+
+//
+// validateHeader - Checks that a decoded header describes an image this
+// program can process: uncompressed 24-bit BGR, or 32-bit BGRA (BI_RGB, or
+// BI_BITFIELDS with the standard BGRA masks), with a BITMAPINFOHEADER or a
+// larger V2-V5 header, stored bottom-up or top-down. buffer holds the first
+// size bytes of the file. Returns 0 if it does, 1 (with a message) otherwise.
+//
+static int validateHeader(const unsigned char *buffer, size_t size,
+                          const struct Header *header, const struct InfoHeader *info,
+                          const char *fileName)
+{
+    if (buffer[0] != 'B' || buffer[1] != 'M') {
+        fprintf(stderr, "Error: %s is not a BMP file.\n", fileName);
+        return 1;
+    }
+    if (info->size != 40 && info->size != 52 && info->size != 56 &&
+        info->size != 108 && info->size != 124) {
+        fprintf(stderr, "Error: unsupported BMP info header size %u.\n", info->size);
+        return 1;
+    }
+    if (header->offset < 14 + info->size || header->offset > size) {
+        fprintf(stderr, "Error: invalid BMP pixel data offset %u.\n", header->offset);
+        return 1;
+    }
+    int bitfields = info->bits == 32 && info->compression == 3;
+    if (info->compression == 1 || info->compression == 2) {
+        fprintf(stderr, "Error: RLE-compressed BMP images are only supported when the "
+                "whole file is loaded (not with --stream, --overlap or in-memory views).\n");
+        return 1;
+    }
+    if (!(info->bits == 24 && info->compression == 0) &&
+        !(info->bits == 32 && info->compression == 0) && !bitfields) {
+        fprintf(stderr, "Error: only uncompressed 24-bit and 32-bit BMP images are supported.\n");
+        return 1;
+    }
+    if (bitfields) {
+        // The red, green and blue masks follow a 40-byte info header, and
+        // are the first fields after it in the larger ones.
+        if (header->offset < 66 || readLE32(buffer + 54) != 0x00FF0000 ||
+            readLE32(buffer + 58) != 0x0000FF00 || readLE32(buffer + 62) != 0x000000FF) {
+            fprintf(stderr, "Error: only BGRA channel masks are supported.\n");
+            return 1;
+        }
+    }
+    if (info->width <= 0 || info->height == 0 || info->height == INT32_MIN) {
+        fprintf(stderr, "Error: invalid BMP dimensions %d x %d.\n",
+                info->width, info->height);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// bmpLayout - Fills in the row layout of an image from its validated info
+// header. A negative height means the rows are stored top-down.
+//
+static void bmpLayout(struct BMPImage *image)
+{
+    image->width = image->info.width;
+    image->topDown = image->info.height < 0;
+    image->height = image->topDown ? -image->info.height : image->info.height;
+    image->pixelBytes = image->info.bits / 8;
+    size_t rowBytes = (size_t)image->width * image->pixelBytes;
+    image->stride = (rowBytes + 3) & ~(size_t)3;
+    image->padding = (int)(image->stride - rowBytes);
+}
+
+//
+// bmpParse - Decodes and validates the header of the BMP file held in the
+// size bytes at data and fills in the header fields, row layout and pixel
+// pointer of image. Returns 0 on success, 1 (with a message) on error.
+//
+static int bmpParse(const unsigned char *data, size_t size, const char *name,
+                    struct BMPImage *image)
+{
+    if (size < BMP_HEADER_SIZE) {
+        fprintf(stderr, "Error reading BMP header.\n");
+        return 1;
+    }
+    decodeHeader(data, &image->header, &image->info);
+    if (validateHeader(data, size, &image->header, &image->info, name) != 0) {
+        return 1;
+    }
+
+    // Calculate the row layout and make sure every row is present. The
+    // pixels start at the offset given in the header, which is past any
+    // larger info header, colour masks or gap.
+    bmpLayout(image);
+    image->pixels = (unsigned char *)data + image->header.offset;
+    if ((size - image->header.offset) / image->stride < (size_t)image->height) {
+        fprintf(stderr, "Error reading pixel data.\n");
+        return 1;
+    }
+    return 0;
+}
+
+// Number of image and I/O buffers allocated, reported by --stats.
+static unsigned long allocationCount;
+
+//
+// countAllocation - Records one buffer allocation. Safe to call from any
+// thread.
+//
+static inline void countAllocation(void)
+{
+    __atomic_fetch_add(&allocationCount, 1, __ATOMIC_RELAXED);
+}
+
+//
+// rleDecode - Expands the BI_RLE8 or BI_RLE4 file held in image->map into
+// a bottom-up 24-bit BMP in memory, which replaces the mapping. Pixels the
+// data skips over (with a delta, or an early end of line or bitmap) take
+// palette entry 0. Returns 0 on success, 1 (with a message) on error.
+//
+static int rleDecode(const char *fileName, struct BMPImage *image)
+{
+    const unsigned char *data = image->map;
+    size_t size = image->mapSize;
+    struct Header header;
+    struct InfoHeader info;
+    decodeHeader(data, &header, &info);
+    int bits = info.compression == 1 ? 8 : 4;
+    size_t palette = BMP_HEADER_SIZE - 40 + (size_t)info.size;
+    unsigned int colors = info.colors != 0 ? info.colors : 1u << bits;
+    if (data[0] != 'B' || data[1] != 'M' || info.bits != bits || info.size < 40 ||
+        info.width <= 0 || info.height <= 0 || colors > (1u << bits) ||
+        header.offset > size || palette + 4 * (size_t)colors > header.offset) {
+        fprintf(stderr, "Error: %s is not a valid %d-bit RLE BMP file.\n", fileName, bits);
+        return 1;
+    }
+
+    // Every two bytes of run data cover at most 255 pixels, so a header
+    // asking for more pixels than that is refused before anything is
+    // allocated for it.
+    int width = info.width, height = info.height;
+    if ((size_t)width * height / 255 > (size - header.offset) / 2) {
+        fprintf(stderr, "Error: %s claims %dx%d pixels, more than its %zu bytes of RLE"
+                " data can describe.\n", fileName, width, height, size - header.offset);
+        return 1;
+    }
+
+    // The decoded file: a fresh header, then rows filled with colour 0.
+    size_t stride = ((size_t)width * 3 + 3) & ~(size_t)3;
+    size_t decodedSize = BMP_HEADER_SIZE + stride * height;
+    unsigned char *decoded = malloc(decodedSize);
+    if (decoded == NULL) {
+        perror("Memory allocation error");
+        return 1;
+    }
+    countAllocation();
+    encodeHeader(decoded, width, height, 3);
+    unsigned char *pixels = decoded + BMP_HEADER_SIZE;
+    const unsigned char *colour = data + palette;
+    for (int y = 0; y < height; y++) {
+        unsigned char *row = pixels + (size_t)y * stride;
+        for (int x = 0; x < width; x++) {
+            memcpy(row + 3 * x, colour, 3);
+        }
+        memset(row + 3 * (size_t)width, 0, stride - 3 * (size_t)width);
+    }
+
+    // Runs of one index (or two alternating nibbles) and escapes: end of
+    // line, end of bitmap, delta, and absolute runs padded to 16 bits.
+    // Pixels past the end of a row are dropped; x never moves past width.
+    size_t p = header.offset;
+    int x = 0, y = 0, status = 1;
+    while (y < height && p + 2 <= size) {
+        int count = data[p], value = data[p + 1];
+        p += 2;
+        if (count == 0 && value == 0) {
+            x = 0;
+            y++;
+            continue;
+        }
+        if (count == 0 && value == 1) {
+            status = 0;
+            break;
+        }
+        if (count == 0 && value == 2) {
+            if (p + 2 > size) {
+                break;
+            }
+            x = width - x < data[p] ? width : x + data[p];
+            y += data[p + 1];
+            p += 2;
+            continue;
+        }
+        const unsigned char *indices = NULL;
+        if (count == 0) {
+            count = value;
+            size_t bytes = bits == 8 ? (size_t)count : ((size_t)count + 1) / 2;
+            if (p + bytes > size) {
+                break;
+            }
+            indices = data + p;
+            p += (bytes + 1) & ~(size_t)1;
+        }
+        unsigned char *row = pixels + (size_t)y * stride;
+        int k = 0;
+        for (; k < count; k++) {
+            int index = indices != NULL ? indices[bits == 8 ? k : k / 2] : value;
+            if (bits == 4) {
+                index = k % 2 == 0 ? index >> 4 : index & 15;
+            }
+            if ((unsigned int)index >= colors) {
+                break;
+            }
+            if (x < width) {
+                memcpy(row + 3 * x, colour + 4 * index, 3);
+                x++;
+            }
+        }
+        if (k < count) {
+            break;
+        }
+    }
+    if (y >= height) {
+        status = 0;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Error reading pixel data.\n");
+        free(decoded);
+        return 1;
+    }
+    munmap(image->map, image->mapSize);
+    image->map = decoded;
+    image->mapSize = decodedSize;
+    image->decoded = 1;
+    return 0;
+}
+
+//
+// loadBMP - Memory-maps a BMP file, validates its header once and fills in a
+// strided view over the pixel rows. The pixels are not copied; they stay in
+// the mapping until unloadBMP is called. Returns 0 on success, 1 on error.
+//
+static int loadBMP(const char *fileName, struct BMPImage *image)
+{
+    memset(image, 0, sizeof(*image));
+
+    // Open the BMP input file and find its size.
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        perror("Error opening input file");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("Error reading input file");
+        close(fd);
+        return 1;
+    }
+    if (st.st_size < BMP_HEADER_SIZE) {
+        fprintf(stderr, "Error reading BMP header.\n");
+        close(fd);
+        return 1;
+    }
+
+    // Map the whole file read-only. The descriptor is not needed afterwards.
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping input file");
+        return 1;
+    }
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    image->map = map;
+    image->mapSize = (size_t)st.st_size;
+
+    // RLE files are expanded to 24-bit pixels, which stand in for the file.
+    unsigned int compression = readLE32(image->map + 30);
+    if ((compression == 1 || compression == 2) && rleDecode(fileName, image) != 0) {
+        unloadBMP(image);
+        return 1;
+    }
+    if (bmpParse(image->map, image->mapSize, fileName, image) != 0) {
+        unloadBMP(image);
+        return 1;
+    }
+    return 0;
+}
+
+//
+// unloadBMP - Releases the mapping (or decoded copy) created by loadBMP.
+//
+static void unloadBMP(struct BMPImage *image)
+{
+    if (image->decoded) {
+        free(image->map);
+    }
+    else if (image->map != NULL) {
+        munmap(image->map, image->mapSize);
+    }
+    memset(image, 0, sizeof(*image));
+}
+
+//
+// outputFileName - Builds the output name by replacing the extension of
+// inputFile with suffix, e.g. ("img.bmp", "-edge.bmp") -> "img-edge.bmp".
+//
+static void outputFileName(const char *inputFile, const char *suffix,
+                           char *outFilename, size_t size)
+{
+    snprintf(outFilename, size, "%s", inputFile);
+    char *dot = strrchr(outFilename, '.');
+    if (dot != NULL) {
+        *dot = '\0';
+    }
+    size_t length = strlen(outFilename);
+    snprintf(outFilename + length, size - length, "%s", suffix);
+}
+
+//
+// peakRSS - Returns the peak resident set size of the process in kilobytes.
+//
+static long peakRSS(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+    return usage.ru_maxrss;
+}
+
+//
+// monotonicSeconds - Returns a monotonic timestamp in seconds.
+//
+static double monotonicSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+//
+// statsMark - Starts timing a phase. Without --stats no clock is read.
+//
+static inline double statsMark(const struct Workspace *ws)
+{
+    return ws->timed ? monotonicSeconds() : 0;
+}
+
+//
+// statsLap - Charges the time since *mark to phase and restarts the mark.
+// Without --stats this is a single test of ws->timed.
+//
+static inline void statsLap(struct Workspace *ws, int phase, double *mark)
+{
+    if (ws->timed) {
+        double now = monotonicSeconds();
+        ws->seconds[phase] += now - *mark;
+        *mark = now;
+    }
+}
+
+//
+// arenaBlock - Allocates a 64-byte-aligned block of at least *size bytes.
+// With hugePages, blocks of a huge page or more are aligned and rounded up
+// to whole huge pages (*size is updated) and the kernel is asked to back
+// them with transparent huge pages, which cuts TLB misses on large images.
+// Returns NULL (with a message) on error.
+//
+static void *arenaBlock(size_t *size, int hugePages)
+{
+    size_t align = ARENA_ALIGN;
+    if (hugePages && *size >= HUGE_PAGE_SIZE) {
+        align = HUGE_PAGE_SIZE;
+        *size = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    }
+    void *block;
+    int error = posix_memalign(&block, align, *size);
+    if (error != 0) {
+        errno = error;
+        perror("Memory allocation error");
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (align == HUGE_PAGE_SIZE) {
+        madvise(block, *size, MADV_HUGEPAGE);
+    }
+#endif
+    countAllocation();
+    return block;
+}
+
+//
+// arenaAlloc - Returns size bytes from the arena, aligned to ARENA_ALIGN.
+// The memory is not cleared and stays valid until the next arenaReset.
+// Returns NULL (with a message) on error.
+//
+static void *arenaAlloc(struct Arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    arena->needed += size;
+    if (size <= arena->size - arena->used) {
+        void *piece = arena->base + arena->used;
+        arena->used += size;
+        return piece;
+    }
+
+    // Out of room: use a block of its own until the next reset.
+    size_t blockSize = ARENA_ALIGN + size;
+    unsigned char *block = arenaBlock(&blockSize, arena->hugePages);
+    if (block == NULL) {
+        return NULL;
+    }
+    struct ArenaBlock *header = (struct ArenaBlock *)block;
+    header->next = arena->overflow;
+    arena->overflow = header;
+    return block + ARENA_ALIGN;
+}
+
+//
+// arenaReset - Takes back everything allocated from the arena. If it had to
+// allocate overflow blocks, the main block is replaced by one that holds
+// all of it, so the next image of the same size fits without allocating.
+//
+static void arenaReset(struct Arena *arena)
+{
+    if (arena->overflow != NULL) {
+        while (arena->overflow != NULL) {
+            struct ArenaBlock *next = arena->overflow->next;
+            free(arena->overflow);
+            arena->overflow = next;
+        }
+        free(arena->base);
+        size_t size = arena->needed;
+        arena->base = arenaBlock(&size, arena->hugePages);
+        arena->size = arena->base != NULL ? size : 0;
+    }
+    arena->used = 0;
+    arena->needed = 0;
+}
+
+//
+// arenaFree - Releases all memory held by an arena.
+//
+static void arenaFree(struct Arena *arena)
+{
+    arena->needed = 0;
+    arenaReset(arena);
+    free(arena->base);
+    arena->base = NULL;
+    arena->size = 0;
+}
+
+//
+// printStats - Prints the --stats report for an operation to stderr. The
+// phase times and byte counts of count workspaces are added together (a
+// batch has one per worker, so its phase times are summed over workers).
+//
+static void printStats(const char *operation, const struct Workspace *ws, int count,
+                       int format)
+{
+    double seconds[PHASES] = { 0 };
+    unsigned long long bytesRead = 0, bytesWritten = 0;
+    unsigned long hits = 0, misses = 0;
+    for (int w = 0; w < count; w++) {
+        for (int p = 0; p < PHASES; p++) {
+            seconds[p] += ws[w].seconds[p];
+        }
+        bytesRead += ws[w].bytesRead;
+        bytesWritten += ws[w].bytesWritten;
+        hits += ws[w].cacheHits;
+        misses += ws[w].cacheMisses;
+    }
+    unsigned long allocations = __atomic_load_n(&allocationCount, __ATOMIC_RELAXED);
+
+    if (format == STATS_JSON) {
+        fprintf(stderr, "{\"op\": \"%s\", \"decode_s\": %.6f, \"compute_s\": %.6f, "
+                "\"encode_s\": %.6f, \"bytes_read\": %llu, \"bytes_written\": %llu, "
+                "\"allocations\": %lu, \"peak_rss_kb\": %ld, \"cache_hits\": %lu, "
+                "\"cache_misses\": %lu}\n", operation,
+                seconds[PHASE_DECODE], seconds[PHASE_COMPUTE], seconds[PHASE_ENCODE],
+                bytesRead, bytesWritten, allocations, peakRSS(), hits, misses);
+    }
+    else {
+        fprintf(stderr, "Stats for %s:\n"
+                "  decode        %.6f s\n"
+                "  compute       %.6f s\n"
+                "  encode        %.6f s\n"
+                "  bytes read    %llu\n"
+                "  bytes written %llu\n"
+                "  allocations   %lu\n"
+                "  peak RSS      %ld KB\n"
+                "  cache hits    %lu\n"
+                "  cache misses  %lu\n", operation,
+                seconds[PHASE_DECODE], seconds[PHASE_COMPUTE], seconds[PHASE_ENCODE],
+                bytesRead, bytesWritten, allocations, peakRSS(), hits, misses);
+    }
+}
+
+//
+// initWorkspace - Sets up an empty workspace for the given options.
+//
+static void initWorkspace(struct Workspace *ws, const struct Options *opts)
+{
+    memset(ws, 0, sizeof(*ws));
+    ws->arena.hugePages = opts->hugePages;
+    ws->timed = opts->stats != STATS_OFF;
+    ws->direct = opts->direct;
+    ws->cacheDir = opts->cacheDir;
+    ws->cacheLimit = opts->cacheLimit;
+}
+
+//
+// freeWorkspace - Releases the buffers held by a workspace.
+//
+static void freeWorkspace(struct Workspace *ws)
+{
+    arenaFree(&ws->arena);
+    memset(ws, 0, sizeof(*ws));
+}
+
+//
+// outputPixels - Allocates size bytes of output rows from the workspace
+// arena. With --direct the rows are placed where they would fall in a
+// page-aligned copy of the whole file, headerSize bytes of header included,
+// so page-aligned file ranges are page-aligned in memory as O_DIRECT needs.
+//
+static unsigned char *outputPixels(struct Workspace *ws, const unsigned char *header,
+                                   size_t headerSize, size_t size)
+{
+    if (!ws->direct) {
+        return arenaAlloc(&ws->arena, size);
+    }
+    unsigned char *file = arenaAlloc(&ws->arena, DIRECT_ALIGN + headerSize + size);
+    if (file == NULL) {
+        return NULL;
+    }
+    file += -(uintptr_t)file & (DIRECT_ALIGN - 1);
+    memcpy(file, header, headerSize);
+    return file + headerSize;
+}
+
+//
+// writeRange - Writes the bytes [begin, end) of the output file from data
+// with pwrite, retrying short writes. A failure is recorded in the writer
+// and stops later writes; an O_DIRECT write the file system rejects is
+// redone through the ordinary descriptor.
+//
+static void writeRange(struct BandWriter *writer, int fd, const unsigned char *data,
+                       size_t begin, size_t end)
+{
+    while (begin < end && __atomic_load_n(&writer->error, __ATOMIC_RELAXED) == 0) {
+        ssize_t written = pwrite(fd, data, end - begin, (off_t)begin);
+        if (written > 0) {
+            data += written;
+            begin += written;
+        }
+        else if (written < 0 && errno == EINVAL && fd != writer->fd) {
+            fd = writer->fd;
+        }
+        else if (written == 0 || errno != EINTR) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&writer->error, &expected, written == 0 ? EIO : errno,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+//
+// detachOutput - Removes outFilename if it is a hard link to another file,
+// such as a --cache entry, so that writing the output replaces it rather
+// than changing the shared file.
+//
+static void detachOutput(const char *outFilename)
+{
+    struct stat st;
+    if (lstat(outFilename, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1) {
+        unlink(outFilename);
+    }
+}
+
+//
+// openBandWriter - Creates outFilename and writes its headerSize-byte header;
+// the height rows that follow (stride bytes apart in pixels, which comes
+// from outputPixels) are written by writeBand. With direct the file is
+// first allocated at its full size, so concurrent band writes do not
+// fragment it, and a second descriptor is opened with O_DIRECT for the
+// page-aligned middle of each band. File systems without O_DIRECT fall back
+// to ordinary writes. Returns 0 on success.
+//
+static int openBandWriter(struct BandWriter *writer, const char *outFilename,
+                          const unsigned char *header, size_t headerSize,
+                          const unsigned char *pixels, size_t stride, int height,
+                          int direct)
+{
+    writer->pixels = pixels;
+    writer->headerSize = headerSize;
+    writer->stride = stride;
+    writer->size = headerSize + stride * height;
+    writer->directFd = -1;
+    writer->error = 0;
+    detachOutput(outFilename);
+    writer->fd = open(outFilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (writer->fd < 0) {
+        perror("Error creating output file");
+        return 1;
+    }
+
+    if (direct) {
+        int error = posix_fallocate(writer->fd, 0, (off_t)writer->size);
+        if (error != 0 && error != EOPNOTSUPP) {
+            errno = error;
+            perror("Error allocating output file");
+            close(writer->fd);
+            return 1;
+        }
+        writer->directFd = open(outFilename, O_WRONLY | O_DIRECT);
+    }
+
+    writeRange(writer, writer->fd, header, 0, headerSize);
+    return 0;
+}
+
+//
+// writeRows - Writes rows [first, last) of the output file from rows, where
+// they are stored stride bytes apart. With O_DIRECT only whole aligned pages
+// go through the direct descriptor, so rows must have the same alignment
+// as the rows' offset in the file modulo DIRECT_ALIGN; the partial pages
+// at either end, which may be shared with the neighbouring bands, are
+// written through the page cache.
+//
+static void writeRows(struct BandWriter *writer, const unsigned char *rows, int first,
+                      int last)
+{
+    size_t begin = writer->headerSize + (size_t)first * writer->stride;
+    size_t end = writer->headerSize + (size_t)last * writer->stride;
+    const unsigned char *data = rows;
+
+    if (writer->directFd >= 0) {
+        size_t alignedBegin = (begin + DIRECT_ALIGN - 1) & ~(size_t)(DIRECT_ALIGN - 1);
+        size_t alignedEnd = end & ~(size_t)(DIRECT_ALIGN - 1);
+        if (alignedBegin < alignedEnd) {
+            writeRange(writer, writer->fd, data, begin, alignedBegin);
+            data += alignedBegin - begin;
+            writeRange(writer, writer->directFd, data, alignedBegin, alignedEnd);
+            data += alignedEnd - alignedBegin;
+            begin = alignedEnd;
+        }
+    }
+    writeRange(writer, writer->fd, data, begin, end);
+}
+
+//
+// writeBand - Writes rows [first, last) of the output image held by the
+// writer. Called by each band task as soon as its rows are done, so writing
+// overlaps the compute of the other bands.
+//
+static void writeBand(struct BandWriter *writer, int first, int last)
+{
+    writeRows(writer, writer->pixels + (size_t)first * writer->stride, first, last);
+}
+
+//
+// closeBandWriter - Closes the output file once every band has been
+// written and reports the first error seen by any writer. Returns 0 on
+// success.
+//
+static int closeBandWriter(struct BandWriter *writer, struct Workspace *ws)
+{
+    int error = writer->error;
+    if (writer->directFd >= 0 && close(writer->directFd) != 0 && error == 0) {
+        error = errno;
+    }
+    if (close(writer->fd) != 0 && error == 0) {
+        error = errno;
+    }
+    ws->bytesWritten += writer->size;
+    if (error != 0) {
+        errno = error;
+        perror("Error writing output file");
+        return 1;
+    }
+    return 0;
+}
+
+//
+// hashBytes - 64-bit hash of size bytes of data (the XXH64 algorithm),
+// used to key the result cache. Four independent lanes consume 32 bytes per
+// step, so hashing an image runs at close to memory speed.
+//
+static uint64_t hashBytes(const void *data, size_t size, uint64_t seed)
+{
+    const uint64_t p1 = 0x9E3779B185EBCA87ull, p2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t p3 = 0x165667B19E3779F9ull, p4 = 0x85EBCA77C2B2AE63ull;
+    const uint64_t p5 = 0x27D4EB2F165667C5ull;
+    const unsigned char *p = data;
+    const unsigned char *end = p + size;
+    uint64_t h, word;
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+#define XXH_ROUND(acc, input) ((acc) += (input) * p2, (acc) = ROTL64(acc, 31), (acc) *= p1)
+
+    if (size >= 32) {
+        uint64_t v[4] = { seed + p1 + p2, seed + p2, seed, seed - p1 };
+        for (; end - p >= 32; p += 32) {
+            for (int lane = 0; lane < 4; lane++) {
+                memcpy(&word, p + 8 * lane, 8);
+                XXH_ROUND(v[lane], word);
+            }
+        }
+        h = ROTL64(v[0], 1) + ROTL64(v[1], 7) + ROTL64(v[2], 12) + ROTL64(v[3], 18);
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t merged = 0;
+            XXH_ROUND(merged, v[lane]);
+            h = (h ^ merged) * p1 + p4;
+        }
+    }
+    else {
+        h = seed + p5;
+    }
+    h += size;
+
+    for (; end - p >= 8; p += 8) {
+        uint64_t k = 0;
+        memcpy(&word, p, 8);
+        XXH_ROUND(k, word);
+        h ^= k;
+        h = ROTL64(h, 27) * p1 + p4;
+    }
+    if (end - p >= 4) {
+        uint32_t half;
+        memcpy(&half, p, 4);
+        h ^= half * p1;
+        h = ROTL64(h, 23) * p2 + p3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * p5;
+        h = ROTL64(h, 11) * p1;
+    }
+#undef XXH_ROUND
+#undef ROTL64
+
+    h ^= h >> 33;
+    h *= p2;
+    h ^= h >> 29;
+    h *= p3;
+    h ^= h >> 32;
+    return h;
+}
+
+//
+// cachePath - Builds the path of the cache entry for key.
+//
+static void cachePath(const struct Workspace *ws, uint64_t key, char *path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.bmp", ws->cacheDir, (unsigned long long)key);
+}
+
+//
+// cloneFile - Creates dst (which must not exist) with the given mode as a
+// copy of src: a reflink sharing src's storage where the file system
+// supports it, otherwise, if copy is set, a byte copy. Returns 0 on
+// success; on failure dst is removed.
+//
+static int cloneFile(const char *src, const char *dst, int mode, int copy)
+{
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        return 1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (out < 0) {
+        close(in);
+        return 1;
+    }
+
+    int status = 1;
+#ifdef FICLONE
+    status = ioctl(out, FICLONE, in) != 0;
+#endif
+    if (status != 0 && copy) {
+        ssize_t copied;
+        while ((copied = copy_file_range(in, NULL, out, NULL, (size_t)1 << 30, 0)) > 0) {
+        }
+        status = copied != 0;
+    }
+    if (close(out) != 0) {
+        status = 1;
+    }
+    close(in);
+    if (status != 0) {
+        unlink(dst);
+    }
+    return status;
+}
+
+//
+// cacheFetch - Looks up the result of the operation whose parameters hash
+// to params, applied to image, in the --cache directory. On a hit the
+// cached file is placed at outFilename (a reflink where the file system
+// supports it, otherwise a hard link to the read-only entry), the entry is
+// marked as recently used and 0 is returned. Otherwise returns 1. Either way
+// *key is set for cacheStore.
+//
+static int cacheFetch(struct Workspace *ws, const struct BMPImage *image, uint64_t params,
+                      const char *outFilename, uint64_t *key)
+{
+    if (ws->cacheDir == NULL) {
+        return 1;
+    }
+    *key = hashBytes(image->map, image->mapSize, params);
+    char path[4096];
+    cachePath(ws, *key, path, sizeof(path));
+    if (access(path, F_OK) != 0) {
+        ws->cacheMisses++;
+        return 1;
+    }
+
+    unlink(outFilename);
+    if (cloneFile(path, outFilename, 0666, 0) != 0 && link(path, outFilename) != 0) {
+        ws->cacheMisses++;
+        return 1;
+    }
+    // The modification time orders entries for LRU eviction.
+    utimensat(AT_FDCWD, path, NULL, 0);
+    ws->cacheHits++;
+    return 0;
+}
+
+// Cache entry seen while evicting.
+struct CacheEntry {
+    char name[21];             // 16 hex digits, ".bmp" and the terminator
+    unsigned long long size;
+    struct timespec used;      // Last use (modification time)
+};
+
+//
+// compareEntries - qsort comparison putting the least recently used
+// cache entries first.
+//
+static int compareEntries(const void *a, const void *b)
+{
+    const struct CacheEntry *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+//
+// cacheEvict - Removes the least recently used cache entries until the
+// entries left take at most ws->cacheLimit bytes, and records what they
+// take in ws->cacheUsed.
+//
+static void cacheEvict(struct Workspace *ws)
+{
+    DIR *dir = opendir(ws->cacheDir);
+    if (dir == NULL) {
+        return;
+    }
+    struct CacheEntry *entries = NULL;
+    int count = 0, capacity = 0;
+    unsigned long long total = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        struct stat st;
+        if (strlen(entry->d_name) != 20 || strcmp(entry->d_name + 16, ".bmp") != 0 ||
+            fstatat(dirfd(dir), entry->d_name, &st, 0) != 0) {
+            continue;
+        }
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 256;
+            struct CacheEntry *grown = realloc(entries, capacity * sizeof(*entries));
+            if (grown == NULL) {
+                break;
+            }
+            entries = grown;
+        }
+        memcpy(entries[count].name, entry->d_name, sizeof(entries[count].name));
+        entries[count].size = st.st_size;
+        entries[count].used = st.st_mtim;
+        total += st.st_size;
+        count++;
+    }
+
+    if (total > ws->cacheLimit) {
+        qsort(entries, count, sizeof(*entries), compareEntries);
+        for (int i = 0; i < count && total > ws->cacheLimit; i++) {
+            if (unlinkat(dirfd(dir), entries[i].name, 0) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+    ws->cacheUsed = total;
+    ws->cacheScanned = 1;
+    free(entries);
+    closedir(dir);
+}
+
+//
+// cacheStore - Adds outFilename to the cache under key as a read-only
+// reflink or copy, so later writes to the output never reach the cache,
+// then evicts entries beyond the size limit. The directory is scanned on
+// the first store and after that only once the running total passes the
+// limit, so a batch of misses costs no more than a stat each. Entries
+// stored by other workspaces or processes are seen at the next scan. The
+// entry is renamed into place, so concurrent readers never see a partial
+// file. Failures only cost the cache entry.
+//
+static void cacheStore(struct Workspace *ws, uint64_t key, const char *outFilename)
+{
+    static unsigned long sequence;
+    if (ws->cacheDir == NULL) {
+        return;
+    }
+    char path[4096], temp[4096];
+    cachePath(ws, key, path, sizeof(path));
+    snprintf(temp, sizeof(temp), "%s/.tmp-%ld-%lu", ws->cacheDir, (long)getpid(),
+             __atomic_fetch_add(&sequence, 1, __ATOMIC_RELAXED));
+    mkdir(ws->cacheDir, 0777);
+    if (cloneFile(outFilename, temp, 0444, 1) != 0) {
+        return;
+    }
+    if (rename(temp, path) != 0) {
+        unlink(temp);
+        return;
+    }
+    struct stat st;
+    if (ws->cacheScanned && stat(path, &st) == 0) {
+        ws->cacheUsed += st.st_size;
+        if (ws->cacheUsed <= ws->cacheLimit) {
+            return;
+        }
+    }
+    cacheEvict(ws);
+}
+
+//
+// bandRowsFor - Chooses the band height for a band-parallel pass. Using
+// several bands per thread lets work-stealing even out the load.
+//
+static int bandRowsFor(const struct ThreadPool *pool, int height)
+{
+    int bandRows = height / (pool->threads * 8);
+    return bandRows < 1 ? 1 : bandRows;
+}
+
+//
+// outReserve - Makes room for at least need more bytes in an OutBuffer,
+// writing out what is buffered if necessary.
+//
+static inline void outReserve(struct OutBuffer *out, size_t need)
+{
+    if (out->used + need > out->size) {
+        fwrite(out->data, 1, out->used, out->fp);
+        out->used = 0;
+    }
+}
+
+//
+// outString - Appends a string to an OutBuffer.
+//
+static void outString(struct OutBuffer *out, const char *text)
+{
+    size_t length = strlen(text);
+    outReserve(out, length);
+    memcpy(out->data + out->used, text, length);
+    out->used += length;
+}
+
+//
+// outInt - Appends a non-negative integer in decimal. The caller must have
+// reserved room for it.
+//
+static inline void outInt(struct OutBuffer *out, unsigned int value)
+{
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (n > 0) {
+        out->data[out->used++] = digits[--n];
+    }
+}
+
+//
+// outByte3 - Appends a byte value as exactly three digits ("%03d"). The
+// caller must have reserved room for it.
+//
+static inline void outByte3(struct OutBuffer *out, unsigned char value)
+{
+    char *p = out->data + out->used;
+    p[0] = (char)('0' + value / 100);
+    p[1] = (char)('0' + value / 10 % 10);
+    p[2] = (char)('0' + value % 10);
+    out->used += 3;
+}
+
+//
+// readOperation - Performs the "read" operation by reading the BMP header
+// and pixel data then printing the details into an output text file.
+// --format csv writes "row,col,r,g,b" lines and --format bin writes the raw
+// R, G, B bytes of each pixel; both skip the header dump. 32-bit images add
+// alpha as a fourth value (and the text lines start with "RGBA"). Rows are
+// numbered in file order. --rows a:b or --rect x,y,w,h restricts the pixels
+// to a region, which is read directly from the mapped rows it covers.
+//
+static int readOperation(const char *inputFile, const char *outputFile,
+                         const struct Options *opts)
+{
+    // The workspace holds the output buffer and the --stats counters.
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+
+    // Map the BMP input file.
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+
+    // Work out the region to print, clipped to the image.
+    int x0 = opts->regionX, y0 = opts->regionY;
+    int x1 = opts->regionW < 0 || opts->regionW > image.width - x0
+             ? image.width : x0 + opts->regionW;
+    int y1 = opts->regionH < 0 || opts->regionH > image.height - y0
+             ? image.height : y0 + opts->regionH;
+    if (x0 > image.width || y0 > image.height) {
+        fprintf(stderr, "Error: region starts outside the %d x %d image.\n",
+                image.width, image.height);
+        unloadBMP(&image);
+        return 1;
+    }
+
+    // Open the output file (in binary mode for the raw dump).
+    FILE *fp = fopen(outputFile, opts->format == DUMP_BINARY ? "wb" : "w");
+    if (!fp) {
+        perror("Error opening output file");
+        unloadBMP(&image);
+        return 1;
+    }
+    struct OutBuffer out;
+    out.fp = fp;
+    out.used = 0;
+    out.size = 1 << 20;
+    out.data = arenaAlloc(&ws.arena, out.size);
+    if (out.data == NULL) {
+        fclose(fp);
+        unloadBMP(&image);
+        freeWorkspace(&ws);
+        return 1;
+    }
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    const unsigned char *headerBuffer = image.map;
+    const struct Header *header = &image.header;
+    const struct InfoHeader *info = &image.info;
+    int padding = image.padding;
+    int alpha = image.pixelBytes == 4;
+
+    if (opts->format == DUMP_TEXT) {
+        // Print the file name and header data to the output file.
+        char line[256];
+        snprintf(line, sizeof(line), "\"%s\"\n", inputFile);
+        outString(&out, line);
+        // Print the two individual header type bytes (usually 'B' and 'M')
+        snprintf(line, sizeof(line),
+                 "Header.Type = %c\nHeader.Type = %c\nHeader.Size = %u\n"
+                 "Header.Offset = %u\nInfoHeader.Size = %u\nInfoHeader.Width = %d\n"
+                 "InfoHeader.Height = %d\nInfoHeader.Planes = %u\n",
+                 headerBuffer[0], headerBuffer[1], header->size, header->offset,
+                 info->size, info->width, info->height, info->planes);
+        outString(&out, line);
+        snprintf(line, sizeof(line),
+                 "InfoHeader.Bits = %u\nInfoHeader.Compression = %u\n"
+                 "InfoHeader.ImageSize = %u\nInfoHeader.xResolution = %d\n"
+                 "InfoHeader.yResolution = %d\nInfoHeader.Colors = %u\n"
+                 "InfoHeader.ImportantColors = %u\nPadding = %d\n",
+                 info->bits, info->compression, info->imageSize, info->xResolution,
+                 info->yResolution, info->colors, info->importantColors, padding);
+        outString(&out, line);
+
+        // Print out each individual byte of the header, up to the pixel data.
+        for (int i = 0; i < (int)header->offset; i++) {
+            snprintf(line, sizeof(line), "Byte[%d] = %03d\n", i, headerBuffer[i]);
+            outString(&out, line);
+        }
+    }
+    else if (opts->format == DUMP_CSV) {
+        outString(&out, alpha ? "row,col,r,g,b,a\n" : "row,col,r,g,b\n");
+    }
+
+    // Print the pixel data straight from the mapped rows. The padding bytes
+    // at the end of a row are printed when the region reaches the last column.
+    for (int i = y0; i < y1; i++) {
+        const unsigned char *row = bmpRow(&image, i);
+        for (int j = x0; j < x1; j++) {
+            // Each pixel has 3 bytes, stored in BMP as B, G, R, or 4 with
+            // alpha last.
+            const unsigned char *color = row + image.pixelBytes * j;
+            if (opts->format == DUMP_TEXT) {
+                // "RGB[i,j] = rrr.ggg.bbb\n" or "RGBA[i,j] = rrr.ggg.bbb.aaa\n"
+                outReserve(&out, 48);
+                memcpy(out.data + out.used, alpha ? "RGBA[" : "RGB[", 4 + alpha);
+                out.used += 4 + alpha;
+                outInt(&out, i);
+                out.data[out.used++] = ',';
+                outInt(&out, j);
+                memcpy(out.data + out.used, "] = ", 4);
+                out.used += 4;
+                outByte3(&out, color[2]);
+                out.data[out.used++] = '.';
+                outByte3(&out, color[1]);
+                out.data[out.used++] = '.';
+                outByte3(&out, color[0]);
+                if (alpha) {
+                    out.data[out.used++] = '.';
+                    outByte3(&out, color[3]);
+                }
+                out.data[out.used++] = '\n';
+            }
+            else if (opts->format == DUMP_CSV) {
+                outReserve(&out, 40);
+                outInt(&out, i);
+                out.data[out.used++] = ',';
+                outInt(&out, j);
+                out.data[out.used++] = ',';
+                outInt(&out, color[2]);
+                out.data[out.used++] = ',';
+                outInt(&out, color[1]);
+                out.data[out.used++] = ',';
+                outInt(&out, color[0]);
+                if (alpha) {
+                    out.data[out.used++] = ',';
+                    outInt(&out, color[3]);
+                }
+                out.data[out.used++] = '\n';
+            }
+            else {
+                // Rearrange into R, G, B (, A) order.
+                outReserve(&out, 4);
+                out.data[out.used++] = (char)color[2];
+                out.data[out.used++] = (char)color[1];
+                out.data[out.used++] = (char)color[0];
+                if (alpha) {
+                    out.data[out.used++] = (char)color[3];
+                }
+            }
+        }
+        if (opts->format == DUMP_TEXT && x1 == image.width) {
+            for (int k = 0; k < padding; k++) {
+                // "Padding[k] = ppp\n"
+                outReserve(&out, 32);
+                memcpy(out.data + out.used, "Padding[", 8);
+                out.used += 8;
+                outInt(&out, k);
+                memcpy(out.data + out.used, "] = ", 4);
+                out.used += 4;
+                outByte3(&out, row[image.pixelBytes * image.width + k]);
+                out.data[out.used++] = '\n';
+            }
+        }
+    }
+
+    // Formatting is compute; the buffer flushes inside the loop are charged
+    // to it as well. Write out whatever is still buffered.
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+    fwrite(out.data, 1, out.used, fp);
+    long written = ftell(fp);
+    ws.bytesWritten += written > 0 ? (unsigned long long)written : 0;
+    int status = 0;
+    if (ferror(fp) | (fclose(fp) != 0)) {
+        perror("Error writing output file");
+        status = 1;
+    }
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("read", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+// Shared state for the band-parallel edge filter.
+struct EdgeJob {
+    struct Image src;          // Source view
+    struct Image dst;          // Destination view of the same size
+    int padding;               // Bytes zeroed after each destination row
+    int bandRows;              // Rows per band (the last band may be shorter)
+    struct BandWriter *writer; // Writes each finished band, or NULL
+};
+
+//
+// edgeBand - Filters one horizontal band of rows. The rows just above and
+// below the band (its one-row halos) are read straight from the source
+// view, so bands are independent and can run in any order.
+//
+static void edgeBand(void *arg, int band, int worker)
+{
+    struct EdgeJob *job = arg;
+    const struct Image *src = &job->src;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > src->height) {
+        last = src->height;
+    }
+    size_t rowBytes = (size_t)src->width * src->format;
+    (void)worker;
+
+    for (int i = first; i < last; i++) {
+        unsigned char *out = imageRow(&job->dst, i);
+        // The first and last rows are boundary pixels, so copy them unchanged.
+        if (i == 0 || i == src->height - 1) {
+            memcpy(out, imageRow(src, i), rowBytes);
+        }
+        else {
+            edgeRow(imageRow(src, i - 1), imageRow(src, i), imageRow(src, i + 1),
+                    out, src->width, src->format);
+        }
+        // Padding bytes are written as 0.
+        memset(out + rowBytes, 0, job->padding);
+    }
+    if (job->writer != NULL) {
+        writeBand(job->writer, first, last);
+    }
+}
+
+//
+// edgeImage - Runs the edge filter from src to dst in bands on pool. The
+// command line passes views in file row order with the BMP padding to
+// clear and a writer for each finished band; the API passes neither.
+//
+static void edgeImage(const struct Image *src, const struct Image *dst, int padding,
+                      struct BandWriter *writer, struct ThreadPool *pool)
+{
+    struct EdgeJob job;
+    job.src = *src;
+    job.dst = *dst;
+    job.padding = padding;
+    job.writer = writer;
+    job.bandRows = bandRowsFor(pool, src->height);
+    poolRun(pool, (src->height + job.bandRows - 1) / job.bandRows, edgeBand, &job);
+}
+
+//
+// rleFile - Returns 1 if inputFile is an RLE-compressed BMP. --stream and
+// --overlap read the file in pieces and cannot expand it, so such files
+// take the mapped path instead.
+//
+static int rleFile(const char *inputFile)
+{
+    unsigned char start[BMP_HEADER_SIZE];
+    FILE *fp = fopen(inputFile, "rb");
+    if (fp == NULL) {
+        return 0;
+    }
+    size_t size = fread(start, 1, sizeof(start), fp);
+    fclose(fp);
+    if (size < sizeof(start)) {
+        return 0;
+    }
+    uint32_t compression = readLE32(start + 30);
+    if (compression != 1 && compression != 2) {
+        return 0;
+    }
+    fprintf(stderr, "Note: %s is RLE-compressed; it is decoded in memory instead of "
+            "streamed.\n", inputFile);
+    return 1;
+}
+
+//
+// edgeOperation - Performs the "edge" operation by reading the BMP image,
+// applying an edge-detection filter, and writing a new BMP file with "-edge" inserted
+// in the original filename.
+//
+static int edgeOperation(const char *inputFile, const struct Options *opts,
+                         struct ThreadPool *pool)
+{
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+
+    int status;
+    int pieces = (opts->stream || opts->overlap) && !rleFile(inputFile);
+    if (opts->stream && pieces) {
+        status = edgeStreamOperation(inputFile, &ws);
+    }
+    else {
+        // Create the output filename by inserting "-edge" before the ".bmp" extension.
+        char outFilename[256];
+        outputFileName(inputFile, "-edge.bmp", outFilename, sizeof(outFilename));
+        if (opts->overlap && pieces) {
+            status = overlapFile(inputFile, outFilename, 1, 0, 0, pool, &ws);
+        }
+        else {
+            status = edgeFile(inputFile, outFilename, pool, &ws);
+        }
+    }
+
+    if (opts->stats != STATS_OFF) {
+        printStats("edge", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+//
+// edgeFile - Applies the edge-detection filter to inputFile and writes the
+// result to outFilename, using (and growing) the buffers in ws.
+//
+static int edgeFile(const char *inputFile, const char *outFilename,
+                    struct ThreadPool *pool, struct Workspace *ws)
+{
+    // Map the BMP input file; the filter reads source pixels in place, so
+    // the page faults that actually read the file are charged to compute.
+    double mark = statsMark(ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws->bytesRead += image.mapSize;
+    uint64_t key = 0;
+    if (cacheFetch(ws, &image, hashBytes("edge", 4, 0), outFilename, &key) == 0) {
+        unloadBMP(&image);
+        statsLap(ws, PHASE_DECODE, &mark);
+        return 0;
+    }
+
+    // The edge-detected rows go into one buffer in BMP layout, behind the
+    // original BMP header in the output file.
+    arenaReset(&ws->arena);
+    unsigned char *pixels = outputPixels(ws, image.map, image.header.offset,
+                                         image.stride * image.height);
+    struct BandWriter writer;
+    if (pixels == NULL ||
+        openBandWriter(&writer, outFilename, image.map, image.header.offset, pixels,
+                       image.stride, image.height, ws->direct) != 0) {
+        unloadBMP(&image);
+        return 1;
+    }
+    statsLap(ws, PHASE_DECODE, &mark);
+
+    // Apply the convolution filter in horizontal bands; each band is
+    // written out as soon as it is done.
+    struct Image src, dst;
+    bmpView(&image, image.pixels, &src);
+    bmpView(&image, pixels, &dst);
+    edgeImage(&src, &dst, image.padding, &writer, pool);
+    statsLap(ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, ws);
+    if (status == 0) {
+        cacheStore(ws, key, outFilename);
+    }
+    unloadBMP(&image);
+    statsLap(ws, PHASE_ENCODE, &mark);
+    return status;
+}
+
+//
+// readHeader - Reads the 54-byte BMP header from fp, then the rest of the
+// header up to the pixel data (larger info headers, colour masks), and
+// validates it. Fills in the header fields and geometry of layout, leaving
+// fp at the first pixel row. Returns the header bytes in a malloc'd buffer,
+// or NULL (with a message) on error.
+//
+static unsigned char *readHeader(FILE *fp, const char *inputFile,
+                                 struct BMPImage *layout)
+{
+    unsigned char start[BMP_HEADER_SIZE];
+    if (fread(start, 1, BMP_HEADER_SIZE, fp) != BMP_HEADER_SIZE) {
+        fprintf(stderr, "Error reading BMP header.\n");
+        return NULL;
+    }
+    memset(layout, 0, sizeof(*layout));
+    decodeHeader(start, &layout->header, &layout->info);
+    size_t headerSize = layout->header.offset;
+    if (headerSize < BMP_HEADER_SIZE || headerSize > (1 << 20)) {
+        fprintf(stderr, "Error: invalid BMP pixel data offset %zu.\n", headerSize);
+        return NULL;
+    }
+    unsigned char *headerBuffer = malloc(headerSize);
+    if (headerBuffer == NULL) {
+        perror("Memory allocation error");
+        return NULL;
+    }
+    countAllocation();
+    memcpy(headerBuffer, start, BMP_HEADER_SIZE);
+    if (fread(headerBuffer + BMP_HEADER_SIZE, 1, headerSize - BMP_HEADER_SIZE, fp) !=
+        headerSize - BMP_HEADER_SIZE) {
+        fprintf(stderr, "Error reading BMP header.\n");
+        free(headerBuffer);
+        return NULL;
+    }
+    if (validateHeader(headerBuffer, headerSize, &layout->header, &layout->info,
+                       inputFile) != 0) {
+        free(headerBuffer);
+        return NULL;
+    }
+    bmpLayout(layout);
+    return headerBuffer;
+}
+
+//
+// edgeStreamOperation - Streaming version of the "edge" operation. Only a
+// ring of three input rows and one output row are held in memory: each
+// output row is written as soon as the row below it has been read, so memory
+// use is O(width) regardless of the image height. Peak RSS is reported on
+// stderr when done.
+//
+static int edgeStreamOperation(const char *inputFile, struct Workspace *ws)
+{
+    double mark = statsMark(ws);
+
+    // Open the BMP input file in binary mode and read its header.
+    FILE *fp = fopen(inputFile, "rb");
+    if (!fp) {
+        perror("Error opening input file");
+        return 1;
+    }
+    struct BMPImage layout;
+    unsigned char *headerBuffer = readHeader(fp, inputFile, &layout);
+    if (headerBuffer == NULL) {
+        fclose(fp);
+        return 1;
+    }
+    size_t headerSize = layout.header.offset;
+    int width = layout.width;
+    int height = layout.height;
+    int pixelBytes = layout.pixelBytes;
+    size_t stride = layout.stride;
+
+    // One allocation holds the three-row input ring and the output row.
+    // calloc leaves the output row's padding bytes set to 0.
+    unsigned char *buffer = calloc(4, stride);
+    if (buffer == NULL) {
+        perror("Memory allocation error");
+        free(headerBuffer);
+        fclose(fp);
+        return 1;
+    }
+    countAllocation();
+    unsigned char *ring[3] = { buffer, buffer + stride, buffer + 2 * stride };
+    unsigned char *out = buffer + 3 * stride;
+
+    // Create the output filename by inserting "-edge" before the ".bmp" extension.
+    char outFilename[256];
+    outputFileName(inputFile, "-edge.bmp", outFilename, sizeof(outFilename));
+    detachOutput(outFilename);
+    FILE *outFp = fopen(outFilename, "wb");
+    if (!outFp) {
+        perror("Error creating output file");
+        free(buffer);
+        free(headerBuffer);
+        fclose(fp);
+        return 1;
+    }
+    fwrite(headerBuffer, 1, headerSize, outFp);
+    ws->bytesRead += headerSize;
+    ws->bytesWritten += headerSize;
+
+    // Prime the ring with the first row, then slide it down the image.
+    int status = 0;
+    if (fread(ring[0], 1, stride, fp) != stride) {
+        status = 1;
+    }
+    for (int i = 0; i < height && status == 0; i++) {
+        // Read the row below the current one before filtering.
+        if (i + 1 < height && fread(ring[(i + 1) % 3], 1, stride, fp) != stride) {
+            status = 1;
+            break;
+        }
+        statsLap(ws, PHASE_DECODE, &mark);
+        const unsigned char *row = ring[i % 3];
+        if (i == 0 || i == height - 1) {
+            memcpy(out, row, (size_t)width * pixelBytes);
+        }
+        else {
+            edgeRow(ring[(i - 1) % 3], row, ring[(i + 1) % 3], out, width, pixelBytes);
+        }
+        statsLap(ws, PHASE_COMPUTE, &mark);
+        if (fwrite(out, 1, stride, outFp) != stride) {
+            break;
+        }
+        statsLap(ws, PHASE_ENCODE, &mark);
+    }
+    if (status != 0) {
+        fprintf(stderr, "Error reading pixel data.\n");
+    }
+    else {
+        ws->bytesRead += stride * height;
+        ws->bytesWritten += stride * height;
+    }
+
+    // A full disk or I/O error may only show up when the last rows are
+    // flushed, so check the stream both before and after closing it.
+    if (ferror(outFp) | fclose(outFp)) {
+        perror("Error writing output file");
+        status = 1;
+    }
+    fclose(fp);
+    free(buffer);
+    free(headerBuffer);
+
+    fprintf(stderr, "Peak RSS: %ld KB\n", peakRSS());
+    return status;
+}
+
+//
+// edgeRow - Applies the 3x3 edge-detection filter
+//
+//      0 -1  0
+//     -1  4 -1
+//      0 -1  0
+//
+// to one row of BMP pixel bytes (B, G, R, B, G, R, ...). above and below are
+// the neighbouring rows. Because the channels are interleaved with a 3-byte
+// pitch, the left and right neighbours of any byte are 3 bytes away, so the
+// filter runs over the row as a flat byte array. BGRA rows (pixelBytes 4)
+// have a 4-byte pitch and their own kernels, which leave alpha unchanged.
+// The first and last pixels are boundary pixels and are copied unchanged.
+//
+static void edgeRow(const unsigned char *above, const unsigned char *row,
+                    const unsigned char *below, unsigned char *out, int width,
+                    int pixelBytes)
+{
+    int last = pixelBytes * (width - 1);
+    memcpy(out, row, pixelBytes);
+    if (last > pixelBytes) {
+        EdgeSpan span = pixelBytes == 4 ? edgeSpan32 : edgeSpan;
+        span(above, row, below, out, pixelBytes, last);
+    }
+    if (width > 1) {
+        memcpy(out + last, row + last, pixelBytes);
+    }
+}
+
+//
+// edgeSpanScalar - Portable edge kernel for bytes [begin, end) of a row.
+// Also finishes the tail that the vector kernels leave over.
+//
+static void edgeSpanScalar(const unsigned char *above, const unsigned char *row,
+                           const unsigned char *below, unsigned char *out,
+                           int begin, int end)
+{
+    for (int k = begin; k < end; k++) {
+        int sum = 4 * row[k] - row[k - 3] - row[k + 3] - above[k] - below[k];
+        out[k] = clamp(sum);
+    }
+}
+
+//
+// edgeSpan32Scalar - Portable edge kernel for BGRA bytes [begin, end), which
+// must be whole pixels. Alpha is copied unchanged.
+//
+static void edgeSpan32Scalar(const unsigned char *above, const unsigned char *row,
+                             const unsigned char *below, unsigned char *out,
+                             int begin, int end)
+{
+    for (int k = begin; k < end; k += 4) {
+        for (int c = k; c < k + 3; c++) {
+            int sum = 4 * row[c] - row[c - 4] - row[c + 4] - above[c] - below[c];
+            out[c] = clamp(sum);
+        }
+        out[k + 3] = row[k + 3];
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+//
+// The vector kernels widen each byte to 16 bits, where 4*c - (l+r+a+b) lies
+// in [-1020, 1020] and cannot overflow, then narrow with an unsigned
+// saturating pack. The saturation does exactly what clamp() does, so the
+// results are bit-exact with the scalar kernel. The unpack and pack
+// instructions both work within 128-bit lanes, so the bytes come back out in
+// their original order on AVX2 and AVX-512 as well.
+//
+
+//
+// edgeSpanSSE2 - Edge kernel processing 16 bytes per iteration.
+//
+static void edgeSpanSSE2(const unsigned char *above, const unsigned char *row,
+                         const unsigned char *below, unsigned char *out,
+                         int begin, int end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int k = begin;
+    for (; k + 16 <= end; k += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(row + k));
+        __m128i l = _mm_loadu_si128((const __m128i *)(row + k - 3));
+        __m128i r = _mm_loadu_si128((const __m128i *)(row + k + 3));
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + k));
+        __m128i b = _mm_loadu_si128((const __m128i *)(below + k));
+
+        __m128i lo = _mm_sub_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 2),
+                     _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(l, zero),
+                                                 _mm_unpacklo_epi8(r, zero)),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                                 _mm_unpacklo_epi8(b, zero))));
+        __m128i hi = _mm_sub_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 2),
+                     _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(l, zero),
+                                                 _mm_unpackhi_epi8(r, zero)),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                                 _mm_unpackhi_epi8(b, zero))));
+        _mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(lo, hi));
+    }
+    edgeSpanScalar(above, row, below, out, k, end);
+}
+
+//
+// edgeSpanAVX2 - Edge kernel processing 32 bytes per iteration.
+//
+__attribute__((target("avx2")))
+static void edgeSpanAVX2(const unsigned char *above, const unsigned char *row,
+                         const unsigned char *below, unsigned char *out,
+                         int begin, int end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    int k = begin;
+    for (; k + 32 <= end; k += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(row + k));
+        __m256i l = _mm256_loadu_si256((const __m256i *)(row + k - 3));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(row + k + 3));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(above + k));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(below + k));
+
+        __m256i lo = _mm256_sub_epi16(_mm256_slli_epi16(_mm256_unpacklo_epi8(c, zero), 2),
+                     _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(l, zero),
+                                                       _mm256_unpacklo_epi8(r, zero)),
+                                      _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                                       _mm256_unpacklo_epi8(b, zero))));
+        __m256i hi = _mm256_sub_epi16(_mm256_slli_epi16(_mm256_unpackhi_epi8(c, zero), 2),
+                     _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(l, zero),
+                                                       _mm256_unpackhi_epi8(r, zero)),
+                                      _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                                       _mm256_unpackhi_epi8(b, zero))));
+        _mm256_storeu_si256((__m256i *)(out + k), _mm256_packus_epi16(lo, hi));
+    }
+    // Clear the upper register halves before any SSE code runs (including
+    // libm), which would otherwise pay a state-transition penalty.
+    _mm256_zeroupper();
+    edgeSpanSSE2(above, row, below, out, k, end);
+}
+
+//
+// edgeSpanAVX512 - Edge kernel processing 64 bytes per iteration.
+//
+__attribute__((target("avx512f,avx512bw")))
+static void edgeSpanAVX512(const unsigned char *above, const unsigned char *row,
+                           const unsigned char *below, unsigned char *out,
+                           int begin, int end)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    int k = begin;
+    for (; k + 64 <= end; k += 64) {
+        __m512i c = _mm512_loadu_si512((const void *)(row + k));
+        __m512i l = _mm512_loadu_si512((const void *)(row + k - 3));
+        __m512i r = _mm512_loadu_si512((const void *)(row + k + 3));
+        __m512i a = _mm512_loadu_si512((const void *)(above + k));
+        __m512i b = _mm512_loadu_si512((const void *)(below + k));
+
+        __m512i lo = _mm512_sub_epi16(_mm512_slli_epi16(_mm512_unpacklo_epi8(c, zero), 2),
+                     _mm512_add_epi16(_mm512_add_epi16(_mm512_unpacklo_epi8(l, zero),
+                                                       _mm512_unpacklo_epi8(r, zero)),
+                                      _mm512_add_epi16(_mm512_unpacklo_epi8(a, zero),
+                                                       _mm512_unpacklo_epi8(b, zero))));
+        __m512i hi = _mm512_sub_epi16(_mm512_slli_epi16(_mm512_unpackhi_epi8(c, zero), 2),
+                     _mm512_add_epi16(_mm512_add_epi16(_mm512_unpackhi_epi8(l, zero),
+                                                       _mm512_unpackhi_epi8(r, zero)),
+                                      _mm512_add_epi16(_mm512_unpackhi_epi8(a, zero),
+                                                       _mm512_unpackhi_epi8(b, zero))));
+        _mm512_storeu_si512((void *)(out + k), _mm512_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper();
+    edgeSpanAVX2(above, row, below, out, k, end);
+}
+
+//
+// The BGRA kernels compute all four bytes of each pixel the same way, with
+// neighbours 4 bytes away, and then put the alpha bytes of the centre row
+// back. Pixels never straddle a vector, so this is one blend per vector
+// where packed BGR would need shuffles.
+//
+
+//
+// edgeSpan32SSE2 - BGRA edge kernel processing 4 pixels per iteration.
+//
+static void edgeSpan32SSE2(const unsigned char *above, const unsigned char *row,
+                           const unsigned char *below, unsigned char *out,
+                           int begin, int end)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+    int k = begin;
+    for (; k + 16 <= end; k += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(row + k));
+        __m128i l = _mm_loadu_si128((const __m128i *)(row + k - 4));
+        __m128i r = _mm_loadu_si128((const __m128i *)(row + k + 4));
+        __m128i a = _mm_loadu_si128((const __m128i *)(above + k));
+        __m128i b = _mm_loadu_si128((const __m128i *)(below + k));
+
+        __m128i lo = _mm_sub_epi16(_mm_slli_epi16(_mm_unpacklo_epi8(c, zero), 2),
+                     _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(l, zero),
+                                                 _mm_unpacklo_epi8(r, zero)),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                                 _mm_unpacklo_epi8(b, zero))));
+        __m128i hi = _mm_sub_epi16(_mm_slli_epi16(_mm_unpackhi_epi8(c, zero), 2),
+                     _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(l, zero),
+                                                 _mm_unpackhi_epi8(r, zero)),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                                 _mm_unpackhi_epi8(b, zero))));
+        __m128i edge = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128((__m128i *)(out + k),
+                         _mm_or_si128(_mm_andnot_si128(alpha, edge), _mm_and_si128(alpha, c)));
+    }
+    edgeSpan32Scalar(above, row, below, out, k, end);
+}
+
+//
+// edgeSpan32AVX2 - BGRA edge kernel processing 8 pixels per iteration.
+//
+__attribute__((target("avx2")))
+static void edgeSpan32AVX2(const unsigned char *above, const unsigned char *row,
+                           const unsigned char *below, unsigned char *out,
+                           int begin, int end)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u);
+    int k = begin;
+    for (; k + 32 <= end; k += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(row + k));
+        __m256i l = _mm256_loadu_si256((const __m256i *)(row + k - 4));
+        __m256i r = _mm256_loadu_si256((const __m256i *)(row + k + 4));
+        __m256i a = _mm256_loadu_si256((const __m256i *)(above + k));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(below + k));
+
+        __m256i lo = _mm256_sub_epi16(_mm256_slli_epi16(_mm256_unpacklo_epi8(c, zero), 2),
+                     _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(l, zero),
+                                                       _mm256_unpacklo_epi8(r, zero)),
+                                      _mm256_add_epi16(_mm256_unpacklo_epi8(a, zero),
+                                                       _mm256_unpacklo_epi8(b, zero))));
+        __m256i hi = _mm256_sub_epi16(_mm256_slli_epi16(_mm256_unpackhi_epi8(c, zero), 2),
+                     _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(l, zero),
+                                                       _mm256_unpackhi_epi8(r, zero)),
+                                      _mm256_add_epi16(_mm256_unpackhi_epi8(a, zero),
+                                                       _mm256_unpackhi_epi8(b, zero))));
+        __m256i edge = _mm256_packus_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *)(out + k),
+                            _mm256_blendv_epi8(edge, c, alpha));
+    }
+    _mm256_zeroupper();
+    edgeSpan32SSE2(above, row, below, out, k, end);
+}
+
+//
+// edgeSpan32AVX512 - BGRA edge kernel processing 16 pixels per iteration.
+// The alpha bytes are merged back with a byte mask instead of a blend.
+//
+__attribute__((target("avx512f,avx512bw")))
+static void edgeSpan32AVX512(const unsigned char *above, const unsigned char *row,
+                             const unsigned char *below, unsigned char *out,
+                             int begin, int end)
+{
+    const __m512i zero = _mm512_setzero_si512();
+    const __mmask64 alpha = 0x8888888888888888ull;
+    int k = begin;
+    for (; k + 64 <= end; k += 64) {
+        __m512i c = _mm512_loadu_si512((const void *)(row + k));
+        __m512i l = _mm512_loadu_si512((const void *)(row + k - 4));
+        __m512i r = _mm512_loadu_si512((const void *)(row + k + 4));
+        __m512i a = _mm512_loadu_si512((const void *)(above + k));
+        __m512i b = _mm512_loadu_si512((const void *)(below + k));
+
+        __m512i lo = _mm512_sub_epi16(_mm512_slli_epi16(_mm512_unpacklo_epi8(c, zero), 2),
+                     _mm512_add_epi16(_mm512_add_epi16(_mm512_unpacklo_epi8(l, zero),
+                                                       _mm512_unpacklo_epi8(r, zero)),
+                                      _mm512_add_epi16(_mm512_unpacklo_epi8(a, zero),
+                                                       _mm512_unpacklo_epi8(b, zero))));
+        __m512i hi = _mm512_sub_epi16(_mm512_slli_epi16(_mm512_unpackhi_epi8(c, zero), 2),
+                     _mm512_add_epi16(_mm512_add_epi16(_mm512_unpackhi_epi8(l, zero),
+                                                       _mm512_unpackhi_epi8(r, zero)),
+                                      _mm512_add_epi16(_mm512_unpackhi_epi8(a, zero),
+                                                       _mm512_unpackhi_epi8(b, zero))));
+        __m512i edge = _mm512_packus_epi16(lo, hi);
+        _mm512_storeu_si512((void *)(out + k), _mm512_mask_blend_epi8(alpha, edge, c));
+    }
+    _mm256_zeroupper();
+    edgeSpan32AVX2(above, row, below, out, k, end);
+}
+#endif
+
+//
+// Compare-exchange networks selecting the median of 9 and 25 values
+// (Paeth's and Devillard's). CX(a, b) must leave the smaller value in v[a]
+// and the larger in v[b]; the median ends up in v[4] or v[12]. The same
+// sequence runs on scalars and on whole vector registers of bytes, where
+// every compare-exchange is one unsigned min and one max, with no branches.
+//
+#define MEDIAN9_NETWORK(CX)                                                           \
+    CX(1, 2) CX(4, 5) CX(7, 8) CX(0, 1) CX(3, 4) CX(6, 7) CX(1, 2) CX(4, 5)          \
+    CX(7, 8) CX(0, 3) CX(5, 8) CX(4, 7) CX(3, 6) CX(1, 4) CX(2, 5) CX(4, 7)          \
+    CX(4, 2) CX(6, 4) CX(4, 2)
+
+#define MEDIAN25_NETWORK(CX)                                                          \
+    CX(0, 1) CX(3, 4) CX(2, 4) CX(2, 3) CX(6, 7) CX(5, 7) CX(5, 6) CX(9, 10)         \
+    CX(8, 10) CX(8, 9) CX(12, 13) CX(11, 13) CX(11, 12) CX(15, 16) CX(14, 16)        \
+    CX(14, 15) CX(18, 19) CX(17, 19) CX(17, 18) CX(21, 22) CX(20, 22) CX(20, 21)     \
+    CX(23, 24) CX(2, 5) CX(3, 6) CX(0, 6) CX(0, 3) CX(4, 7) CX(1, 7) CX(1, 4)        \
+    CX(11, 14) CX(8, 14) CX(8, 11) CX(12, 15) CX(9, 15) CX(9, 12) CX(13, 16)         \
+    CX(10, 16) CX(10, 13) CX(20, 23) CX(17, 23) CX(17, 20) CX(21, 24) CX(18, 24)     \
+    CX(18, 21) CX(19, 22) CX(8, 17) CX(9, 18) CX(0, 18) CX(0, 9) CX(10, 19)          \
+    CX(1, 19) CX(1, 10) CX(11, 20) CX(2, 20) CX(2, 11) CX(12, 21) CX(3, 21)          \
+    CX(3, 12) CX(13, 22) CX(4, 22) CX(4, 13) CX(14, 23) CX(5, 23) CX(5, 14)          \
+    CX(15, 24) CX(6, 24) CX(6, 15) CX(7, 16) CX(7, 19) CX(13, 21) CX(15, 23)         \
+    CX(7, 13) CX(7, 15) CX(1, 9) CX(3, 11) CX(5, 17) CX(11, 17) CX(9, 17)            \
+    CX(4, 10) CX(6, 12) CX(7, 14) CX(4, 6) CX(4, 7) CX(12, 14) CX(10, 14)            \
+    CX(6, 7) CX(10, 12) CX(6, 10) CX(6, 17) CX(12, 17) CX(7, 17) CX(7, 10)           \
+    CX(12, 18) CX(7, 12) CX(10, 18) CX(12, 20) CX(10, 20) CX(10, 12)
+
+#define MEDIAN_CX_SCALAR(a, b)                                                        \
+    { int t = v[a] < v[b] ? v[a] : v[b]; v[b] ^= v[a] ^ t; v[a] = t; }
+
+//
+// medianNetwork - Returns the median of the size * size values in v (size
+// 3 or 5), reordering them.
+//
+static inline int medianNetwork(int *v, int size)
+{
+    if (size == 3) {
+        MEDIAN9_NETWORK(MEDIAN_CX_SCALAR)
+        return v[4];
+    }
+    MEDIAN25_NETWORK(MEDIAN_CX_SCALAR)
+    return v[12];
+}
+
+//
+// medianSpanScalar - Portable median kernel for bytes [begin, end) of a
+// row, which must be at least size / 2 pixels from either edge. Also
+// finishes the tail that the vector kernels leave over.
+//
+static inline void medianSpanScalar(const unsigned char *const *rows, unsigned char *out,
+                                    int begin, int end, int pitch, int size)
+{
+    int radius = size / 2;
+    for (int b = begin; b < end; b++) {
+        int v[25];
+        for (int k = 0; k < size * size; k++) {
+            v[k] = rows[k / size][b + pitch * (k % size - radius)];
+        }
+        out[b] = (unsigned char)medianNetwork(v, size);
+    }
+}
+
+static void medianSpan3Scalar(const unsigned char *const *rows, unsigned char *out,
+                              int begin, int end, int pitch)
+{
+    medianSpanScalar(rows, out, begin, end, pitch, 3);
+}
+
+static void medianSpan5Scalar(const unsigned char *const *rows, unsigned char *out,
+                              int begin, int end, int pitch)
+{
+    medianSpanScalar(rows, out, begin, end, pitch, 5);
+}
+
+#ifdef HAVE_X86_SIMD
+//
+// Defines the 3x3 and 5x5 median kernels for one instruction set. Each
+// iteration loads the window around STEP consecutive bytes as 9 or 25
+// unaligned vectors and runs the network on them, producing STEP medians
+// at once. The bytes left over go to the TAIL kernels of the next lower
+// level. Results are bit-exact with the scalar kernels.
+//
+#define MEDIAN_SPANS(ISA, TARGET, VEC, STEP, LOAD, STORE, CX, TAIL)                   \
+    TARGET                                                                            \
+    static void medianSpan3##ISA(const unsigned char *const *rows, unsigned char *out, \
+                                 int begin, int end, int pitch)                       \
+    {                                                                                 \
+        int b = begin;                                                                \
+        for (; b + STEP <= end; b += STEP) {                                          \
+            VEC v[9];                                                                 \
+            for (int k = 0; k < 9; k++) {                                             \
+                v[k] = LOAD((const void *)(rows[k / 3] + b + pitch * (k % 3 - 1)));   \
+            }                                                                         \
+            MEDIAN9_NETWORK(CX)                                                       \
+            STORE((void *)(out + b), v[4]);                                           \
+        }                                                                             \
+        medianSpan3##TAIL(rows, out, b, end, pitch);                                  \
+    }                                                                                 \
+    TARGET                                                                            \
+    static void medianSpan5##ISA(const unsigned char *const *rows, unsigned char *out, \
+                                 int begin, int end, int pitch)                       \
+    {                                                                                 \
+        int b = begin;                                                                \
+        for (; b + STEP <= end; b += STEP) {                                          \
+            VEC v[25];                                                                \
+            for (int k = 0; k < 25; k++) {                                            \
+                v[k] = LOAD((const void *)(rows[k / 5] + b + pitch * (k % 5 - 2)));   \
+            }                                                                         \
+            MEDIAN25_NETWORK(CX)                                                      \
+            STORE((void *)(out + b), v[12]);                                          \
+        }                                                                             \
+        medianSpan5##TAIL(rows, out, b, end, pitch);                                  \
+    }
+
+#define MEDIAN_CX_SSE2(a, b)                                                          \
+    { __m128i t = _mm_min_epu8(v[a], v[b]); v[b] = _mm_max_epu8(v[a], v[b]); v[a] = t; }
+#define MEDIAN_CX_AVX2(a, b)                                                          \
+    { __m256i t = _mm256_min_epu8(v[a], v[b]); v[b] = _mm256_max_epu8(v[a], v[b]);   \
+      v[a] = t; }
+#define MEDIAN_CX_AVX512(a, b)                                                        \
+    { __m512i t = _mm512_min_epu8(v[a], v[b]); v[b] = _mm512_max_epu8(v[a], v[b]);   \
+      v[a] = t; }
+
+MEDIAN_SPANS(SSE2, , __m128i, 16, _mm_loadu_si128, _mm_storeu_si128,
+             MEDIAN_CX_SSE2, Scalar)
+MEDIAN_SPANS(AVX2, __attribute__((target("avx2"))), __m256i, 32, _mm256_loadu_si256,
+             _mm256_storeu_si256, MEDIAN_CX_AVX2, SSE2)
+MEDIAN_SPANS(AVX512, __attribute__((target("avx512f,avx512bw"))), __m512i, 64,
+             _mm512_loadu_si512, _mm512_storeu_si512, MEDIAN_CX_AVX512, AVX2)
+#endif
+
+//
+// halveSpanScalar - Portable 2x2 averaging kernel: for bytes [begin, end)
+// of a pair of rows a and b, out[k] is the rounded mean of a[k], b[k] and
+// the bytes one pixel (pitch bytes) to their right. Also finishes the tail
+// that the vector kernels leave over.
+//
+static void halveSpanScalar(const unsigned char *a, const unsigned char *b,
+                            unsigned char *out, int begin, int end, int pitch)
+{
+    for (int k = begin; k < end; k++) {
+        out[k] = (unsigned char)((a[k] + a[k + pitch] + b[k] + b[k + pitch] + 2) >> 2);
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+//
+// The vector 2x2 kernels widen to 16 bits, where a sum of four bytes plus
+// the rounding term cannot overflow, and narrow again with a pack; as in
+// the edge kernels the bytes come back out in their original order.
+//
+
+//
+// halveSpanSSE2 - 2x2 averaging kernel processing 16 bytes per iteration.
+//
+static void halveSpanSSE2(const unsigned char *a, const unsigned char *b,
+                          unsigned char *out, int begin, int end, int pitch)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+    int k = begin;
+    for (; k + 16 <= end; k += 16) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(a + k));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(a + k + pitch));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(b + k));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(b + k + pitch));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a0, zero),
+                                                 _mm_unpacklo_epi8(a1, zero)),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(b0, zero),
+                                                 _mm_unpacklo_epi8(b1, zero)));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a0, zero),
+                                                 _mm_unpackhi_epi8(a1, zero)),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(b0, zero),
+                                                 _mm_unpackhi_epi8(b1, zero)));
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, two), 2);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, two), 2);
+        _mm_storeu_si128((__m128i *)(out + k), _mm_packus_epi16(lo, hi));
+    }
+    halveSpanScalar(a, b, out, k, end, pitch);
+}
+
+//
+// halveSpanAVX2 - 2x2 averaging kernel processing 32 bytes per iteration.
+//
+__attribute__((target("avx2")))
+static void halveSpanAVX2(const unsigned char *a, const unsigned char *b,
+                          unsigned char *out, int begin, int end, int pitch)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i two = _mm256_set1_epi16(2);
+    int k = begin;
+    for (; k + 32 <= end; k += 32) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(a + k));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(a + k + pitch));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(b + k));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(b + k + pitch));
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(a0, zero),
+                                                       _mm256_unpacklo_epi8(a1, zero)),
+                                      _mm256_add_epi16(_mm256_unpacklo_epi8(b0, zero),
+                                                       _mm256_unpacklo_epi8(b1, zero)));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(a0, zero),
+                                                       _mm256_unpackhi_epi8(a1, zero)),
+                                      _mm256_add_epi16(_mm256_unpackhi_epi8(b0, zero),
+                                                       _mm256_unpackhi_epi8(b1, zero)));
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, two), 2);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, two), 2);
+        _mm256_storeu_si256((__m256i *)(out + k), _mm256_packus_epi16(lo, hi));
+    }
+    halveSpanSSE2(a, b, out, k, end, pitch);
+}
+#endif
+
+//
+// selectKernels - Picks the fastest kernels the CPU supports, but no higher
+// than limit. __builtin_cpu_supports reads the CPUID feature bits (and the
+// OS support for the wider registers). Returns the level chosen.
+//
+static int selectKernels(int limit)
+{
+    int level = ISA_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        level = ISA_SSE2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        level = ISA_AVX2;
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+        level = ISA_AVX512;
+    }
+#endif
+    if (level > limit) {
+        level = limit;
+    }
+
+    switch (level) {
+#ifdef HAVE_X86_SIMD
+    case ISA_AVX512:
+        edgeSpan = edgeSpanAVX512;
+        edgeSpan32 = edgeSpan32AVX512;
+        medianSpan3 = medianSpan3AVX512;
+        medianSpan5 = medianSpan5AVX512;
+        halveSpan = halveSpanAVX2;
+        break;
+    case ISA_AVX2:
+        edgeSpan = edgeSpanAVX2;
+        edgeSpan32 = edgeSpan32AVX2;
+        medianSpan3 = medianSpan3AVX2;
+        medianSpan5 = medianSpan5AVX2;
+        halveSpan = halveSpanAVX2;
+        break;
+    case ISA_SSE2:
+        edgeSpan = edgeSpanSSE2;
+        edgeSpan32 = edgeSpan32SSE2;
+        medianSpan3 = medianSpan3SSE2;
+        medianSpan5 = medianSpan5SSE2;
+        halveSpan = halveSpanSSE2;
+        break;
+#endif
+    default:
+        edgeSpan = edgeSpanScalar;
+        edgeSpan32 = edgeSpan32Scalar;
+        medianSpan3 = medianSpan3Scalar;
+        medianSpan5 = medianSpan5Scalar;
+        halveSpan = halveSpanScalar;
+        break;
+    }
+    return level;
+}
+
+// Shared state for the band-parallel noise operation.
+struct NoiseJob {
+    struct Image src;          // Source view
+    struct Image dst;          // Destination view of the same size
+    int padding;               // Bytes zeroed after each destination row
+    int bandRows;              // Rows per band (the last band may be shorter)
+    uint64_t seed;             // Generator key
+    double stddev;             // Standard deviation of the noise
+    double *samples;           // One row of samples per worker
+    size_t rowSamples;         // Samples per worker in samples
+    struct BandWriter *writer; // Writes each finished band, or NULL
+};
+
+//
+// noiseBand - Adds noise to one horizontal band of rows. Each sample is
+// keyed by its position in the view, so the result does not depend on how
+// the rows are split between threads.
+//
+static void noiseBand(void *arg, int band, int worker)
+{
+    struct NoiseJob *job = arg;
+    const struct Image *src = &job->src;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > src->height) {
+        last = src->height;
+    }
+    int rowBytes = src->width * src->format;
+    int rowSamples = src->width * 3;
+    double *samples = job->samples + (size_t)worker * job->rowSamples;
+
+    for (int i = first; i < last; i++) {
+        unsigned char *out = imageRow(&job->dst, i);
+        noiseRow(imageRow(src, i), out, rowSamples, (uint64_t)i * rowSamples,
+                 job->seed, job->stddev, samples, src->format);
+        // Padding bytes are written as 0.
+        memset(out + rowBytes, 0, job->padding);
+    }
+    if (job->writer != NULL) {
+        writeBand(job->writer, first, last);
+    }
+}
+
+//
+// noiseSamples - Returns the number of doubles of sample scratch noiseImage
+// needs per worker for rows of width pixels. A row needs at most 3 extra
+// samples to reach the 4-sample block boundaries on either side, and rows
+// of samples are rounded up to whole cache lines so workers never share one.
+//
+static size_t noiseSamples(int width)
+{
+    return ((size_t)width * 3 + 8 + 7) & ~(size_t)7;
+}
+
+//
+// noiseImage - Adds noise from src to dst in bands on pool. samples holds
+// noiseSamples(src->width) doubles for each thread of the pool. padding and
+// writer are as in edgeImage.
+//
+static void noiseImage(const struct Image *src, const struct Image *dst, uint64_t seed,
+                       double stddev, double *samples, int padding,
+                       struct BandWriter *writer, struct ThreadPool *pool)
+{
+    struct NoiseJob job;
+    job.src = *src;
+    job.dst = *dst;
+    job.padding = padding;
+    job.writer = writer;
+    job.seed = seed;
+    job.stddev = stddev;
+    job.samples = samples;
+    job.rowSamples = noiseSamples(src->width);
+    job.bandRows = bandRowsFor(pool, src->height);
+    poolRun(pool, (src->height + job.bandRows - 1) / job.bandRows, noiseBand, &job);
+}
+
+//
+// noiseOperation - Performs the "noise" operation by reading the BMP image,
+// adding Gaussian (Box-Muller) noise to each pixel, and writing a new BMP file with "-noise"
+// inserted in the original filename.
+//
+static int noiseOperation(const char *inputFile, const struct Options *opts,
+                          struct ThreadPool *pool)
+{
+    // Prompt the user for the standard deviation (from 5 to 20) for the
+    // Gaussian noise, unless it was given on the command line.
+    double stddev = opts->stddev;
+    if (stddev == 0) {
+        printf("Enter standard deviation for noise (%d to %d): ", NOISE_MIN_STDDEV,
+               NOISE_MAX_STDDEV);
+        if (scanf("%lf", &stddev) != 1 || stddev < NOISE_MIN_STDDEV ||
+            stddev > NOISE_MAX_STDDEV) {
+            printf("Standard deviation out of range. Setting to 5.\n");
+            stddev = 5;
+        }
+    }
+    fprintf(stderr, "Seed: %llu\n", (unsigned long long)opts->seed);
+
+    // Create the output filename by inserting "-noise" before ".bmp"
+    char outFilename[256];
+    outputFileName(inputFile, "-noise.bmp", outFilename, sizeof(outFilename));
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    int status;
+    if (opts->overlap && !rleFile(inputFile)) {
+        status = overlapFile(inputFile, outFilename, 0, opts->seed, stddev, pool, &ws);
+    }
+    else {
+        status = noiseFile(inputFile, outFilename, opts->seed, stddev, pool, &ws);
+    }
+    if (opts->stats != STATS_OFF) {
+        printStats("noise", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+//
+// noiseFile - Adds Gaussian noise with the given seed and standard deviation
+// to inputFile and writes the result to outFilename, using (and growing) the
+// buffers in ws.
+//
+static int noiseFile(const char *inputFile, const char *outFilename, uint64_t seed,
+                     double stddev, struct ThreadPool *pool, struct Workspace *ws)
+{
+    // Map the BMP input file; source pixels are read in place.
+    double mark = statsMark(ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws->bytesRead += image.mapSize;
+    uint64_t key = 0, params[2] = { seed, 0 };
+    memcpy(&params[1], &stddev, sizeof(stddev));
+    if (cacheFetch(ws, &image, hashBytes(params, sizeof(params), hashBytes("noise", 5, 0)),
+                   outFilename, &key) == 0) {
+        unloadBMP(&image);
+        statsLap(ws, PHASE_DECODE, &mark);
+        return 0;
+    }
+
+    // The noisy rows go into one buffer in BMP layout. Each worker also
+    // needs a row of samples.
+    arenaReset(&ws->arena);
+    unsigned char *pixels = outputPixels(ws, image.map, image.header.offset,
+                                         image.stride * image.height);
+    double *samples = arenaAlloc(&ws->arena, pool->threads * noiseSamples(image.width) *
+                                             sizeof(double));
+    struct BandWriter writer;
+    if (pixels == NULL || samples == NULL ||
+        openBandWriter(&writer, outFilename, image.map, image.header.offset, pixels,
+                       image.stride, image.height, ws->direct) != 0) {
+        unloadBMP(&image);
+        return 1;
+    }
+    statsLap(ws, PHASE_DECODE, &mark);
+
+    // Add Gaussian noise in horizontal bands, writing each one out when done.
+    struct Image src, dst;
+    bmpView(&image, image.pixels, &src);
+    bmpView(&image, pixels, &dst);
+    noiseImage(&src, &dst, seed, stddev, samples, image.padding, &writer, pool);
+    statsLap(ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, ws);
+    if (status == 0) {
+        cacheStore(ws, key, outFilename);
+    }
+    unloadBMP(&image);
+    statsLap(ws, PHASE_ENCODE, &mark);
+    return status;
+}
+
+//
+// imageInit - Picks the fastest SIMD kernels the CPU supports (see bmp.h).
+//
+void imageInit(void)
+{
+    selectKernels(ISA_AVX512);
+}
+
+//
+// imageDecode - Fills in a top-row-first view of the pixels of the BMP
+// file in buffer, without copying them (see bmp.h). Bottom-up files get a
+// negative stride.
+//
+int imageDecode(const void *buffer, size_t size, struct Image *image)
+{
+    struct BMPImage bmp;
+    memset(&bmp, 0, sizeof(bmp));
+    if (bmpParse(buffer, size, "buffer", &bmp) != 0) {
+        return 1;
+    }
+    image->width = bmp.width;
+    image->height = bmp.height;
+    image->format = bmp.pixelBytes;
+    image->stride = bmp.topDown ? (ptrdiff_t)bmp.stride : -(ptrdiff_t)bmp.stride;
+    image->data = bmp.topDown ? bmp.pixels
+                              : bmp.pixels + (size_t)(bmp.height - 1) * bmp.stride;
+    return 0;
+}
+
+//
+// imageEncodedSize - Returns the size of the BMP file imageEncode writes.
+//
+size_t imageEncodedSize(const struct Image *image)
+{
+    size_t stride = ((size_t)image->width * image->format + 3) & ~(size_t)3;
+    return BMP_HEADER_SIZE + stride * image->height;
+}
+
+//
+// imageEncode - Writes image into buffer as a bottom-up BMP file with a
+// 54-byte header and zero padding. Returns the bytes written, or 0 if
+// buffer is too small.
+//
+size_t imageEncode(const struct Image *image, void *buffer, size_t size)
+{
+    size_t total = imageEncodedSize(image);
+    if (size < total) {
+        fprintf(stderr, "Error: BMP buffer too small (%zu of %zu bytes).\n", size, total);
+        return 0;
+    }
+    unsigned char *file = buffer;
+    size_t rowBytes = (size_t)image->width * image->format;
+    size_t stride = ((size_t)rowBytes + 3) & ~(size_t)3;
+    encodeHeader(file, image->width, image->height, image->format);
+    for (int i = 0; i < image->height; i++) {
+        unsigned char *row = file + BMP_HEADER_SIZE + (size_t)i * stride;
+        memcpy(row, imageRow(image, image->height - 1 - i), rowBytes);
+        memset(row + rowBytes, 0, stride - rowBytes);
+    }
+    return total;
+}
+
+//
+// imageView - Fills in a view of a sub-rectangle of image (see bmp.h).
+//
+int imageView(const struct Image *image, int x, int y, int width, int height,
+              struct Image *view)
+{
+    if (x < 0 || y < 0 || width <= 0 || height <= 0 ||
+        width > image->width - x || height > image->height - y) {
+        fprintf(stderr, "Error: view %d,%d,%d,%d is outside the %d x %d image.\n",
+                x, y, width, height, image->width, image->height);
+        return 1;
+    }
+    view->width = width;
+    view->height = height;
+    view->stride = image->stride;
+    view->format = image->format;
+    view->data = imageRow(image, y) + (size_t)x * image->format;
+    return 0;
+}
+
+//
+// checkImages - Checks that src and dst can be a filter's source and
+// destination. Returns 0 if they can, 1 (with a message) otherwise.
+//
+static int checkImages(const struct Image *src, const struct Image *dst)
+{
+    if ((src->format != PIXEL_BGR && src->format != PIXEL_BGRA) ||
+        src->width <= 0 || src->height <= 0) {
+        fprintf(stderr, "Error: unsupported image (%d x %d, %d bytes per pixel).\n",
+                src->width, src->height, src->format);
+        return 1;
+    }
+    if (dst->width != src->width || dst->height != src->height ||
+        dst->format != src->format) {
+        fprintf(stderr, "Error: source and destination images differ in size or format.\n");
+        return 1;
+    }
+    return 0;
+}
+
+//
+// imageEdge - Applies the edge filter to a view (see bmp.h). A NULL pool
+// runs it on a pool of just the calling thread.
+//
+int imageEdge(const struct Image *src, const struct Image *dst, struct ThreadPool *pool)
+{
+    if (checkImages(src, dst) != 0) {
+        return 1;
+    }
+    struct ThreadPool *run = pool != NULL ? pool : poolCreate(1);
+    if (run == NULL) {
+        return 1;
+    }
+    edgeImage(src, dst, 0, NULL, run);
+    if (run != pool) {
+        poolDestroy(run);
+    }
+    return 0;
+}
+
+//
+// imageNoise - Adds Gaussian noise to a view (see bmp.h). A NULL pool
+// runs it on a pool of just the calling thread.
+//
+int imageNoise(const struct Image *src, const struct Image *dst, uint64_t seed,
+               double stddev, struct ThreadPool *pool)
+{
+    if (checkImages(src, dst) != 0) {
+        return 1;
+    }
+    struct ThreadPool *run = pool != NULL ? pool : poolCreate(1);
+    if (run == NULL) {
+        return 1;
+    }
+    double *samples = malloc(run->threads * noiseSamples(src->width) * sizeof(double));
+    if (samples != NULL) {
+        countAllocation();
+        noiseImage(src, dst, seed, stddev, samples, 0, NULL, run);
+        free(samples);
+    }
+    else {
+        perror("Memory allocation error");
+    }
+    if (run != pool) {
+        poolDestroy(run);
+    }
+    return samples == NULL;
+}
+
+//
+// overlapWait - Waits until slot reaches state. Returns 0 if the run
+// failed in the meantime, 1 otherwise.
+//
+static int overlapWait(struct OverlapJob *job, struct OverlapSlot *slot, int state)
+{
+    pthread_mutex_lock(&job->lock);
+    while (slot->state != state && !job->failed) {
+        pthread_cond_wait(&job->changed, &job->lock);
+    }
+    int ok = !job->failed;
+    pthread_mutex_unlock(&job->lock);
+    return ok;
+}
+
+//
+// overlapSet - Moves slot to state, or marks the whole run as failed if
+// slot is NULL, and wakes the other stages.
+//
+static void overlapSet(struct OverlapJob *job, struct OverlapSlot *slot, int state)
+{
+    pthread_mutex_lock(&job->lock);
+    if (slot != NULL) {
+        slot->state = state;
+    }
+    else {
+        job->failed = 1;
+    }
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->lock);
+}
+
+//
+// overlapReader - Reader stage of an --overlap run. Reads each band, with
+// the rows just above and below it for the edge filter, into the next free
+// slot with pread, staying up to OVERLAP_SLOTS bands ahead of the filter.
+//
+static void *overlapReader(void *arg)
+{
+    struct OverlapJob *job = arg;
+    const struct BMPImage *layout = job->layout;
+    int halo = job->edge;
+
+    for (int band = 0; band < job->bands; band++) {
+        struct OverlapSlot *slot = &job->slots[band % OVERLAP_SLOTS];
+        if (!overlapWait(job, slot, SLOT_FREE)) {
+            break;
+        }
+        double start = job->timed ? monotonicSeconds() : 0;
+        int first = band * job->bandRows;
+        int from = first - halo > 0 ? first - halo : 0;
+        int to = first + job->bandRows + halo;
+        if (to > layout->height) {
+            to = layout->height;
+        }
+        unsigned char *data = slot->in + (size_t)(from - first + 1) * layout->stride;
+        size_t offset = layout->header.offset + (size_t)from * layout->stride;
+        size_t left = (size_t)(to - from) * layout->stride;
+        while (left > 0) {
+            ssize_t got = pread(job->fd, data, left, (off_t)offset);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                fprintf(stderr, "Error reading pixel data.\n");
+                overlapSet(job, NULL, 0);
+                return NULL;
+            }
+            data += got;
+            offset += got;
+            left -= got;
+        }
+        if (job->timed) {
+            job->readSeconds += monotonicSeconds() - start;
+        }
+        overlapSet(job, slot, SLOT_READ);
+    }
+    return NULL;
+}
+
+//
+// overlapWriter - Writer stage of an --overlap run. Writes each filtered
+// band to the output file in order and hands its slot back to the reader.
+//
+static void *overlapWriter(void *arg)
+{
+    struct OverlapJob *job = arg;
+    int height = job->layout->height;
+
+    for (int band = 0; band < job->bands; band++) {
+        struct OverlapSlot *slot = &job->slots[band % OVERLAP_SLOTS];
+        if (!overlapWait(job, slot, SLOT_FILTERED)) {
+            break;
+        }
+        double start = job->timed ? monotonicSeconds() : 0;
+        int first = band * job->bandRows;
+        int last = first + job->bandRows < height ? first + job->bandRows : height;
+        writeRows(&job->writer, slot->out, first, last);
+        if (job->timed) {
+            job->writeSeconds += monotonicSeconds() - start;
+        }
+        if (__atomic_load_n(&job->writer.error, __ATOMIC_RELAXED) != 0) {
+            overlapSet(job, NULL, 0);
+            break;
+        }
+        overlapSet(job, slot, SLOT_FREE);
+    }
+    return NULL;
+}
+
+//
+// overlapTask - Filters one group of rows of the band being filtered, with
+// the edge filter or noise as in edgeBand and noiseBand.
+//
+static void overlapTask(void *arg, int index, int worker)
+{
+    struct OverlapJob *job = arg;
+    const struct BMPImage *layout = job->layout;
+    const struct OverlapSlot *slot = &job->slots[job->band % OVERLAP_SLOTS];
+    int bandFirst = job->band * job->bandRows;
+    int first = bandFirst + index * job->taskRows;
+    int last = first + job->taskRows;
+    if (last > bandFirst + job->bandRows) {
+        last = bandFirst + job->bandRows;
+    }
+    if (last > layout->height) {
+        last = layout->height;
+    }
+    size_t stride = layout->stride;
+    int rowBytes = layout->width * layout->pixelBytes;
+    int rowSamples = layout->width * 3;
+
+    for (int i = first; i < last; i++) {
+        const unsigned char *row = slot->in + (size_t)(i - bandFirst + 1) * stride;
+        unsigned char *out = slot->out + (size_t)(i - bandFirst) * stride;
+        if (!job->edge) {
+            noiseRow(row, out, rowSamples, (uint64_t)i * rowSamples, job->seed,
+                     job->stddev, job->samples + (size_t)worker * job->rowSamples,
+                     layout->pixelBytes);
+        }
+        else if (i == 0 || i == layout->height - 1) {
+            memcpy(out, row, rowBytes);
+        }
+        else {
+            edgeRow(row - stride, row, row + stride, out, layout->width,
+                    layout->pixelBytes);
+        }
+        // Padding bytes are written as 0.
+        memset(out + rowBytes, 0, layout->padding);
+    }
+}
+
+//
+// overlapFile - Applies the edge filter (edge = 1) or noise (edge = 0) to
+// inputFile and writes the result to outFilename as a three-stage pipeline:
+// while the thread pool filters band N, a reader thread reads band N+1 and
+// a writer thread writes band N-1. At most OVERLAP_SLOTS bands of about
+// OVERLAP_BAND_BYTES each are held in memory, and wall time approaches the
+// slowest of reading, filtering and writing rather than their sum. The
+// output is identical to edgeFile and noiseFile.
+//
+static int overlapFile(const char *inputFile, const char *outFilename, int edge,
+                       uint64_t seed, double stddev, struct ThreadPool *pool,
+                       struct Workspace *ws)
+{
+    double mark = statsMark(ws);
+    FILE *fp = fopen(inputFile, "rb");
+    if (!fp) {
+        perror("Error opening input file");
+        return 1;
+    }
+    struct BMPImage layout;
+    unsigned char *header = readHeader(fp, inputFile, &layout);
+    if (header == NULL) {
+        fclose(fp);
+        return 1;
+    }
+
+    struct OverlapJob job;
+    memset(&job, 0, sizeof(job));
+    job.layout = &layout;
+    job.fd = fileno(fp);
+    job.edge = edge;
+    job.seed = seed;
+    job.stddev = stddev;
+    job.timed = ws->timed;
+    job.bandRows = OVERLAP_BAND_BYTES / layout.stride;
+    if (job.bandRows < 1) {
+        job.bandRows = 1;
+    }
+    if (job.bandRows > layout.height) {
+        job.bandRows = layout.height;
+    }
+    job.bands = (layout.height + job.bandRows - 1) / job.bandRows;
+    job.taskRows = (job.bandRows + pool->threads * 2 - 1) / (pool->threads * 2);
+    posix_fadvise(job.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // Each slot holds a band plus its two halo rows, and a page-aligned
+    // output area with a page to spare, so the filtered rows can start at
+    // the same page offset as their place in the file for O_DIRECT.
+    size_t bandBytes = (size_t)job.bandRows * layout.stride;
+    job.rowSamples = ((size_t)layout.width * 3 + 8 + 7) & ~(size_t)7;
+    arenaReset(&ws->arena);
+    int status = 0;
+    for (int s = 0; s < OVERLAP_SLOTS && status == 0; s++) {
+        job.slots[s].in = arenaAlloc(&ws->arena, bandBytes + 2 * layout.stride);
+        unsigned char *out = arenaAlloc(&ws->arena, bandBytes + 2 * DIRECT_ALIGN);
+        if (job.slots[s].in == NULL || out == NULL) {
+            status = 1;
+            break;
+        }
+        job.slots[s].outBase = out + (-(uintptr_t)out & (DIRECT_ALIGN - 1));
+    }
+    if (!edge && status == 0) {
+        job.samples = arenaAlloc(&ws->arena, pool->threads * job.rowSamples * sizeof(double));
+        status = job.samples == NULL;
+    }
+    if (status == 0) {
+        status = openBandWriter(&job.writer, outFilename, header, layout.header.offset,
+                                NULL, layout.stride, layout.height, ws->direct);
+    }
+    if (status != 0) {
+        free(header);
+        fclose(fp);
+        return 1;
+    }
+    statsLap(ws, PHASE_DECODE, &mark);
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+    pthread_t reader, writer;
+    int readerStarted = pthread_create(&reader, NULL, overlapReader, &job) == 0;
+    int writerStarted = readerStarted &&
+                        pthread_create(&writer, NULL, overlapWriter, &job) == 0;
+    if (!writerStarted) {
+        fprintf(stderr, "Error creating I/O threads.\n");
+        overlapSet(&job, NULL, 0);
+    }
+
+    // Filter each band as soon as it has been read, on the thread pool.
+    for (int band = 0; band < job.bands && writerStarted; band++) {
+        struct OverlapSlot *slot = &job.slots[band % OVERLAP_SLOTS];
+        if (!overlapWait(&job, slot, SLOT_READ)) {
+            break;
+        }
+        size_t offset = layout.header.offset + (size_t)band * bandBytes;
+        slot->out = slot->outBase +
+                    (job.writer.directFd >= 0 ? offset % DIRECT_ALIGN : 0);
+        job.band = band;
+        int rows = band == job.bands - 1 ? layout.height - band * job.bandRows
+                                         : job.bandRows;
+        poolRun(pool, (rows + job.taskRows - 1) / job.taskRows, overlapTask, &job);
+        overlapSet(&job, slot, SLOT_FILTERED);
+    }
+
+    if (readerStarted) {
+        pthread_join(reader, NULL);
+    }
+    if (writerStarted) {
+        pthread_join(writer, NULL);
+    }
+    status = job.failed;
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    ws->bytesRead += status == 0 ? layout.header.offset + layout.stride * layout.height : 0;
+    statsLap(ws, PHASE_COMPUTE, &mark);
+
+    // closeBandWriter reports any failed write.
+    if (closeBandWriter(&job.writer, ws) != 0) {
+        status = 1;
+    }
+    fclose(fp);
+    free(header);
+    statsLap(ws, PHASE_ENCODE, &mark);
+    ws->seconds[PHASE_DECODE] += job.readSeconds;
+    ws->seconds[PHASE_ENCODE] += job.writeSeconds;
+    return status;
+}
+
+//
+// parseStages - Parses a pipe specification such as "edge,noise:sigma=10"
+// into at most max stages. Each noise stage gets its own key derived from
+// seed; the first one uses seed itself, so a single noise stage matches the
+// noise operation run with the same seed. Returns the number of stages, or
+// -1 (with a message) on error.
+//
+static int parseStages(const char *spec, uint64_t seed, struct Stage *stages, int max)
+{
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer), "%s", spec);
+    int count = 0, noiseStages = 0;
+
+    for (char *save = NULL, *item = strtok_r(buffer, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        if (count == max) {
+            fprintf(stderr, "Too many pipe stages (at most %d).\n", max);
+            return -1;
+        }
+        struct Stage *stage = &stages[count++];
+        memset(stage, 0, sizeof(*stage));
+
+        // Split off the stage name, then read its key=value parameters.
+        char *params = strchr(item, ':');
+        if (params != NULL) {
+            *params++ = '\0';
+        }
+        if (strcmp(item, "edge") == 0) {
+            stage->kind = STAGE_EDGE;
+        }
+        else if (strcmp(item, "noise") == 0) {
+            stage->kind = STAGE_NOISE;
+            stage->sigma = NOISE_DEFAULT_STDDEV;
+            stage->seed = seed + 0x9E3779B97F4A7C15ull * noiseStages++;
+        }
+        else {
+            fprintf(stderr, "Unknown pipe stage: %s\n", item);
+            return -1;
+        }
+
+        while (params != NULL && *params != '\0') {
+            char *next = strchr(params, ':');
+            if (next != NULL) {
+                *next++ = '\0';
+            }
+            char *end;
+            if (stage->kind == STAGE_NOISE && strncmp(params, "sigma=", 6) == 0) {
+                stage->sigma = strtod(params + 6, &end);
+                if (*end != '\0' || !(stage->sigma >= NOISE_MIN_STDDEV &&
+                                       stage->sigma <= NOISE_MAX_STDDEV)) {
+                    fprintf(stderr, "Noise sigma must be from %d to %d: %s\n",
+                            NOISE_MIN_STDDEV, NOISE_MAX_STDDEV, params + 6);
+                    return -1;
+                }
+            }
+            else {
+                fprintf(stderr, "Unknown parameter for %s: %s\n", item, params);
+                return -1;
+            }
+            params = next;
+        }
+    }
+    if (count == 0) {
+        fprintf(stderr, "Empty pipe specification.\n");
+        return -1;
+    }
+    return count;
+}
+
+// Shared state for one fused pass of a pipe: a producer (edge or a plain
+// copy) followed by any number of per-pixel stages applied to each row
+// while it is still in cache.
+struct PipeJob {
+    const unsigned char *src;  // Source rows, stride bytes apart
+    unsigned char *dst;        // Destination rows, stride bytes apart
+    size_t stride;             // Bytes per row, including padding
+    int width;                 // Image width in pixels
+    int height;                // Image height in pixels
+    int pixelBytes;            // 3 for BGR pixels, 4 for BGRA
+    int edge;                  // 1 if the producer is the edge filter
+    const struct Stage *fused; // Per-pixel stages run on each produced row
+    int fusedCount;            // Number of fused stages
+    int bandRows;              // Rows per band (the last band may be shorter)
+    double *samples;           // One row of noise samples per worker
+    size_t rowSamples;         // Samples per worker in samples
+    struct BandWriter *writer; // Writes finished bands (last pass only), or NULL
+};
+
+//
+// pipeBand - Runs one fused pass over a horizontal band of rows.
+//
+static void pipeBand(void *arg, int band, int worker)
+{
+    struct PipeJob *job = arg;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > job->height) {
+        last = job->height;
+    }
+    int rowBytes = job->width * job->pixelBytes;
+    int rowSamples = job->width * 3;
+    double *samples = job->samples + (size_t)worker * job->rowSamples;
+
+    for (int i = first; i < last; i++) {
+        const unsigned char *row = job->src + (size_t)i * job->stride;
+        unsigned char *out = job->dst + (size_t)i * job->stride;
+
+        // Produce the row: edge-filter it, or copy it for a leading noise stage.
+        if (job->edge && i > 0 && i < job->height - 1) {
+            edgeRow(row - job->stride, row, row + job->stride, out, job->width,
+                    job->pixelBytes);
+        }
+        else {
+            memcpy(out, row, rowBytes);
+        }
+
+        // Apply the fused per-pixel stages in place.
+        for (int s = 0; s < job->fusedCount; s++) {
+            noiseRow(out, out, rowSamples, (uint64_t)i * rowSamples, job->fused[s].seed,
+                     job->fused[s].sigma, samples, job->pixelBytes);
+        }
+        // Padding bytes are written as 0.
+        memset(out + rowBytes, 0, job->stride - rowBytes);
+    }
+    if (job->writer != NULL) {
+        writeBand(job->writer, first, last);
+    }
+}
+
+//
+// pipeOperation - Performs the "pipe" operation: decodes inputFile once,
+// runs the stages in spec in memory and encodes the result once. Each edge
+// stage starts a new pass that reads the previous result; noise stages are
+// fused into the pass before them. Two buffers are used in turn, so memory
+// stays at two images however many stages there are. The last pass writes
+// each band to the output file as soon as it is done.
+//
+static int pipeOperation(const char *inputFile, const char *spec,
+                         const struct Options *opts, struct ThreadPool *pool)
+{
+    struct Stage stages[32];
+    int count = parseStages(spec, opts->seed, stages, 32);
+    if (count < 0) {
+        return 1;
+    }
+
+    char outFilename[4096];
+    if (opts->outFile != NULL) {
+        snprintf(outFilename, sizeof(outFilename), "%s", opts->outFile);
+    }
+    else {
+        outputFileName(inputFile, "-pipe.bmp", outFilename, sizeof(outFilename));
+    }
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+
+    // The cache key covers every stage, in order.
+    uint64_t key = 0, params = hashBytes("pipe", 4, 0);
+    for (int s = 0; s < count; s++) {
+        uint64_t fields[3] = { (uint64_t)stages[s].kind, 0, 0 };
+        if (stages[s].kind == STAGE_NOISE) {
+            fields[1] = stages[s].seed;
+            memcpy(&fields[2], &stages[s].sigma, sizeof(double));
+        }
+        params = hashBytes(fields, sizeof(fields), params);
+    }
+    if (cacheFetch(&ws, &image, params, outFilename, &key) == 0) {
+        unloadBMP(&image);
+        statsLap(&ws, PHASE_DECODE, &mark);
+        if (opts->stats != STATS_OFF) {
+            printStats("pipe", &ws, 1, opts->stats);
+        }
+        freeWorkspace(&ws);
+        return 0;
+    }
+
+    size_t size = image.stride * image.height;
+    size_t rowSamples = ((size_t)image.width * 3 + 8 + 7) & ~(size_t)7;
+    unsigned char *buffers[2];
+    buffers[0] = outputPixels(&ws, image.map, image.header.offset, size);
+    buffers[1] = outputPixels(&ws, image.map, image.header.offset, size);
+    double *samples = arenaAlloc(&ws.arena, pool->threads * rowSamples * sizeof(double));
+
+    // Every edge stage is a pass, plus one for leading noise stages.
+    int passCount = stages[0].kind == STAGE_NOISE;
+    for (int s = 0; s < count; s++) {
+        passCount += stages[s].kind == STAGE_EDGE;
+    }
+    struct BandWriter writer;
+    if (buffers[0] == NULL || buffers[1] == NULL || samples == NULL ||
+        openBandWriter(&writer, outFilename, image.map, image.header.offset,
+                       buffers[(passCount - 1) % 2], image.stride, image.height,
+                       ws.direct) != 0) {
+        freeWorkspace(&ws);
+        unloadBMP(&image);
+        return 1;
+    }
+
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    // The first pass reads the mapped file; later passes read the result
+    // of the pass before them.
+    const unsigned char *src = image.pixels;
+    int passes = 0;
+    for (int s = 0; s < count; ) {
+        struct PipeJob job;
+        job.src = src;
+        job.dst = buffers[passes % 2];
+        job.stride = image.stride;
+        job.width = image.width;
+        job.height = image.height;
+        job.pixelBytes = image.pixelBytes;
+        job.edge = stages[s].kind == STAGE_EDGE;
+        if (job.edge) {
+            s++;
+        }
+        job.fused = &stages[s];
+        job.fusedCount = 0;
+        while (s < count && stages[s].kind == STAGE_NOISE) {
+            job.fusedCount++;
+            s++;
+        }
+        job.samples = samples;
+        job.rowSamples = rowSamples;
+        job.writer = passes == passCount - 1 ? &writer : NULL;
+        job.bandRows = bandRowsFor(pool, image.height);
+        poolRun(pool, (image.height + job.bandRows - 1) / job.bandRows, pipeBand, &job);
+
+        src = job.dst;
+        passes++;
+    }
+
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, &ws);
+    if (status == 0) {
+        cacheStore(&ws, key, outFilename);
+    }
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("pipe", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+// Named kernels accepted by parseKernel, row-major from the top row.
+static const struct {
+    const char *name;
+    int size;
+    float weights[49];
+} kernelPresets[] = {
+    { "box3", 3, { 1, 1, 1, 1, 1, 1, 1, 1, 1 } },
+    { "box5", 5, { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 } },
+    { "box7", 7, { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+                   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 } },
+    { "blur3", 3, { 1, 2, 1, 2, 4, 2, 1, 2, 1 } },
+    { "blur5", 5, { 1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6,
+                    4, 16, 24, 16, 4, 1, 4, 6, 4, 1 } },
+    { "blur7", 7, { 1, 6, 15, 20, 15, 6, 1, 6, 36, 90, 120, 90, 36, 6,
+                    15, 90, 225, 300, 225, 90, 15, 20, 120, 300, 400, 300, 120, 20,
+                    15, 90, 225, 300, 225, 90, 15, 6, 36, 90, 120, 90, 36, 6,
+                    1, 6, 15, 20, 15, 6, 1 } },
+    { "sharpen", 3, { 0, -1, 0, -1, 5, -1, 0, -1, 0 } },
+    { "edge", 3, { 0, -1, 0, -1, 4, -1, 0, -1, 0 } },
+    { "sobelx", 3, { -1, 0, 1, -2, 0, 2, -1, 0, 1 } },
+    { "sobely", 3, { 1, 2, 1, 0, 0, 0, -1, -2, -1 } },
+};
+
+//
+// factorKernel - Checks whether a kernel is separable, i.e. its weights are
+// the outer product column[y] * row[x] of two 1-D kernels, and if so fills
+// in kernel->column and kernel->row. Integer kernels such as the Gaussian
+// and box blurs factor exactly; a small tolerance allows for rounding in
+// kernels read from a file.
+//
+static void factorKernel(struct Kernel *kernel)
+{
+    int size = kernel->size;
+    const float *w = kernel->weights;
+
+    // Factor around the largest weight.
+    int pivot = 0;
+    for (int k = 1; k < size * size; k++) {
+        if (fabsf(w[k]) > fabsf(w[pivot])) {
+            pivot = k;
+        }
+    }
+    kernel->separable = 0;
+    float largest = fabsf(w[pivot]);
+    if (largest == 0) {
+        return;
+    }
+    int py = pivot / size, px = pivot % size;
+    for (int k = 0; k < size; k++) {
+        kernel->column[k] = w[k * size + px];
+        kernel->row[k] = w[py * size + k] / w[pivot];
+    }
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            if (fabsf(w[y * size + x] - kernel->column[y] * kernel->row[x]) > 1e-5f * largest) {
+                return;
+            }
+        }
+    }
+    kernel->separable = 1;
+}
+
+//
+// parseKernel - Fills in a kernel from spec, which is one of the preset
+// names ("blur5", "sobelx", ...), the name of a file holding the weights, or
+// the weights themselves such as "0,-1,0;-1,4,-1;0,-1,0". Weights may be
+// separated by commas, semicolons or white space and are read row by row
+// from the top; their count must be the square of an odd size up to
+// MAX_KERNEL. A scale of 0 means 1 / (sum of the weights), or 1 when they
+// sum to 0. Returns 0 on success, 1 (with a message) on error.
+//
+static int parseKernel(const char *spec, double scale, double bias, struct Kernel *kernel)
+{
+    memset(kernel, 0, sizeof(*kernel));
+    int count = 0;
+    for (size_t p = 0; p < sizeof(kernelPresets) / sizeof(kernelPresets[0]); p++) {
+        if (strcmp(spec, kernelPresets[p].name) == 0) {
+            kernel->size = kernelPresets[p].size;
+            count = kernel->size * kernel->size;
+            memcpy(kernel->weights, kernelPresets[p].weights, count * sizeof(float));
+            break;
+        }
+    }
+
+    if (kernel->size == 0) {
+        // Weights come from a file if one has this name, otherwise from
+        // the argument itself.
+        char text[8192];
+        FILE *fp = fopen(spec, "r");
+        if (fp != NULL) {
+            size_t length = fread(text, 1, sizeof(text) - 1, fp);
+            text[length] = '\0';
+            fclose(fp);
+        }
+        else {
+            snprintf(text, sizeof(text), "%s", spec);
+        }
+
+        const char *p = text;
+        for (;;) {
+            p += strspn(p, ",; \t\r\n");
+            if (*p == '\0') {
+                break;
+            }
+            char *end;
+            double weight = strtod(p, &end);
+            if (end == p || count == MAX_KERNEL * MAX_KERNEL) {
+                fprintf(stderr, "Invalid kernel: %s\n", spec);
+                return 1;
+            }
+            kernel->weights[count++] = (float)weight;
+            p = end;
+        }
+        while (kernel->size * kernel->size < count) {
+            kernel->size++;
+        }
+        if (count == 0 || kernel->size * kernel->size != count || kernel->size % 2 == 0) {
+            fprintf(stderr, "Kernel must be a square of odd size up to %d x %d: %s\n",
+                    MAX_KERNEL, MAX_KERNEL, spec);
+            return 1;
+        }
+    }
+
+    if (scale == 0) {
+        double sum = 0;
+        for (int k = 0; k < count; k++) {
+            sum += kernel->weights[k];
+        }
+        scale = sum != 0 ? 1 / sum : 1;
+    }
+    kernel->scale = (float)scale;
+    kernel->bias = (float)bias;
+    factorKernel(kernel);
+    return 0;
+}
+
+//
+// clampFloat - Rounds a filtered value to the nearest integer and clamps it
+// to the range [0, 255].
+//
+static inline unsigned char clampFloat(float value)
+{
+    // Written as selects rather than early returns so that loops calling it
+    // still vectorize.
+    value = value < 0 ? 0 : value;
+    value = value > 255 ? 255 : value;
+    return (unsigned char)(value + 0.5f);
+}
+
+//
+// clampIndex - Clamps a row or column index to [0, count - 1], which makes
+// the pixels outside the image copies of the nearest edge pixel.
+//
+static inline int clampIndex(int index, int count)
+{
+    return index < 0 ? 0 : index >= count ? count - 1 : index;
+}
+
+//
+// The convolution loops below take the kernel size as an argument and are
+// always inlined. The wrappers made by CONVOLVE_SIZE pass a constant size,
+// so the compiler unrolls the tap loops completely for each common size and
+// vectorizes the loop over the bytes of a row; any other size runs the same
+// code with a variable size.
+//
+// As in edgeRow, a row is treated as a flat array of bytes whose
+// horizontal neighbours are pitch bytes away (3 for BGR, 4 for BGRA).
+// Bytes within size / 2 pixels of the left or right edge read clamped
+// columns and go through the slower per-byte loops at the end of each
+// function.
+//
+
+// Bytes per block in the convolution loops.
+#define CONVOLVE_BLOCK 64
+
+//
+// convolveRowSized - Applies the full 2-D kernel to one row. rows[y] is the
+// source row under kernel row y, with edge rows already repeated.
+//
+static inline __attribute__((always_inline))
+void convolveRowSized(const unsigned char *const *rows, const struct Kernel *kernel,
+                      unsigned char *restrict out, int width, int pitch, int size)
+{
+    // Local copies keep the stores to out from forcing the weights and
+    // row pointers to be reloaded on every byte.
+    float weights[MAX_KERNEL * MAX_KERNEL];
+    const unsigned char *src[MAX_KERNEL];
+    memcpy(weights, kernel->weights, size * size * sizeof(float));
+    memcpy(src, rows, size * sizeof(*src));
+    float scale = kernel->scale, bias = kernel->bias;
+
+    // Bytes are filtered in blocks with the taps in the outer loops, so the
+    // fixed-length loop over a block vectorizes for any kernel size. The
+    // passes of a separable kernel below are blocked the same way.
+    int radius = size / 2;
+    int begin = pitch * radius, end = pitch * (width - radius);
+    int b = begin;
+    for (; b + CONVOLVE_BLOCK <= end; b += CONVOLVE_BLOCK) {
+        float sum[CONVOLVE_BLOCK] = { 0 };
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                float weight = weights[y * size + x];
+                const unsigned char *p = src[y] + b + pitch * (x - radius);
+                for (int k = 0; k < CONVOLVE_BLOCK; k++) {
+                    sum[k] += weight * p[k];
+                }
+            }
+        }
+        for (int k = 0; k < CONVOLVE_BLOCK; k++) {
+            out[b + k] = clampFloat(sum[k] * scale + bias);
+        }
+    }
+    for (; b < end; b++) {
+        float sum = 0;
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                sum += weights[y * size + x] * src[y][b + pitch * (x - radius)];
+            }
+        }
+        out[b] = clampFloat(sum * scale + bias);
+    }
+    for (int b = 0; b < pitch * width; b++) {
+        if (b == begin && begin < end) {
+            b = end - 1;
+            continue;
+        }
+        int column = b / pitch, channel = b % pitch;
+        float sum = 0;
+        for (int y = 0; y < size; y++) {
+            for (int x = 0; x < size; x++) {
+                int c = clampIndex(column + x - radius, width);
+                sum += weights[y * size + x] * src[y][pitch * c + channel];
+            }
+        }
+        out[b] = clampFloat(sum * scale + bias);
+    }
+}
+
+//
+// convolveHorizontalSized - First pass of a separable kernel: filters one
+// source row with kernel->row into floats.
+//
+static inline __attribute__((always_inline))
+void convolveHorizontalSized(const unsigned char *src, const struct Kernel *kernel,
+                             float *restrict dst, int width, int pitch, int size)
+{
+    float weights[MAX_KERNEL];
+    memcpy(weights, kernel->row, size * sizeof(float));
+
+    int radius = size / 2;
+    int begin = pitch * radius, end = pitch * (width - radius);
+    int b = begin;
+    for (; b + CONVOLVE_BLOCK <= end; b += CONVOLVE_BLOCK) {
+        float sum[CONVOLVE_BLOCK] = { 0 };
+        for (int x = 0; x < size; x++) {
+            const unsigned char *p = src + b + pitch * (x - radius);
+            for (int k = 0; k < CONVOLVE_BLOCK; k++) {
+                sum[k] += weights[x] * p[k];
+            }
+        }
+        memcpy(dst + b, sum, sizeof(sum));
+    }
+    for (; b < end; b++) {
+        float sum = 0;
+        for (int x = 0; x < size; x++) {
+            sum += weights[x] * src[b + pitch * (x - radius)];
+        }
+        dst[b] = sum;
+    }
+    for (int b = 0; b < pitch * width; b++) {
+        if (b == begin && begin < end) {
+            b = end - 1;
+            continue;
+        }
+        int column = b / pitch, channel = b % pitch;
+        float sum = 0;
+        for (int x = 0; x < size; x++) {
+            sum += weights[x] * src[pitch * clampIndex(column + x - radius, width) + channel];
+        }
+        dst[b] = sum;
+    }
+}
+
+//
+// convolveVerticalSized - Second pass of a separable kernel: combines the
+// horizontally filtered rows under each kernel row with kernel->column.
+//
+static inline __attribute__((always_inline))
+void convolveVerticalSized(const float *const *rows, const struct Kernel *kernel,
+                           unsigned char *restrict out, int width, int pitch, int size)
+{
+    float weights[MAX_KERNEL];
+    const float *src[MAX_KERNEL];
+    memcpy(weights, kernel->column, size * sizeof(float));
+    memcpy(src, rows, size * sizeof(*src));
+    float scale = kernel->scale, bias = kernel->bias;
+
+    int b = 0;
+    for (; b + CONVOLVE_BLOCK <= pitch * width; b += CONVOLVE_BLOCK) {
+        float sum[CONVOLVE_BLOCK] = { 0 };
+        for (int y = 0; y < size; y++) {
+            const float *p = src[y] + b;
+            for (int k = 0; k < CONVOLVE_BLOCK; k++) {
+                sum[k] += weights[y] * p[k];
+            }
+        }
+        for (int k = 0; k < CONVOLVE_BLOCK; k++) {
+            out[b + k] = clampFloat(sum[k] * scale + bias);
+        }
+    }
+    for (; b < pitch * width; b++) {
+        float sum = 0;
+        for (int y = 0; y < size; y++) {
+            sum += weights[y] * src[y][b];
+        }
+        out[b] = clampFloat(sum * scale + bias);
+    }
+}
+
+// Row functions for one kernel size.
+struct ConvolveKernels {
+    void (*row)(const unsigned char *const *rows, const struct Kernel *kernel,
+                unsigned char *out, int width, int pitch);
+    void (*horizontal)(const unsigned char *src, const struct Kernel *kernel,
+                       float *dst, int width, int pitch);
+    void (*vertical)(const float *const *rows, const struct Kernel *kernel,
+                     unsigned char *out, int width, int pitch);
+};
+
+// Defines the row functions for kernels of size N and their table entry.
+#define CONVOLVE_SIZE(N)                                                             \
+    static void convolveRow##N(const unsigned char *const *rows,                     \
+                               const struct Kernel *kernel, unsigned char *out,      \
+                               int width, int pitch)                                 \
+    {                                                                                \
+        convolveRowSized(rows, kernel, out, width, pitch, N);                        \
+    }                                                                                \
+    static void convolveHorizontal##N(const unsigned char *src,                      \
+                                      const struct Kernel *kernel, float *dst,       \
+                                      int width, int pitch)                          \
+    {                                                                                \
+        convolveHorizontalSized(src, kernel, dst, width, pitch, N);                  \
+    }                                                                                \
+    static void convolveVertical##N(const float *const *rows,                        \
+                                    const struct Kernel *kernel, unsigned char *out, \
+                                    int width, int pitch)                            \
+    {                                                                                \
+        convolveVerticalSized(rows, kernel, out, width, pitch, N);                   \
+    }                                                                                \
+    static const struct ConvolveKernels convolveKernels##N = {                       \
+        convolveRow##N, convolveHorizontal##N, convolveVertical##N                   \
+    };
+
+CONVOLVE_SIZE(3)
+CONVOLVE_SIZE(5)
+CONVOLVE_SIZE(7)
+
+// Shared state for the band-parallel convolution.
+struct ConvolveJob {
+    const struct BMPImage *image;
+    const struct Kernel *kernel;
+    struct ConvolveKernels kernels; // Row functions for kernel->size (NULL = generic)
+    unsigned char *out;        // Output rows, image->stride bytes apart
+    int bandRows;              // Rows per band (the last band may be shorter)
+    float *scratch;            // kernel->size float rows per worker (separable only)
+    size_t rowFloats;          // Floats per scratch row
+    struct BandWriter *writer; // Writes each finished band to the output file
+};
+
+//
+// copyAlpha - Copies the alpha bytes of width BGRA pixels from src to out.
+//
+static void copyAlpha(unsigned char *out, const unsigned char *src, int width)
+{
+    for (int p = 3; p < 4 * width; p += 4) {
+        out[p] = src[p];
+    }
+}
+
+//
+// convolveBand - Convolves one horizontal band of rows. Kernel row 0 is the
+// top of the kernel, which lies over the row above: the next stored row for
+// bottom-up images, the previous one for top-down images. A separable
+// kernel keeps its horizontally filtered rows in a ring of kernel->size
+// rows, so each source row is filtered horizontally once per band rather
+// than once per output row. BGRA alpha is copied from the source pixel.
+//
+static void convolveBand(void *arg, int band, int worker)
+{
+    struct ConvolveJob *job = arg;
+    const struct BMPImage *image = job->image;
+    const struct Kernel *kernel = job->kernel;
+    int size = kernel->size, radius = size / 2;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > image->height) {
+        last = image->height;
+    }
+    int pitch = image->pixelBytes;
+    int rowBytes = image->width * pitch;
+    int up = image->topDown ? -1 : 1;
+
+    if (!kernel->separable) {
+        const unsigned char *rows[MAX_KERNEL];
+        for (int i = first; i < last; i++) {
+            unsigned char *out = job->out + (size_t)i * image->stride;
+            for (int y = 0; y < size; y++) {
+                rows[y] = bmpRow(image, clampIndex(i + up * (radius - y), image->height));
+            }
+            if (job->kernels.row != NULL) {
+                job->kernels.row(rows, kernel, out, image->width, pitch);
+            }
+            else {
+                convolveRowSized(rows, kernel, out, image->width, pitch, size);
+            }
+            if (pitch == 4) {
+                copyAlpha(out, bmpRow(image, i), image->width);
+            }
+            // Padding bytes are written as 0.
+            memset(out + rowBytes, 0, image->padding);
+        }
+        writeBand(job->writer, first, last);
+        return;
+    }
+
+    // Ring slot s % size holds source row s (before clamping), for s from
+    // i - radius to i + radius.
+    float *ring = job->scratch + (size_t)worker * size * job->rowFloats;
+    const float *rows[MAX_KERNEL];
+    for (int s = first - radius; s < last + radius; s++) {
+        const unsigned char *src = bmpRow(image, clampIndex(s, image->height));
+        float *dst = ring + (size_t)((s % size + size) % size) * job->rowFloats;
+        if (job->kernels.horizontal != NULL) {
+            job->kernels.horizontal(src, kernel, dst, image->width, pitch);
+        }
+        else {
+            convolveHorizontalSized(src, kernel, dst, image->width, pitch, size);
+        }
+        int i = s - radius;
+        if (i < first) {
+            continue;
+        }
+
+        // All the rows under output row i are filtered.
+        for (int y = 0; y < size; y++) {
+            int row = i + up * (radius - y);
+            rows[y] = ring + (size_t)((row % size + size) % size) * job->rowFloats;
+        }
+        unsigned char *out = job->out + (size_t)i * image->stride;
+        if (job->kernels.vertical != NULL) {
+            job->kernels.vertical(rows, kernel, out, image->width, pitch);
+        }
+        else {
+            convolveVerticalSized(rows, kernel, out, image->width, pitch, size);
+        }
+        if (pitch == 4) {
+            copyAlpha(out, bmpRow(image, i), image->width);
+        }
+        memset(out + rowBytes, 0, image->padding);
+    }
+    writeBand(job->writer, first, last);
+}
+
+//
+// convolveOperation - Performs the "conv" operation: applies the kernel
+// given by spec (see parseKernel) to every channel and writes the result to
+// the -o file or "<original>-conv.bmp". Pixels outside the image repeat the
+// nearest edge pixel. Separable kernels run as a horizontal and a vertical
+// 1-D pass, which for a 7x7 blur is 14 taps per byte instead of 49.
+//
+static int convolveOperation(const char *inputFile, const char *spec,
+                             const struct Options *opts, struct ThreadPool *pool)
+{
+    struct Kernel kernel;
+    if (parseKernel(spec, opts->scale, opts->bias, &kernel) != 0) {
+        return 1;
+    }
+
+    char outFilename[4096];
+    if (opts->outFile != NULL) {
+        snprintf(outFilename, sizeof(outFilename), "%s", opts->outFile);
+    }
+    else {
+        outputFileName(inputFile, "-conv.bmp", outFilename, sizeof(outFilename));
+    }
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    int status = convolveFile(inputFile, outFilename, &kernel, pool, &ws);
+    if (opts->stats != STATS_OFF) {
+        printStats("conv", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+//
+// convolveFile - Applies kernel to inputFile and writes the result to
+// outFilename, using (and growing) the buffers in ws.
+//
+static int convolveFile(const char *inputFile, const char *outFilename,
+                        const struct Kernel *kernel, struct ThreadPool *pool,
+                        struct Workspace *ws)
+{
+    double mark = statsMark(ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws->bytesRead += image.mapSize;
+    float factors[2] = { kernel->scale, kernel->bias };
+    uint64_t key = 0, params = hashBytes(kernel->weights, sizeof(float) * kernel->size *
+                                         kernel->size, hashBytes("conv", 4, 0));
+    if (cacheFetch(ws, &image, hashBytes(factors, sizeof(factors), params),
+                   outFilename, &key) == 0) {
+        unloadBMP(&image);
+        statsLap(ws, PHASE_DECODE, &mark);
+        return 0;
+    }
+
+    struct ConvolveJob job;
+    memset(&job, 0, sizeof(job));
+    job.rowFloats = ((size_t)image.width * image.pixelBytes + 15) & ~(size_t)15;
+    arenaReset(&ws->arena);
+    job.out = outputPixels(ws, image.map, image.header.offset, image.stride * image.height);
+    if (kernel->separable) {
+        job.scratch = arenaAlloc(&ws->arena, (size_t)pool->threads * kernel->size *
+                                 job.rowFloats * sizeof(float));
+    }
+    struct BandWriter writer;
+    if (job.out == NULL || (kernel->separable && job.scratch == NULL) ||
+        openBandWriter(&writer, outFilename, image.map, image.header.offset, job.out,
+                       image.stride, image.height, ws->direct) != 0) {
+        unloadBMP(&image);
+        return 1;
+    }
+    statsLap(ws, PHASE_DECODE, &mark);
+
+    job.image = &image;
+    job.writer = &writer;
+    job.kernel = kernel;
+    switch (kernel->size) {
+    case 3:
+        job.kernels = convolveKernels3;
+        break;
+    case 5:
+        job.kernels = convolveKernels5;
+        break;
+    case 7:
+        job.kernels = convolveKernels7;
+        break;
+    }
+    job.bandRows = bandRowsFor(pool, image.height);
+    poolRun(pool, (image.height + job.bandRows - 1) / job.bandRows, convolveBand, &job);
+    statsLap(ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, ws);
+    if (status == 0) {
+        cacheStore(ws, key, outFilename);
+    }
+    unloadBMP(&image);
+    statsLap(ws, PHASE_ENCODE, &mark);
+    return status;
+}
+
+//
+// borderIndex - Maps a row or column index that may lie outside
+// [0, count - 1] back into the image according to the Border policy.
+//
+static inline int borderIndex(int index, int count, int border)
+{
+    if (index >= 0 && index < count) {
+        return index;
+    }
+    if (border == BORDER_REPLICATE || count == 1) {
+        return index < 0 ? 0 : count - 1;
+    }
+    // Reflect about the edge pixels until the index is inside.
+    while (index < 0 || index >= count) {
+        index = index < 0 ? -index : 2 * (count - 1) - index;
+    }
+    return index;
+}
+
+// Shared state for the band-parallel canny passes. The planes hold one
+// value per pixel, width values per row, rows in the order they are stored.
+struct CannyJob {
+    const struct BMPImage *image;
+    int pass;                  // CannyPass being run
+    int border;                // Border policy
+    int radius;                // Gaussian radius
+    int weights[2 * CANNY_RADIUS + 1]; // Gaussian weights summing to 256
+    int low, high;             // Hysteresis thresholds on |gx| + |gy|
+    int bits;                  // Output bits per pixel, 1 or 8
+    uint16_t *blurred;         // Horizontally blurred luma, times 256
+    unsigned char *smooth;     // Smoothed luma
+    uint16_t *magnitude;       // |gx| + |gy|
+    unsigned char *sector;     // Gradient direction: 0 horizontal, 1 and 3
+                               // diagonal, 2 vertical
+    unsigned char *edges;      // 0 suppressed, 1 weak, 2 strong (an edge)
+    unsigned char *scratch;    // Per-worker scratch for a row or a band stack
+    size_t scratchSize;        // Bytes of scratch per worker
+    int parity;                // Bands linked by this CANNY_LINK pass
+    int changed;               // Set when a CANNY_LINK pass adds edges
+    unsigned char *out;        // Output rows, outStride bytes apart
+    size_t outStride;
+    int bandRows;              // Rows per band (the last band may be shorter)
+    struct BandWriter *writer; // Writes each packed band to the output file
+    unsigned char *rle;        // --rle: RLE8 rows of each band, rleBand bytes apart
+    size_t rleBand;            // Most bytes one band can encode to
+    size_t *rleSize;           // Bytes each band encoded to
+};
+
+//
+// cannyBlurRow - Converts stored row i to luma and blurs it horizontally
+// into the blurred plane. Columns within radius of either side use the
+// border policy; the columns between them need no index checks.
+//
+static void cannyBlurRow(const struct CannyJob *job, int i, unsigned char *luma)
+{
+    const struct BMPImage *image = job->image;
+    const unsigned char *src = bmpRow(image, i);
+    int width = image->width, radius = job->radius, pitch = image->pixelBytes;
+    uint16_t *restrict dst = job->blurred + (size_t)i * width;
+
+    // ITU-R BT.601 weights, scaled to 256.
+    for (int x = 0; x < width; x++) {
+        const unsigned char *p = src + (size_t)x * pitch;
+        luma[x] = (unsigned char)((29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8);
+    }
+
+    int begin = radius < width ? radius : width;
+    int end = width - radius > begin ? width - radius : begin;
+    for (int x = 0; x < width; x++) {
+        if (x == begin) {
+            for (; x < end; x++) {
+                int sum = 0;
+                for (int k = 0; k <= 2 * radius; k++) {
+                    sum += job->weights[k] * luma[x - radius + k];
+                }
+                dst[x] = (uint16_t)sum;
+            }
+            if (x == width) {
+                break;
+            }
+        }
+        int sum = 0;
+        for (int k = 0; k <= 2 * radius; k++) {
+            sum += job->weights[k] * luma[borderIndex(x - radius + k, width, job->border)];
+        }
+        dst[x] = (uint16_t)sum;
+    }
+}
+
+//
+// cannyBlurColumns - Blurs stored row i of the blurred plane vertically
+// into the smoothed plane, rounding the 16-bit fixed-point result.
+//
+static void cannyBlurColumns(const struct CannyJob *job, int i, uint32_t *restrict sum)
+{
+    int width = job->image->width, height = job->image->height;
+    memset(sum, 0, (size_t)width * sizeof(uint32_t));
+    for (int k = 0; k <= 2 * job->radius; k++) {
+        const uint16_t *restrict row = job->blurred +
+            (size_t)borderIndex(i - job->radius + k, height, job->border) * width;
+        uint32_t weight = job->weights[k];
+        for (int x = 0; x < width; x++) {
+            sum[x] += weight * row[x];
+        }
+    }
+    unsigned char *restrict dst = job->smooth + (size_t)i * width;
+    for (int x = 0; x < width; x++) {
+        dst[x] = (unsigned char)((sum[x] + 32768) >> 16);
+    }
+}
+
+//
+// cannyGradient - Sobel gradient of the smoothed pixel at column x, with
+// neighbouring columns left and right, in rows above, row and below.
+// Stores |gx| + |gy| and the direction sector. A gradient within 22.5
+// degrees of an axis (tan 22.5 is about 53/128) is horizontal (0) or
+// vertical (2); otherwise it is diagonal, 1 when gx and gy have the same
+// sign and 3 when they differ.
+//
+static inline void cannyGradient(const unsigned char *above, const unsigned char *row,
+                                 const unsigned char *below, int left, int x, int right,
+                                 uint16_t *magnitude, unsigned char *sector)
+{
+    int gx = (above[right] + 2 * row[right] + below[right]) -
+             (above[left] + 2 * row[left] + below[left]);
+    int gy = (below[left] + 2 * below[x] + below[right]) -
+             (above[left] + 2 * above[x] + above[right]);
+    int ax = gx < 0 ? -gx : gx, ay = gy < 0 ? -gy : gy;
+    *magnitude = (uint16_t)(ax + ay);
+    *sector = 128 * ay <= 53 * ax ? 0 : 128 * ax <= 53 * ay ? 2 : (gx ^ gy) >= 0 ? 1 : 3;
+}
+
+//
+// cannyGradientRow - Computes the gradient of every pixel of stored row i.
+//
+static void cannyGradientRow(const struct CannyJob *job, int i)
+{
+    int width = job->image->width, height = job->image->height;
+    const unsigned char *above = job->smooth +
+        (size_t)borderIndex(i - 1, height, job->border) * width;
+    const unsigned char *row = job->smooth + (size_t)i * width;
+    const unsigned char *below = job->smooth +
+        (size_t)borderIndex(i + 1, height, job->border) * width;
+    uint16_t *magnitude = job->magnitude + (size_t)i * width;
+    unsigned char *sector = job->sector + (size_t)i * width;
+
+    for (int x = 0; x < width; x++) {
+        if (x == 1) {
+            for (; x < width - 1; x++) {
+                cannyGradient(above, row, below, x - 1, x, x + 1, &magnitude[x], &sector[x]);
+            }
+            if (x == width) {
+                break;
+            }
+        }
+        cannyGradient(above, row, below, borderIndex(x - 1, width, job->border), x,
+                      borderIndex(x + 1, width, job->border), &magnitude[x], &sector[x]);
+    }
+}
+
+//
+// cannySuppressRow - Keeps the pixels of stored row i whose gradient
+// magnitude is a maximum along the gradient direction and at least the low
+// threshold, marking them strong (2) from the high threshold up and weak
+// (1) below it. A pixel must beat one neighbour and at least equal the
+// other, so plateaus stay one pixel thick. Sectors come from stored rows,
+// which mirrors the diagonals of a bottom-up image along with its rows, but
+// not the vertical step: that one is flipped so ties break toward the same
+// visual row whichever way the file stores the picture.
+//
+static void cannySuppressRow(const struct CannyJob *job, int i)
+{
+    static const int steps[4][2] = { { 1, 0 }, { 1, 1 }, { 0, 1 }, { 1, -1 } };
+    int width = job->image->width, height = job->image->height;
+    int down = job->image->topDown ? 1 : -1;
+    const uint16_t *magnitude = job->magnitude;
+    size_t base = (size_t)i * width;
+
+    for (int x = 0; x < width; x++) {
+        int m = magnitude[base + x];
+        unsigned char edge = 0;
+        if (m >= job->low) {
+            const int *step = steps[job->sector[base + x]];
+            int dy = step[0] == 0 ? down * step[1] : step[1];
+            int y1 = borderIndex(i + dy, height, job->border);
+            int y2 = borderIndex(i - dy, height, job->border);
+            int x1 = borderIndex(x + step[0], width, job->border);
+            int x2 = borderIndex(x - step[0], width, job->border);
+            if (m > magnitude[(size_t)y1 * width + x1] &&
+                m >= magnitude[(size_t)y2 * width + x2]) {
+                edge = m >= job->high ? 2 : 1;
+            }
+        }
+        job->edges[base + x] = edge;
+    }
+}
+
+//
+// cannyFlood - Marks as strong every weak pixel of rows [first, last)
+// connected to the count strong pixels already on stack, which holds
+// offsets from the start of row first. Returns the number of pixels marked.
+//
+static int cannyFlood(const struct CannyJob *job, int first, int last, int *stack, int count)
+{
+    int width = job->image->width, marked = 0;
+    unsigned char *edges = job->edges + (size_t)first * width;
+    int rows = last - first;
+    while (count > 0) {
+        int p = stack[--count];
+        int y = p / width, x = p % width;
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                int ny = y + dy, nx = x + dx;
+                if (ny < 0 || ny >= rows || nx < 0 || nx >= width) {
+                    continue;
+                }
+                int q = ny * width + nx;
+                if (edges[q] == 1) {
+                    edges[q] = 2;
+                    stack[count++] = q;
+                    marked++;
+                }
+            }
+        }
+    }
+    return marked;
+}
+
+//
+// cannyLinkRow - Pushes onto stack the weak pixels of stored row i that
+// touch a strong pixel of the neighbouring row n (outside the band) and
+// marks them strong. Returns the new stack size.
+//
+static int cannyLinkRow(const struct CannyJob *job, int i, int n, int first, int *stack,
+                        int count)
+{
+    int width = job->image->width;
+    unsigned char *row = job->edges + (size_t)i * width;
+    const unsigned char *next = job->edges + (size_t)n * width;
+    for (int x = 0; x < width; x++) {
+        if (row[x] == 1 && (next[x] == 2 || (x > 0 && next[x - 1] == 2) ||
+                            (x + 1 < width && next[x + 1] == 2))) {
+            row[x] = 2;
+            stack[count++] = (i - first) * width + x;
+        }
+    }
+    return count;
+}
+
+//
+// cannyPackRow - Writes stored row i of the edge map as an output row:
+// one byte (0 or 255) or one bit (most significant first) per pixel.
+//
+static void cannyPackRow(const struct CannyJob *job, int i)
+{
+    int width = job->image->width;
+    const unsigned char *edges = job->edges + (size_t)i * width;
+    unsigned char *out = job->out + (size_t)i * job->outStride;
+    memset(out, 0, job->outStride);
+    if (job->bits == 8) {
+        for (int x = 0; x < width; x++) {
+            out[x] = edges[x] == 2 ? 255 : 0;
+        }
+        return;
+    }
+    for (int x = 0; x < width; x++) {
+        out[x >> 3] |= (edges[x] == 2) << (7 - (x & 7));
+    }
+}
+
+//
+// rleRunLength - Returns how many of the first limit bytes at p equal p[0],
+// comparing eight bytes at a time while they match.
+//
+static int rleRunLength(const unsigned char *p, int limit)
+{
+    uint64_t pattern = p[0] * 0x0101010101010101ull;
+    int n = 1;
+    while (n + 8 <= limit) {
+        uint64_t word;
+        memcpy(&word, p + n, sizeof(word));
+        if (word != pattern) {
+            break;
+        }
+        n += 8;
+    }
+    while (n < limit && p[n] == p[0]) {
+        n++;
+    }
+    return n;
+}
+
+//
+// rleEncodeRow - Encodes width 8-bit indices as one BI_RLE8 row, ending
+// with an end-of-line escape, at out. Runs of three or more are encoded
+// as (count, index); other stretches go in absolute runs of up to 255,
+// padded to an even length. Each pixel costs at most 2 bytes, so a row
+// takes at most 2 * width + 2. Returns the bytes written.
+//
+static size_t rleEncodeRow(const unsigned char *row, int width, unsigned char *out)
+{
+    unsigned char *start = out;
+    int x = 0;
+    while (x < width) {
+        int limit = width - x < 255 ? width - x : 255;
+        int run = rleRunLength(row + x, limit);
+        int end = x + run;
+        if (run < 3) {
+            // Take pixels up to the next run of three, for an absolute run.
+            while (end < x + limit) {
+                int next = rleRunLength(row + end, x + limit - end);
+                if (next >= 3) {
+                    break;
+                }
+                end += next;
+            }
+        }
+        if (run >= 3 || end - x < 3) {
+            *out++ = (unsigned char)run;
+            *out++ = row[x];
+            x += run;
+            continue;
+        }
+        int count = end - x;
+        *out++ = 0;
+        *out++ = (unsigned char)count;
+        memcpy(out, row + x, count);
+        out += count;
+        if (count % 2 != 0) {
+            *out++ = 0;
+        }
+        x = end;
+    }
+    *out++ = 0;
+    *out++ = 0;
+    return (size_t)(out - start);
+}
+
+//
+// cannyRleBand - Encodes rows [first, last) of the packed output as RLE8
+// into the band's part of job->rle. RLE8 rows are always stored bottom-up,
+// so rows are counted from the bottom of the image.
+//
+static void cannyRleBand(struct CannyJob *job, int band, int first, int last)
+{
+    const struct BMPImage *image = job->image;
+    unsigned char *out = job->rle + (size_t)band * job->rleBand;
+    size_t size = 0;
+    for (int r = first; r < last; r++) {
+        int i = image->topDown ? image->height - 1 - r : r;
+        size += rleEncodeRow(job->out + (size_t)i * job->outStride, image->width,
+                             out + size);
+    }
+    job->rleSize[band] = size;
+}
+
+//
+// cannyBand - Runs the current canny pass over one band of rows.
+//
+static void cannyBand(void *arg, int index, int worker)
+{
+    struct CannyJob *job = arg;
+    int height = job->image->height;
+    int band = job->pass == CANNY_LINK ? 2 * index + job->parity : index;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > height) {
+        last = height;
+    }
+    unsigned char *scratch = job->scratch + (size_t)worker * job->scratchSize;
+    int *stack = (int *)scratch;
+    int count = 0;
+
+    switch (job->pass) {
+    case CANNY_BLUR_ROWS:
+        for (int i = first; i < last; i++) {
+            cannyBlurRow(job, i, scratch);
+        }
+        break;
+    case CANNY_BLUR_COLUMNS:
+        for (int i = first; i < last; i++) {
+            cannyBlurColumns(job, i, (uint32_t *)scratch);
+        }
+        break;
+    case CANNY_GRADIENT:
+        for (int i = first; i < last; i++) {
+            cannyGradientRow(job, i);
+        }
+        break;
+    case CANNY_SUPPRESS:
+        for (int i = first; i < last; i++) {
+            cannySuppressRow(job, i);
+        }
+        break;
+    case CANNY_TRACE:
+        // Start from every strong pixel of the band.
+        for (int p = 0; p < (last - first) * job->image->width; p++) {
+            if (job->edges[(size_t)first * job->image->width + p] == 2) {
+                stack[count++] = p;
+            }
+        }
+        cannyFlood(job, first, last, stack, count);
+        break;
+    case CANNY_LINK:
+        // Start from the weak pixels on the band's edges that touch strong
+        // pixels in the bands above and below, which no pass is changing.
+        if (first > 0) {
+            count = cannyLinkRow(job, first, first - 1, first, stack, count);
+        }
+        if (last < height) {
+            count = cannyLinkRow(job, last - 1, last, first, stack, count);
+        }
+        if (count > 0) {
+            cannyFlood(job, first, last, stack, count);
+            __atomic_store_n(&job->changed, 1, __ATOMIC_RELAXED);
+        }
+        break;
+    case CANNY_PACK:
+        for (int i = first; i < last; i++) {
+            cannyPackRow(job, i);
+        }
+        if (job->writer != NULL) {
+            writeBand(job->writer, first, last);
+        }
+        break;
+    case CANNY_RLE:
+        cannyRleBand(job, band, first, last);
+        break;
+    }
+}
+
+//
+// encodeIndexedHeader - Builds the header of an uncompressed 1- or 8-bit
+// BMP with a black-to-white palette: the 54-byte headers followed by
+// 2 or 256 palette entries. A negative height stores rows top-down.
+// Returns the header size.
+//
+static size_t encodeIndexedHeader(unsigned char *buffer, int width, int height, int bits)
+{
+    int colors = 1 << bits;
+    size_t stride = (((size_t)width * bits + 31) / 32) * 4;
+    size_t headerSize = BMP_HEADER_SIZE + 4 * (size_t)colors;
+    size_t imageSize = stride * (size_t)(height < 0 ? -height : height);
+    unsigned int fields[13] = {
+        (unsigned int)(headerSize + imageSize), 0, (unsigned int)headerSize,
+        40, (unsigned int)width, (unsigned int)height, 1 | ((unsigned int)bits << 16), 0,
+        (unsigned int)imageSize, 2835, 2835, (unsigned int)colors, 0
+    };
+
+    buffer[0] = 'B';
+    buffer[1] = 'M';
+    for (int f = 0; f < 13; f++) {
+        for (int b = 0; b < 4; b++) {
+            buffer[2 + 4 * f + b] = (unsigned char)(fields[f] >> (8 * b));
+        }
+    }
+    for (int c = 0; c < colors; c++) {
+        unsigned char level = (unsigned char)(c * 255 / (colors - 1));
+        unsigned char *entry = buffer + BMP_HEADER_SIZE + 4 * c;
+        entry[0] = entry[1] = entry[2] = level;
+        entry[3] = 0;
+    }
+    return headerSize;
+}
+
+//
+// cannyWriteRle - Writes the RLE8 bands of job to outFilename after the
+// headerSize-byte header, which is changed to describe the compressed
+// data, and ends the bitmap. Returns 0 on success.
+//
+static int cannyWriteRle(const struct CannyJob *job, const char *outFilename,
+                         unsigned char *header, size_t headerSize, int bands,
+                         struct Workspace *ws)
+{
+    static const unsigned char endOfBitmap[2] = { 0, 1 };
+    size_t imageSize = sizeof(endOfBitmap);
+    for (int b = 0; b < bands; b++) {
+        imageSize += job->rleSize[b];
+    }
+    writeLE32(header + 2, (uint32_t)(headerSize + imageSize));
+    writeLE32(header + 30, 1);
+    writeLE32(header + 34, (uint32_t)imageSize);
+
+    detachOutput(outFilename);
+    FILE *fp = fopen(outFilename, "wb");
+    if (fp == NULL) {
+        perror("Error creating output file");
+        return 1;
+    }
+    fwrite(header, 1, headerSize, fp);
+    for (int b = 0; b < bands; b++) {
+        fwrite(job->rle + (size_t)b * job->rleBand, 1, job->rleSize[b], fp);
+    }
+    fwrite(endOfBitmap, 1, sizeof(endOfBitmap), fp);
+    if (ferror(fp) | (fclose(fp) != 0)) {
+        perror("Error writing output file");
+        return 1;
+    }
+    ws->bytesWritten += headerSize + imageSize;
+    return 0;
+}
+
+//
+// cannyOperation - Performs the "canny" operation: Canny edge detection on
+// the luma of the image, written to the -o file or "<original>-canny.bmp"
+// as an 8-bit (0 or 255) or 1-bit edge map. The image is smoothed with a
+// Gaussian of --sigma, Sobel gradients are measured as |gx| + |gy|, thin
+// edges are kept by non-maximum suppression, and hysteresis keeps weak
+// edges (from --low) that connect to strong ones (from --high). Every pass
+// runs band-parallel; --border chooses how pixels outside the image are
+// read. Top-down images give top-down output.
+//
+static int cannyOperation(const char *inputFile, const struct Options *opts,
+                          struct ThreadPool *pool)
+{
+    if (opts->low > opts->high) {
+        fprintf(stderr, "The low threshold must not exceed the high threshold.\n");
+        return 1;
+    }
+    if (opts->rle && opts->bits != 8) {
+        fprintf(stderr, "RLE8 output needs 8 bits per pixel.\n");
+        return 1;
+    }
+    char outFilename[4096];
+    if (opts->outFile != NULL) {
+        snprintf(outFilename, sizeof(outFilename), "%s", opts->outFile);
+    }
+    else {
+        outputFileName(inputFile, "-canny.bmp", outFilename, sizeof(outFilename));
+    }
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+
+    // Gaussian weights in fixed point, rounded to sum to exactly 256.
+    struct CannyJob job;
+    memset(&job, 0, sizeof(job));
+    job.image = &image;
+    job.border = opts->border;
+    job.low = opts->low;
+    job.high = opts->high;
+    job.bits = opts->bits;
+    job.radius = (int)ceil(3 * opts->sigma);
+    double gauss[2 * CANNY_RADIUS + 1], total = 0;
+    for (int k = 0; k <= 2 * job.radius; k++) {
+        double d = k - job.radius;
+        gauss[k] = exp(-d * d / (2 * opts->sigma * opts->sigma));
+        total += gauss[k];
+    }
+    int sum = 0;
+    for (int k = 0; k <= 2 * job.radius; k++) {
+        job.weights[k] = (int)lround(256 * gauss[k] / total);
+        sum += job.weights[k];
+    }
+    job.weights[job.radius] += 256 - sum;
+
+    // The planes, the output rows and per-worker scratch: a row of luma or
+    // 32-bit sums, or a flood-fill stack covering a whole band.
+    size_t pixels = (size_t)image.width * image.height;
+    job.bandRows = bandRowsFor(pool, image.height);
+    job.outStride = (((size_t)image.width * job.bits + 31) / 32) * 4;
+    job.scratchSize = (size_t)job.bandRows * image.width * sizeof(int);
+    if (job.scratchSize < (size_t)image.width * sizeof(uint32_t)) {
+        job.scratchSize = (size_t)image.width * sizeof(uint32_t);
+    }
+    job.scratchSize = (job.scratchSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    unsigned char header[BMP_HEADER_SIZE + 4 * 256];
+    size_t headerSize = encodeIndexedHeader(header, image.width,
+                                            image.topDown && !opts->rle ? -image.height :
+                                            image.height, job.bits);
+    int bands = (image.height + job.bandRows - 1) / job.bandRows;
+    if (opts->rle) {
+        job.rleBand = (size_t)job.bandRows * (2 * (size_t)image.width + 2);
+        job.rle = arenaAlloc(&ws.arena, bands * job.rleBand);
+        job.rleSize = arenaAlloc(&ws.arena, bands * sizeof(size_t));
+    }
+    job.blurred = arenaAlloc(&ws.arena, pixels * sizeof(uint16_t));
+    job.smooth = arenaAlloc(&ws.arena, pixels);
+    job.magnitude = arenaAlloc(&ws.arena, pixels * sizeof(uint16_t));
+    job.sector = arenaAlloc(&ws.arena, pixels);
+    job.edges = arenaAlloc(&ws.arena, pixels);
+    job.scratch = arenaAlloc(&ws.arena, pool->threads * job.scratchSize);
+    job.out = outputPixels(&ws, header, headerSize, job.outStride * image.height);
+    struct BandWriter writer;
+    if (job.blurred == NULL || job.smooth == NULL || job.magnitude == NULL ||
+        job.sector == NULL || job.edges == NULL || job.scratch == NULL || job.out == NULL ||
+        (opts->rle && (job.rle == NULL || job.rleSize == NULL)) ||
+        (!opts->rle && openBandWriter(&writer, outFilename, header, headerSize, job.out,
+                                      job.outStride, image.height, ws.direct) != 0)) {
+        unloadBMP(&image);
+        freeWorkspace(&ws);
+        return 1;
+    }
+    job.writer = opts->rle ? NULL : &writer;
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    for (job.pass = CANNY_BLUR_ROWS; job.pass <= CANNY_PACK; job.pass++) {
+        if (job.pass != CANNY_LINK) {
+            poolRun(pool, bands, cannyBand, &job);
+            continue;
+        }
+        // Link even bands to their neighbours, then odd ones, until an
+        // edge no longer crosses into another band.
+        do {
+            job.changed = 0;
+            for (job.parity = 0; job.parity < 2; job.parity++) {
+                poolRun(pool, (bands - job.parity + 1) / 2, cannyBand, &job);
+            }
+        } while (job.changed);
+    }
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    int status;
+    if (opts->rle) {
+        double start = monotonicSeconds();
+        job.pass = CANNY_RLE;
+        poolRun(pool, bands, cannyBand, &job);
+        double seconds = monotonicSeconds() - start;
+        status = cannyWriteRle(&job, outFilename, header, headerSize, bands, &ws);
+        size_t plain = headerSize + job.outStride * image.height;
+        if (status == 0) {
+            printf("RLE8: %llu bytes, %.1f%% of the %zu-byte uncompressed file, "
+                   "encoded at %.1f MB/s\n", ws.bytesWritten, 100.0 * ws.bytesWritten / plain,
+                   plain, job.outStride * image.height / seconds / 1e6);
+        }
+    }
+    else {
+        status = closeBandWriter(&writer, &ws);
+    }
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("canny", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+// Largest radius denoise accepts. A column histogram counts 2 * radius + 1
+// rows, which must fit in a byte.
+#define DENOISE_MAX_RADIUS 127
+
+// Fine and coarse histogram bins per channel: one per value, and one per
+// 16 values.
+#define MEDIAN_BINS 256
+#define MEDIAN_COARSE 16
+
+// Shared state for the band-parallel denoise operation.
+struct DenoiseJob {
+    const struct BMPImage *image;
+    int radius;                // Window radius
+    int border;                // Border policy
+    MedianSpan span;           // Median kernel for radius 1 or 2 (NULL = histogram)
+    unsigned char *out;        // Output rows, image->stride bytes apart
+    int bandRows;              // Rows per band (the last band may be shorter)
+    unsigned char *scratch;    // Per-worker column histograms
+    size_t scratchSize;        // Bytes of scratch per worker
+    struct BandWriter *writer; // Writes each finished band to the output file
+};
+
+//
+// denoiseNetworkRow - Median filters stored row i with a sorting network.
+// The bytes at least radius pixels from either side go to the vector
+// kernel; the rest read the columns the border policy gives them.
+//
+static void denoiseNetworkRow(const struct DenoiseJob *job, int i, unsigned char *out)
+{
+    const struct BMPImage *image = job->image;
+    int radius = job->radius, size = 2 * radius + 1;
+    int width = image->width, pitch = image->pixelBytes;
+    const unsigned char *rows[5];
+    for (int y = 0; y < size; y++) {
+        rows[y] = bmpRow(image, borderIndex(i + y - radius, image->height, job->border));
+    }
+
+    int begin = pitch * radius, end = pitch * (width - radius);
+    if (begin < end) {
+        job->span(rows, out, begin, end, pitch);
+    }
+    for (int b = 0; b < pitch * width; b++) {
+        if (b == begin && begin < end) {
+            b = end - 1;
+            continue;
+        }
+        int column = b / pitch, channel = b % pitch;
+        int v[25];
+        for (int k = 0; k < size * size; k++) {
+            int c = borderIndex(column + k % size - radius, width, job->border);
+            v[k] = rows[k / size][pitch * c + channel];
+        }
+        out[b] = (unsigned char)medianNetwork(v, size);
+    }
+}
+
+//
+// histogramAddRow - Adds (delta 1) or removes (delta -1) the B, G and R
+// values of a source row to the histograms of every column.
+//
+static void histogramAddRow(unsigned char *fine, unsigned char *coarse,
+                            const unsigned char *row, int width, int pitch, int delta)
+{
+    for (int x = 0; x < width; x++) {
+        for (int c = 0; c < 3; c++) {
+            int value = row[(size_t)x * pitch + c];
+            size_t h = (size_t)x * 3 + c;
+            fine[h * MEDIAN_BINS + value] += (unsigned char)delta;
+            coarse[h * MEDIAN_COARSE + (value >> 4)] += (unsigned char)delta;
+        }
+    }
+}
+
+//
+// histogramAddColumn - Adds (sign 1) or subtracts (sign -1) the three
+// channel histograms of one column to the window histograms. The loops
+// have a fixed length and vectorize.
+//
+static inline void histogramAddColumn(uint16_t *restrict windowFine,
+                                      uint16_t *restrict windowCoarse,
+                                      const unsigned char *fine,
+                                      const unsigned char *coarse, int sign)
+{
+    for (int k = 0; k < 3 * MEDIAN_BINS; k++) {
+        windowFine[k] += (uint16_t)(sign * fine[k]);
+    }
+    for (int k = 0; k < 3 * MEDIAN_COARSE; k++) {
+        windowCoarse[k] += (uint16_t)(sign * coarse[k]);
+    }
+}
+
+//
+// histogramMedian - Returns the value of the given rank (counting from 0)
+// in a window histogram: the coarse bins find the group of 16 values it is
+// in, so at most 32 bins are read.
+//
+static inline unsigned char histogramMedian(const uint16_t *fine, const uint16_t *coarse,
+                                            int rank)
+{
+    int group = 0;
+    while (rank >= coarse[group]) {
+        rank -= coarse[group++];
+    }
+    int value = group * 16;
+    while (rank >= fine[value]) {
+        rank -= fine[value++];
+    }
+    return (unsigned char)value;
+}
+
+//
+// denoiseHistogramBand - Median filters a band of rows with sliding
+// histograms (Perreault and Hebert). Every column keeps a histogram of the
+// 2 * radius + 1 rows around the current row, updated by one row in and
+// one row out per output row. The window histogram is the sum of the
+// column histograms around x, updated by one column in and one out per
+// pixel, so the cost per pixel does not depend on the radius.
+//
+static void denoiseHistogramBand(const struct DenoiseJob *job, int first, int last,
+                                 unsigned char *scratch)
+{
+    const struct BMPImage *image = job->image;
+    int radius = job->radius, size = 2 * radius + 1;
+    int width = image->width, height = image->height, pitch = image->pixelBytes;
+    int border = job->border, rank = size * size / 2;
+    unsigned char *fine = scratch;
+    unsigned char *coarse = fine + (size_t)width * 3 * MEDIAN_BINS;
+    uint16_t *windowFine = (uint16_t *)(coarse + (size_t)width * 3 * MEDIAN_COARSE);
+    uint16_t *windowCoarse = windowFine + 3 * MEDIAN_BINS;
+    size_t fineColumn = 3 * MEDIAN_BINS, coarseColumn = 3 * MEDIAN_COARSE;
+
+    memset(fine, 0, (size_t)width * (fineColumn + coarseColumn));
+    for (int y = first - radius; y <= first + radius; y++) {
+        histogramAddRow(fine, coarse, bmpRow(image, borderIndex(y, height, border)),
+                        width, pitch, 1);
+    }
+
+    for (int i = first; i < last; i++) {
+        if (i > first) {
+            histogramAddRow(fine, coarse,
+                            bmpRow(image, borderIndex(i - radius - 1, height, border)),
+                            width, pitch, -1);
+            histogramAddRow(fine, coarse,
+                            bmpRow(image, borderIndex(i + radius, height, border)),
+                            width, pitch, 1);
+        }
+
+        memset(windowFine, 0, (fineColumn + coarseColumn) * sizeof(uint16_t));
+        for (int x = -radius; x <= radius; x++) {
+            size_t c = borderIndex(x, width, border);
+            histogramAddColumn(windowFine, windowCoarse, fine + c * fineColumn,
+                               coarse + c * coarseColumn, 1);
+        }
+        unsigned char *out = job->out + (size_t)i * image->stride;
+        for (int x = 0; x < width; x++) {
+            if (x > 0) {
+                size_t in = borderIndex(x + radius, width, border);
+                size_t gone = borderIndex(x - radius - 1, width, border);
+                histogramAddColumn(windowFine, windowCoarse, fine + in * fineColumn,
+                                   coarse + in * coarseColumn, 1);
+                histogramAddColumn(windowFine, windowCoarse, fine + gone * fineColumn,
+                                   coarse + gone * coarseColumn, -1);
+            }
+            for (int c = 0; c < 3; c++) {
+                out[(size_t)x * pitch + c] =
+                    histogramMedian(windowFine + c * MEDIAN_BINS,
+                                    windowCoarse + c * MEDIAN_COARSE, rank);
+            }
+        }
+    }
+}
+
+//
+// denoiseBand - Median filters one horizontal band of rows. BGRA alpha is
+// copied from the source pixel.
+//
+static void denoiseBand(void *arg, int band, int worker)
+{
+    struct DenoiseJob *job = arg;
+    const struct BMPImage *image = job->image;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > image->height) {
+        last = image->height;
+    }
+
+    if (job->span == NULL) {
+        denoiseHistogramBand(job, first, last,
+                             job->scratch + (size_t)worker * job->scratchSize);
+    }
+    for (int i = first; i < last; i++) {
+        unsigned char *out = job->out + (size_t)i * image->stride;
+        if (job->span != NULL) {
+            denoiseNetworkRow(job, i, out);
+        }
+        if (image->pixelBytes == 4) {
+            copyAlpha(out, bmpRow(image, i), image->width);
+        }
+        // Padding bytes are written as 0.
+        memset(out + (size_t)image->width * image->pixelBytes, 0, image->padding);
+    }
+    writeBand(job->writer, first, last);
+}
+
+//
+// denoiseOperation - Performs the "denoise" operation: a median filter over
+// a (2 * --radius + 1)-square window of each channel, written to the -o file
+// or "<original>-denoise.bmp". Radius 1 and 2 (3x3 and 5x5) use sorting
+// networks on vector registers; larger radii use sliding histograms whose
+// cost per pixel does not grow with the window. Rows are filtered in
+// parallel bands as in conv, and --border chooses how pixels outside the
+// image are read.
+//
+static int denoiseOperation(const char *inputFile, const struct Options *opts,
+                            struct ThreadPool *pool)
+{
+    if (opts->radius > DENOISE_MAX_RADIUS) {
+        fprintf(stderr, "Radius must be from 1 to %d for denoise.\n", DENOISE_MAX_RADIUS);
+        return 1;
+    }
+    char outFilename[4096];
+    if (opts->outFile != NULL) {
+        snprintf(outFilename, sizeof(outFilename), "%s", opts->outFile);
+    }
+    else {
+        outputFileName(inputFile, "-denoise.bmp", outFilename, sizeof(outFilename));
+    }
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+
+    struct DenoiseJob job;
+    memset(&job, 0, sizeof(job));
+    job.image = &image;
+    job.radius = opts->radius;
+    job.border = opts->border;
+    job.span = opts->radius == 1 ? medianSpan3 : opts->radius == 2 ? medianSpan5 : NULL;
+    job.bandRows = bandRowsFor(pool, image.height);
+    if (job.span == NULL) {
+        // Each band starts by filling the column histograms from
+        // 2 * radius + 1 rows; taller bands keep that a small part of the work.
+        int size = 2 * job.radius + 1;
+        if (job.bandRows < 4 * size) {
+            job.bandRows = 4 * size;
+        }
+        job.scratchSize = (size_t)image.width * 3 * (MEDIAN_BINS + MEDIAN_COARSE) +
+                          3 * (MEDIAN_BINS + MEDIAN_COARSE) * sizeof(uint16_t);
+        job.scratchSize = (job.scratchSize + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    }
+    arenaReset(&ws.arena);
+    job.out = outputPixels(&ws, image.map, image.header.offset, image.stride * image.height);
+    if (job.span == NULL) {
+        job.scratch = arenaAlloc(&ws.arena, pool->threads * job.scratchSize);
+    }
+    struct BandWriter writer;
+    if (job.out == NULL || (job.span == NULL && job.scratch == NULL) ||
+        openBandWriter(&writer, outFilename, image.map, image.header.offset, job.out,
+                       image.stride, image.height, ws.direct) != 0) {
+        unloadBMP(&image);
+        freeWorkspace(&ws);
+        return 1;
+    }
+    job.writer = &writer;
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    poolRun(pool, (image.height + job.bandRows - 1) / job.bandRows, denoiseBand, &job);
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, &ws);
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("denoise", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+// Passes of the blur operation, each band-parallel over the image.
+enum BlurPass {
+    BLUR_ROWS,                 // Prefix sums along each padded row
+    BLUR_COLUMNS,              // Prefix sums down each strip of columns
+    BLUR_BOXES                 // Box sums to output rows, written per band
+};
+
+// Shared state for the blur operation. The integral image covers the
+// image padded by radius pixels on every side according to the Border
+// policy. Entry (y, x) holds, for each of B, G and R, the sum of the
+// padded pixels above and to the left of it, so it has one more row and
+// column than the padded image, and row and column 0 are zero.
+struct BlurJob {
+    const struct BMPImage *image;
+    int pass;                  // BlurPass being run
+    int radius;                // Box radius
+    int border;                // Border policy
+    int paddedWidth;           // width + 2 * radius
+    int paddedHeight;          // height + 2 * radius
+    int *columns;              // Source column of each padded column
+    uint32_t *integral;        // (paddedHeight + 1) rows of rowEntries sums
+    size_t rowEntries;         // 3 * (paddedWidth + 1)
+    int bandRows;              // Rows per band in BLUR_ROWS and BLUR_BOXES
+    int stripEntries;          // Entries per strip in BLUR_COLUMNS
+    unsigned char *out;        // Output rows, image->stride bytes apart
+    struct BandWriter *writer; // Writes each finished band to the output file
+};
+
+//
+// blurBand - Runs the current blur pass over one band of rows or, for
+// BLUR_COLUMNS, one strip of columns. Sums wrap around at 2^32, but every
+// box sum is below 2^32, so the differences taken from them are exact
+// however large the image is.
+//
+static void blurBand(void *arg, int index, int worker)
+{
+    struct BlurJob *job = arg;
+    const struct BMPImage *image = job->image;
+    int radius = job->radius, pitch = image->pixelBytes;
+    size_t rowEntries = job->rowEntries;
+    (void)worker;
+
+    if (job->pass == BLUR_COLUMNS) {
+        size_t begin = (size_t)index * job->stripEntries;
+        size_t end = begin + job->stripEntries;
+        if (end > rowEntries) {
+            end = rowEntries;
+        }
+        for (int y = 2; y <= job->paddedHeight; y++) {
+            uint32_t *restrict row = job->integral + (size_t)y * rowEntries;
+            const uint32_t *restrict above = row - rowEntries;
+            for (size_t k = begin; k < end; k++) {
+                row[k] += above[k];
+            }
+        }
+        return;
+    }
+
+    int rows = job->pass == BLUR_ROWS ? job->paddedHeight : image->height;
+    int first = index * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > rows) {
+        last = rows;
+    }
+
+    if (job->pass == BLUR_ROWS) {
+        for (int y = first; y < last; y++) {
+            const unsigned char *src =
+                bmpRow(image, borderIndex(y - radius, image->height, job->border));
+            uint32_t *row = job->integral + (size_t)(y + 1) * rowEntries;
+            uint32_t b = 0, g = 0, r = 0;
+            row[0] = row[1] = row[2] = 0;
+            for (int x = 0; x < job->paddedWidth; x++) {
+                const unsigned char *p = src + (size_t)job->columns[x] * pitch;
+                b += p[0];
+                g += p[1];
+                r += p[2];
+                row[3 * x + 3] = b;
+                row[3 * x + 4] = g;
+                row[3 * x + 5] = r;
+            }
+        }
+        return;
+    }
+
+    // Output row i is centred on padded row i + radius, so its box covers
+    // padded rows i to i + 2 * radius: integral rows i and i + 2 * radius + 1.
+    int size = 2 * radius + 1;
+    uint32_t area = (uint32_t)size * size;
+    for (int i = first; i < last; i++) {
+        const uint32_t *top = job->integral + (size_t)i * rowEntries;
+        const uint32_t *bottom = top + (size_t)size * rowEntries;
+        unsigned char *out = job->out + (size_t)i * image->stride;
+        for (int x = 0; x < image->width; x++) {
+            size_t left = 3 * (size_t)x, right = left + 3 * (size_t)size;
+            for (int c = 0; c < 3; c++) {
+                uint32_t sum = bottom[right + c] - bottom[left + c] -
+                               top[right + c] + top[left + c];
+                out[(size_t)x * pitch + c] = (unsigned char)((sum + area / 2) / area);
+            }
+        }
+        if (pitch == 4) {
+            copyAlpha(out, bmpRow(image, i), image->width);
+        }
+        // Padding bytes are written as 0.
+        memset(out + (size_t)image->width * pitch, 0, image->padding);
+    }
+    writeBand(job->writer, first, last);
+}
+
+//
+// blurOperation - Performs the "blur" operation: a box blur of radius
+// --radius on each channel, written to the -o file or "<original>-blur.bmp".
+// Each output pixel is read from an integral image with four lookups per
+// channel, so the cost per pixel is the same at any radius. The integral
+// image is built with band-parallel row prefix sums and then strip-parallel
+// column prefix sums. --border chooses how pixels outside the image are
+// read.
+//
+static int blurOperation(const char *inputFile, const struct Options *opts,
+                         struct ThreadPool *pool)
+{
+    char outFilename[4096];
+    if (opts->outFile != NULL) {
+        snprintf(outFilename, sizeof(outFilename), "%s", opts->outFile);
+    }
+    else {
+        outputFileName(inputFile, "-blur.bmp", outFilename, sizeof(outFilename));
+    }
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+
+    struct BlurJob job;
+    memset(&job, 0, sizeof(job));
+    job.image = &image;
+    job.radius = opts->radius;
+    job.border = opts->border;
+    job.paddedWidth = image.width + 2 * job.radius;
+    job.paddedHeight = image.height + 2 * job.radius;
+    job.rowEntries = 3 * ((size_t)job.paddedWidth + 1);
+    arenaReset(&ws.arena);
+    job.out = outputPixels(&ws, image.map, image.header.offset, image.stride * image.height);
+    job.columns = arenaAlloc(&ws.arena, (size_t)job.paddedWidth * sizeof(int));
+    job.integral = arenaAlloc(&ws.arena, ((size_t)job.paddedHeight + 1) * job.rowEntries *
+                                         sizeof(uint32_t));
+    struct BandWriter writer;
+    if (job.out == NULL || job.columns == NULL || job.integral == NULL ||
+        openBandWriter(&writer, outFilename, image.map, image.header.offset, job.out,
+                       image.stride, image.height, ws.direct) != 0) {
+        unloadBMP(&image);
+        freeWorkspace(&ws);
+        return 1;
+    }
+    job.writer = &writer;
+    for (int x = 0; x < job.paddedWidth; x++) {
+        job.columns[x] = borderIndex(x - job.radius, image.width, job.border);
+    }
+    memset(job.integral, 0, job.rowEntries * sizeof(uint32_t));
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    // Strips of whole cache lines, several per thread.
+    int strip = (int)(job.rowEntries / ((size_t)pool->threads * 8));
+    job.stripEntries = (strip + 15) & ~15;
+    if (job.stripEntries < 64) {
+        job.stripEntries = 64;
+    }
+    job.pass = BLUR_ROWS;
+    job.bandRows = bandRowsFor(pool, job.paddedHeight);
+    poolRun(pool, (job.paddedHeight + job.bandRows - 1) / job.bandRows, blurBand, &job);
+    job.pass = BLUR_COLUMNS;
+    poolRun(pool, (int)((job.rowEntries + job.stripEntries - 1) / job.stripEntries),
+            blurBand, &job);
+    job.pass = BLUR_BOXES;
+    job.bandRows = bandRowsFor(pool, image.height);
+    poolRun(pool, (image.height + job.bandRows - 1) / job.bandRows, blurBand, &job);
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, &ws);
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("blur", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+//
+// resizedHeader - Copies the header of image to buffer, changing the
+// dimensions, image size and file size to those of a width x height image
+// with rows stride bytes apart. Every other field, the sign of the height
+// (row order) and any colour masks are kept.
+//
+static void resizedHeader(unsigned char *buffer, const struct BMPImage *image,
+                          int width, int height, size_t stride)
+{
+    size_t headerSize = image->header.offset;
+    size_t imageSize = stride * height;
+    memcpy(buffer, image->map, headerSize);
+    writeLE32(buffer + 2, (uint32_t)(headerSize + imageSize));
+    writeLE32(buffer + 18, (uint32_t)width);
+    writeLE32(buffer + 22, (uint32_t)(image->topDown ? -height : height));
+    writeLE32(buffer + 34, (uint32_t)imageSize);
+}
+
+// One level of a pyramid being built: half the width and height of the
+// level above it, rounded up.
+struct PyramidLevel {
+    int width, height;
+    int sourceWidth;           // Width of the level above (or the image)
+    size_t stride;             // Bytes per output row, including padding
+    unsigned char *pending;    // Row of the level above waiting for its pair
+    int hasPending;            // pending holds a row
+    unsigned char *sums;       // 2x2 means at every byte of the level above
+    unsigned char *row;        // Output row, padding bytes zero
+    FILE *fp;                  // Output file
+};
+
+// State of a pyramid run.
+struct PyramidJob {
+    int levels;
+    int pitch;                 // Bytes per pixel
+    struct PyramidLevel level[PYRAMID_LEVELS];
+    struct Workspace *ws;
+};
+
+static void pyramidFeed(struct PyramidJob *job, int k, const unsigned char *row);
+
+//
+// pyramidPair - Makes the next row of level k from a pair of rows a and b
+// of the level above, writes it out and feeds it to level k + 1. An odd
+// last column is averaged over its two rows only; b equals a for the odd
+// last row.
+//
+static void pyramidPair(struct PyramidJob *job, int k, const unsigned char *a,
+                        const unsigned char *b)
+{
+    struct PyramidLevel *level = &job->level[k];
+    int pitch = job->pitch, source = level->sourceWidth, pairs = source / 2;
+    if (source > 1) {
+        halveSpan(a, b, level->sums, 0, pitch * (source - 1), pitch);
+    }
+    for (int x = 0; x < pairs; x++) {
+        memcpy(level->row + (size_t)x * pitch, level->sums + (size_t)2 * x * pitch, pitch);
+    }
+    if (source % 2 != 0) {
+        size_t last = (size_t)(source - 1) * pitch;
+        for (int c = 0; c < pitch; c++) {
+            level->row[(size_t)pairs * pitch + c] =
+                (unsigned char)((a[last + c] + b[last + c] + 1) >> 1);
+        }
+    }
+    fwrite(level->row, 1, level->stride, level->fp);
+    job->ws->bytesWritten += level->stride;
+    if (k + 1 < job->levels) {
+        pyramidFeed(job, k + 1, level->row);
+    }
+}
+
+//
+// pyramidFeed - Passes one row of the level above level k (the image, for
+// level 0) down the pyramid. The first row of each pair waits in pending;
+// the second completes a row of level k.
+//
+static void pyramidFeed(struct PyramidJob *job, int k, const unsigned char *row)
+{
+    struct PyramidLevel *level = &job->level[k];
+    if (!level->hasPending) {
+        memcpy(level->pending, row, (size_t)level->sourceWidth * job->pitch);
+        level->hasPending = 1;
+        return;
+    }
+    level->hasPending = 0;
+    pyramidPair(job, k, level->pending, row);
+}
+
+//
+// pyramidOperation - Performs the "pyramid" operation: writes successive
+// 2x downsamples of the image to "<original>-1.bmp", "<original>-2.bmp"
+// and so on, down to 1x1 or --levels N levels. Each level pixel is the
+// rounded mean of a 2x2 block of the level above, with the last row or
+// column of an odd size averaged on its own. The source is read once,
+// row by row; each row ripples down through every level as soon as it
+// completes a pair, so only two rows per level are held in memory and
+// all levels cost little more than one read of the source.
+//
+static int pyramidOperation(const char *inputFile, const struct Options *opts)
+{
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+    arenaReset(&ws.arena);
+
+    struct PyramidJob job;
+    memset(&job, 0, sizeof(job));
+    job.pitch = image.pixelBytes;
+    job.ws = &ws;
+    int width = image.width, height = image.height;
+    while ((width > 1 || height > 1) && job.levels < PYRAMID_LEVELS &&
+           (opts->levels == 0 || job.levels < opts->levels)) {
+        struct PyramidLevel *level = &job.level[job.levels++];
+        level->sourceWidth = width;
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        level->width = width;
+        level->height = height;
+        level->stride = ((size_t)width * job.pitch + 3) & ~(size_t)3;
+    }
+
+    int status = 0;
+    for (int k = 0; k < job.levels && status == 0; k++) {
+        struct PyramidLevel *level = &job.level[k];
+        size_t sourceBytes = (size_t)level->sourceWidth * job.pitch;
+        level->pending = arenaAlloc(&ws.arena, sourceBytes);
+        level->sums = arenaAlloc(&ws.arena, sourceBytes);
+        level->row = arenaAlloc(&ws.arena, level->stride);
+        unsigned char *header = arenaAlloc(&ws.arena, image.header.offset);
+        char suffix[16], outFilename[4096];
+        snprintf(suffix, sizeof(suffix), "-%d.bmp", k + 1);
+        outputFileName(inputFile, suffix, outFilename, sizeof(outFilename));
+        if (level->pending == NULL || level->sums == NULL || level->row == NULL ||
+            header == NULL) {
+            status = 1;
+            break;
+        }
+        memset(level->row, 0, level->stride);
+        detachOutput(outFilename);
+        level->fp = fopen(outFilename, "wb");
+        if (level->fp == NULL) {
+            perror("Error creating output file");
+            status = 1;
+            break;
+        }
+        resizedHeader(header, &image, level->width, level->height, level->stride);
+        fwrite(header, 1, image.header.offset, level->fp);
+        ws.bytesWritten += image.header.offset;
+    }
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    // Rows are taken in stored order, so every level keeps the row order
+    // of the source.
+    if (status == 0 && job.levels > 0) {
+        for (int i = 0; i < image.height; i++) {
+            pyramidFeed(&job, 0, bmpRow(&image, i));
+        }
+        for (int k = 0; k < job.levels; k++) {
+            if (job.level[k].hasPending) {
+                job.level[k].hasPending = 0;
+                pyramidPair(&job, k, job.level[k].pending, job.level[k].pending);
+            }
+        }
+    }
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    // Rows are written unchecked as they ripple down; a failed write
+    // leaves the stream's error flag set.
+    for (int k = 0; k < job.levels; k++) {
+        FILE *fp = job.level[k].fp;
+        if (fp != NULL && (ferror(fp) | (fclose(fp) != 0))) {
+            perror("Error writing output file");
+            status = 1;
+        }
+    }
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("pyramid", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+// Source pixels and weights covering each output pixel along one axis of
+// an area-averaging resize. Output pixel o covers source pixels first[o]
+// to first[o] + count[o] - 1 with weights[o * taps + j], which sum to 1.
+struct ResizeAxis {
+    int *first;
+    int *count;
+    float *weights;
+    int taps;                  // Most source pixels one output pixel covers
+};
+
+//
+// resizeAxis - Fills in the coverage of size output pixels spread evenly
+// over source input pixels: output pixel o covers the source interval
+// [o * input / size, (o + 1) * input / size), and each source pixel is
+// weighted by how much of that interval it covers. Returns 0 on success.
+//
+static int resizeAxis(struct Arena *arena, int input, int size, struct ResizeAxis *axis)
+{
+    double scale = (double)input / size;
+    axis->taps = (int)ceil(scale) + 1;
+    axis->first = arenaAlloc(arena, (size_t)size * sizeof(int));
+    axis->count = arenaAlloc(arena, (size_t)size * sizeof(int));
+    axis->weights = arenaAlloc(arena, (size_t)size * axis->taps * sizeof(float));
+    if (axis->first == NULL || axis->count == NULL || axis->weights == NULL) {
+        return 1;
+    }
+    for (int o = 0; o < size; o++) {
+        double lo = o * scale, hi = (o + 1) * scale;
+        int first = (int)floor(lo);
+        int last = (int)ceil(hi) - 1;
+        if (last > input - 1) {
+            last = input - 1;
+        }
+        axis->first[o] = first;
+        axis->count[o] = last - first + 1;
+        for (int s = first; s <= last; s++) {
+            double covered = (s + 1 < hi ? s + 1 : hi) - (s > lo ? s : lo);
+            axis->weights[(size_t)o * axis->taps + (s - first)] = (float)(covered / scale);
+        }
+    }
+    return 0;
+}
+
+// Shared state for the band-parallel resize.
+struct ResizeJob {
+    const struct BMPImage *image;
+    int width, height;         // Output size
+    struct ResizeAxis columns; // Coverage of the output columns
+    struct ResizeAxis rows;    // Coverage of the output rows, in stored order
+    unsigned char *out;        // Output rows, stride bytes apart
+    size_t stride;
+    int bandRows;              // Rows per band (the last band may be shorter)
+    float *scratch;            // Two rows of width * pitch floats per worker
+    size_t rowFloats;          // Floats per scratch row
+    struct BandWriter *writer; // Writes each finished band to the output file
+};
+
+//
+// resizeBand - Resizes one horizontal band of output rows. Each source row
+// under an output row is resampled across, then weighted into the sum for
+// the output row. Every channel, alpha included, is averaged.
+//
+static void resizeBand(void *arg, int band, int worker)
+{
+    struct ResizeJob *job = arg;
+    const struct BMPImage *image = job->image;
+    const struct ResizeAxis *columns = &job->columns, *rows = &job->rows;
+    int pitch = image->pixelBytes, bytes = job->width * pitch;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > job->height) {
+        last = job->height;
+    }
+    float *sum = job->scratch + (size_t)worker * 2 * job->rowFloats;
+    float *across = sum + job->rowFloats;
+
+    for (int i = first; i < last; i++) {
+        memset(sum, 0, (size_t)bytes * sizeof(float));
+        for (int j = 0; j < rows->count[i]; j++) {
+            const unsigned char *src = bmpRow(image, rows->first[i] + j);
+            float weight = rows->weights[(size_t)i * rows->taps + j];
+            for (int x = 0; x < job->width; x++) {
+                const unsigned char *p = src + (size_t)columns->first[x] * pitch;
+                const float *w = columns->weights + (size_t)x * columns->taps;
+                for (int c = 0; c < pitch; c++) {
+                    float value = 0;
+                    for (int t = 0; t < columns->count[x]; t++) {
+                        value += w[t] * p[t * pitch + c];
+                    }
+                    across[x * pitch + c] = value;
+                }
+            }
+            for (int b = 0; b < bytes; b++) {
+                sum[b] += weight * across[b];
+            }
+        }
+        unsigned char *out = job->out + (size_t)i * job->stride;
+        for (int b = 0; b < bytes; b++) {
+            out[b] = clampFloat(sum[b]);
+        }
+        // Padding bytes are written as 0.
+        memset(out + bytes, 0, job->stride - bytes);
+    }
+    writeBand(job->writer, first, last);
+}
+
+//
+// resizeOperation - Performs the "resize" operation: area-averaging
+// resampling to --size WxH, or by --factor F, written to the -o file or
+// "<original>-resize.bmp". Each output pixel is the mean of the source
+// area it covers, weighting partly covered pixels by their coverage, so
+// any scale works, and downscaling by a whole factor averages whole
+// blocks. Output rows run band-parallel.
+//
+static int resizeOperation(const char *inputFile, const struct Options *opts,
+                           struct ThreadPool *pool)
+{
+    char outFilename[4096];
+    if (opts->outFile != NULL) {
+        snprintf(outFilename, sizeof(outFilename), "%s", opts->outFile);
+    }
+    else {
+        outputFileName(inputFile, "-resize.bmp", outFilename, sizeof(outFilename));
+    }
+
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+    struct BMPImage image;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+    arenaReset(&ws.arena);
+
+    struct ResizeJob job;
+    memset(&job, 0, sizeof(job));
+    job.image = &image;
+    job.width = opts->resizeWidth;
+    job.height = opts->resizeHeight;
+    if (job.width == 0) {
+        job.width = (int)lround(image.width * opts->factor);
+        job.height = (int)lround(image.height * opts->factor);
+        job.width = job.width < 1 ? 1 : job.width;
+        job.height = job.height < 1 ? 1 : job.height;
+    }
+    int pitch = image.pixelBytes;
+    job.stride = ((size_t)job.width * pitch + 3) & ~(size_t)3;
+    job.rowFloats = ((size_t)job.width * pitch + 15) & ~(size_t)15;
+    job.bandRows = bandRowsFor(pool, job.height);
+
+    unsigned char *header = arenaAlloc(&ws.arena, image.header.offset);
+    if (header != NULL) {
+        resizedHeader(header, &image, job.width, job.height, job.stride);
+    }
+    job.scratch = arenaAlloc(&ws.arena, (size_t)pool->threads * 2 * job.rowFloats *
+                                        sizeof(float));
+    job.out = header == NULL ? NULL : outputPixels(&ws, header, image.header.offset,
+                                                   job.stride * job.height);
+    struct BandWriter writer;
+    if (header == NULL || job.scratch == NULL || job.out == NULL ||
+        resizeAxis(&ws.arena, image.width, job.width, &job.columns) != 0 ||
+        resizeAxis(&ws.arena, image.height, job.height, &job.rows) != 0 ||
+        openBandWriter(&writer, outFilename, header, image.header.offset, job.out,
+                       job.stride, job.height, ws.direct) != 0) {
+        unloadBMP(&image);
+        freeWorkspace(&ws);
+        return 1;
+    }
+    job.writer = &writer;
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    poolRun(pool, (job.height + job.bandRows - 1) / job.bandRows, resizeBand, &job);
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    int status = closeBandWriter(&writer, &ws);
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("resize", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+// Sums of one channel over a 4x4 block of the image and the reference,
+// for SSIM.
+struct BlockSums {
+    uint32_t sum, refSum;      // Sums of the values
+    uint32_t squares;          // Sum of the squares of both
+    uint32_t products;         // Sum of the products
+};
+
+// One worker's share of the statistics, merged when all bands are done.
+struct StatsPartial {
+    uint64_t histogram[4][256];
+    uint64_t squaredError[4];  // Squared differences from the reference
+    int64_t ssim[4];           // Sum of window SSIMs, fixed point (SSIM_ONE = 1)
+    uint64_t windows;          // SSIM windows summed
+};
+
+// Fixed point SSIM sums are exact, so they do not depend on how windows
+// were split between workers.
+#define SSIM_ONE 4294967296.0
+
+// Shared state for the band-parallel statistics.
+struct StatsJob {
+    struct Image image;        // Image the statistics are of, top row first
+    struct Image ref;          // Reference, top row first (data NULL if none)
+    int bandRows;              // Rows per band, a multiple of 4
+    struct StatsPartial **partial; // One per worker
+    struct BlockSums *blocks;  // Two rows of blocks per worker
+    size_t blockEntries;       // Entries per row of blocks
+    uint32_t *columns;         // Column sums of a block row, per worker
+};
+
+//
+// statsBlocks - Sums each channel over the 4x4 blocks of block row j. The
+// four rows are first summed down each column, which vectorizes, and the
+// column sums then added up in fours.
+//
+static void statsBlocks(const struct StatsJob *job, int j, struct BlockSums *blocks,
+                        uint32_t *columns)
+{
+    int pitch = job->image.format, blocksX = job->image.width / 4;
+    size_t count = (size_t)4 * blocksX * pitch;
+    uint32_t *sum = columns, *refSum = columns + count;
+    uint32_t *squares = refSum + count, *products = squares + count;
+    memset(columns, 0, 4 * count * sizeof(*columns));
+    for (int y = 4 * j; y < 4 * j + 4; y++) {
+        const unsigned char *a = imageRow(&job->image, y);
+        const unsigned char *b = imageRow(&job->ref, y);
+        for (size_t i = 0; i < count; i++) {
+            uint32_t u = a[i], v = b[i];
+            sum[i] += u;
+            refSum[i] += v;
+            squares[i] += u * u + v * v;
+            products[i] += u * v;
+        }
+    }
+    for (int bx = 0; bx < blocksX; bx++) {
+        for (int c = 0; c < pitch; c++) {
+            struct BlockSums *block = blocks + (size_t)bx * pitch + c;
+            memset(block, 0, sizeof(*block));
+            for (size_t i = (size_t)4 * bx * pitch + c; i < (size_t)(4 * bx + 4) * pitch;
+                 i += pitch) {
+                block->sum += sum[i];
+                block->refSum += refSum[i];
+                block->squares += squares[i];
+                block->products += products[i];
+            }
+        }
+    }
+}
+
+//
+// ssimWindow - Returns the SSIM of an 8x8 window from its sums, with the
+// usual constants (0.01 * 255)^2 and (0.03 * 255)^2 scaled to sums.
+//
+static double ssimWindow(double sum, double refSum, double squares, double products)
+{
+    const double n = 64;
+    const double c1 = 0.01 * 0.01 * 255 * 255 * n * n;
+    const double c2 = 0.03 * 0.03 * 255 * 255 * n * (n - 1);
+    double variances = squares * n - sum * sum - refSum * refSum;
+    double covariance = products * n - sum * refSum;
+    return (2 * sum * refSum + c1) * (2 * covariance + c2) /
+           ((sum * sum + refSum * refSum + c1) * (variances + c2));
+}
+
+//
+// statsBand - Adds one band of rows to the worker's partial statistics:
+// the histogram of each channel, squared differences from the reference,
+// and the SSIM of every 8x8 window (at steps of 4 pixels) whose top block
+// row falls in the band.
+//
+static void statsBand(void *arg, int band, int worker)
+{
+    struct StatsJob *job = arg;
+    struct StatsPartial *partial = job->partial[worker];
+    int pitch = job->image.format, width = job->image.width;
+    int first = band * job->bandRows;
+    int last = first + job->bandRows;
+    if (last > job->image.height) {
+        last = job->image.height;
+    }
+
+    // Two histograms per channel, for even and odd pixels, so runs of equal
+    // values do not wait on the increment before.
+    uint32_t counts[2][4][256];
+    memset(counts, 0, sizeof(counts));
+    uint64_t squaredError[4] = { 0 };
+    for (int y = first; y < last; y++) {
+        const unsigned char *p = imageRow(&job->image, y);
+        int x = 0;
+        for (; x + 1 < width; x += 2, p += 2 * pitch) {
+            for (int c = 0; c < pitch; c++) {
+                counts[0][c][p[c]]++;
+                counts[1][c][p[pitch + c]]++;
+            }
+        }
+        if (x < width) {
+            for (int c = 0; c < pitch; c++) {
+                counts[0][c][p[c]]++;
+            }
+        }
+        if (job->ref.data != NULL) {
+            const unsigned char *a = imageRow(&job->image, y);
+            const unsigned char *b = imageRow(&job->ref, y);
+            for (int x = 0; x < width; x++, a += pitch, b += pitch) {
+                for (int c = 0; c < pitch; c++) {
+                    int d = a[c] - b[c];
+                    squaredError[c] += d * d;
+                }
+            }
+        }
+    }
+    for (int c = 0; c < pitch; c++) {
+        for (int v = 0; v < 256; v++) {
+            partial->histogram[c][v] += counts[0][c][v] + counts[1][c][v];
+        }
+        partial->squaredError[c] += squaredError[c];
+    }
+
+    int blocksX = width / 4, windowRows = job->image.height / 4 - 1;
+    int top = first / 4, bottom = last / 4;
+    if (job->ref.data == NULL || blocksX < 2 || top >= windowRows) {
+        return;
+    }
+    if (bottom > windowRows) {
+        bottom = windowRows;
+    }
+    struct BlockSums *upper = job->blocks + (size_t)worker * 2 * job->blockEntries;
+    struct BlockSums *lower = upper + job->blockEntries;
+    uint32_t *columns = job->columns + (size_t)worker * 16 * job->blockEntries;
+    statsBlocks(job, top, upper, columns);
+    for (int j = top; j < bottom; j++) {
+        statsBlocks(job, j + 1, lower, columns);
+        for (int bx = 0; bx + 1 < blocksX; bx++) {
+            const struct BlockSums *q[4] = {
+                upper + (size_t)bx * pitch, upper + (size_t)(bx + 1) * pitch,
+                lower + (size_t)bx * pitch, lower + (size_t)(bx + 1) * pitch
+            };
+            for (int c = 0; c < pitch; c++) {
+                uint32_t sum = 0, refSum = 0, squares = 0, products = 0;
+                for (int k = 0; k < 4; k++) {
+                    sum += q[k][c].sum;
+                    refSum += q[k][c].refSum;
+                    squares += q[k][c].squares;
+                    products += q[k][c].products;
+                }
+                partial->ssim[c] += (int64_t)(ssimWindow(sum, refSum, squares, products) *
+                                              SSIM_ONE);
+            }
+        }
+        partial->windows += blocksX - 1;
+        struct BlockSums *swap = upper;
+        upper = lower;
+        lower = swap;
+    }
+}
+
+//
+// printQuality - Prints one JSON member mapping each channel, and "all"
+// (blue, green and red together), to a value; null where it is undefined.
+//
+static void printQuality(FILE *json, const char *name, const double *values,
+                         int channels)
+{
+    static const char *channelNames[] = { "blue", "green", "red", "alpha", "all" };
+    fprintf(json, ",\n  \"%s\": {", name);
+    for (int c = 0; c <= channels; c++) {
+        int slot = c < channels ? c : 4;
+        fprintf(json, "%s\"%s\": ", c > 0 ? ", " : "", channelNames[slot]);
+        if (isfinite(values[slot])) {
+            fprintf(json, "%.6f", values[slot]);
+        }
+        else {
+            fprintf(json, "null");
+        }
+    }
+    fprintf(json, "}");
+}
+
+//
+// statsOperation - Performs the "stats" operation: reads the image once and
+// writes JSON (to stdout, or the -o file) with the histogram, minimum,
+// maximum, mean and variance of each channel. With --ref, it also gives
+// the PSNR and SSIM of the image against a reference of the same size and
+// format. PSNR is null for identical images. SSIM averages 8x8 windows at
+// steps of 4 pixels and is null for images under 8x8; the last width % 4
+// columns and bottom height % 4 rows only count towards the other
+// statistics. Both images are viewed top row first, so the windows do not
+// depend on either file's row order. Bands run in parallel into per-worker
+// partial sums, merged at the end.
+//
+static int statsOperation(const char *inputFile, const struct Options *opts,
+                          struct ThreadPool *pool)
+{
+    static const char *channelNames[] = { "blue", "green", "red", "alpha" };
+    struct Workspace ws;
+    initWorkspace(&ws, opts);
+    double mark = statsMark(&ws);
+    struct BMPImage image, ref;
+    if (loadBMP(inputFile, &image) != 0) {
+        return 1;
+    }
+    ws.bytesRead += image.mapSize;
+
+    struct StatsJob job;
+    memset(&job, 0, sizeof(job));
+    bmpView(&image, image.pixels, &job.image);
+    if (!image.topDown) {
+        flipView(&job.image);
+    }
+    if (opts->refFile != NULL) {
+        if (loadBMP(opts->refFile, &ref) != 0) {
+            unloadBMP(&image);
+            return 1;
+        }
+        ws.bytesRead += ref.mapSize;
+        if (ref.width != image.width || ref.height != image.height ||
+            ref.pixelBytes != image.pixelBytes) {
+            fprintf(stderr, "Reference image must have the same size and format\n");
+            unloadBMP(&ref);
+            unloadBMP(&image);
+            return 1;
+        }
+        bmpView(&ref, ref.pixels, &job.ref);
+        if (!ref.topDown) {
+            flipView(&job.ref);
+        }
+    }
+
+    int pitch = image.pixelBytes;
+    arenaReset(&ws.arena);
+    job.partial = arenaAlloc(&ws.arena, (size_t)pool->threads * sizeof(*job.partial));
+    job.blockEntries = (size_t)(image.width / 4) * pitch;
+    job.blocks = arenaAlloc(&ws.arena, (size_t)pool->threads * 2 * job.blockEntries *
+                                       sizeof(*job.blocks));
+    job.columns = arenaAlloc(&ws.arena, (size_t)pool->threads * 16 * job.blockEntries *
+                                        sizeof(*job.columns));
+    int status = job.partial == NULL ||
+                 ((job.blocks == NULL || job.columns == NULL) && job.blockEntries > 0);
+    for (int w = 0; w < pool->threads && status == 0; w++) {
+        job.partial[w] = arenaAlloc(&ws.arena, sizeof(struct StatsPartial));
+        if (job.partial[w] == NULL) {
+            status = 1;
+        }
+        else {
+            memset(job.partial[w], 0, sizeof(struct StatsPartial));
+        }
+    }
+    FILE *json = stdout;
+    if (status == 0 && opts->outFile != NULL) {
+        json = fopen(opts->outFile, "w");
+        if (json == NULL) {
+            perror("Error creating statistics output");
+            status = 1;
+        }
+    }
+    if (status != 0) {
+        if (opts->refFile != NULL) {
+            unloadBMP(&ref);
+        }
+        unloadBMP(&image);
+        freeWorkspace(&ws);
+        return 1;
+    }
+    statsLap(&ws, PHASE_DECODE, &mark);
+
+    job.bandRows = (bandRowsFor(pool, image.height) + 3) & ~3;
+    poolRun(pool, (image.height + job.bandRows - 1) / job.bandRows, statsBand, &job);
+    struct StatsPartial *total = job.partial[0];
+    for (int w = 1; w < pool->threads; w++) {
+        for (int c = 0; c < pitch; c++) {
+            for (int v = 0; v < 256; v++) {
+                total->histogram[c][v] += job.partial[w]->histogram[c][v];
+            }
+            total->squaredError[c] += job.partial[w]->squaredError[c];
+            total->ssim[c] += job.partial[w]->ssim[c];
+        }
+        total->windows += job.partial[w]->windows;
+    }
+    statsLap(&ws, PHASE_COMPUTE, &mark);
+
+    double pixels = (double)image.width * image.height;
+    fprintf(json, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"bits\": %d,\n"
+            "  \"channels\": {", image.width, image.height, 8 * pitch);
+    for (int c = 0; c < pitch; c++) {
+        const uint64_t *histogram = total->histogram[c];
+        int min = 0, max = 255;
+        double mean = 0, variance = 0;
+        while (histogram[min] == 0) {
+            min++;
+        }
+        while (histogram[max] == 0) {
+            max--;
+        }
+        for (int v = min; v <= max; v++) {
+            mean += (double)v * histogram[v];
+        }
+        mean /= pixels;
+        for (int v = min; v <= max; v++) {
+            variance += (v - mean) * (v - mean) * histogram[v];
+        }
+        variance /= pixels;
+        fprintf(json, "%s\n    \"%s\": {\"min\": %d, \"max\": %d, \"mean\": %.6f, "
+                "\"variance\": %.6f, \"histogram\": [", c > 0 ? "," : "",
+                channelNames[c], min, max, mean, variance);
+        for (int v = 0; v < 256; v++) {
+            fprintf(json, "%s%llu", v > 0 ? ", " : "", (unsigned long long)histogram[v]);
+        }
+        fprintf(json, "]}");
+    }
+    fprintf(json, "\n  }");
+
+    // Per channel values in slots 0-3, blue, green and red together in 4.
+    if (opts->refFile != NULL) {
+        double psnr[5], ssim[5], colorError = 0, colorSsim = 0;
+        for (int c = 0; c < pitch; c++) {
+            double mse = total->squaredError[c] / pixels;
+            psnr[c] = mse > 0 ? 10 * log10(255.0 * 255.0 / mse) : NAN;
+            ssim[c] = total->windows > 0 ? total->ssim[c] / SSIM_ONE / total->windows : NAN;
+            if (c < 3) {
+                colorError += mse / 3;
+                colorSsim += ssim[c] / 3;
+            }
+        }
+        psnr[4] = colorError > 0 ? 10 * log10(255.0 * 255.0 / colorError) : NAN;
+        ssim[4] = colorSsim;
+        printQuality(json, "psnr", psnr, pitch);
+        printQuality(json, "ssim", ssim, pitch);
+    }
+    fprintf(json, "\n}\n");
+
+    if (json != stdout && fclose(json) != 0) {
+        perror("Error writing statistics output");
+        status = 1;
+    }
+    if (opts->refFile != NULL) {
+        unloadBMP(&ref);
+    }
+    unloadBMP(&image);
+    statsLap(&ws, PHASE_ENCODE, &mark);
+    if (opts->stats != STATS_OFF) {
+        printStats("stats", &ws, 1, opts->stats);
+    }
+    freeWorkspace(&ws);
+    return status;
+}
+
+//
+// encodeHeader - Builds the 54-byte header of an uncompressed 24-bit
+// (pixelBytes 3) or 32-bit (pixelBytes 4) BMP with the given dimensions.
+//
+static void encodeHeader(unsigned char *buffer, int width, int height, int pixelBytes)
+{
+    size_t stride = ((size_t)width * pixelBytes + 3) & ~(size_t)3;
+    size_t imageSize = stride * height;
+    unsigned int fields[13] = {
+        (unsigned int)(BMP_HEADER_SIZE + imageSize), 0, BMP_HEADER_SIZE,
+        40, (unsigned int)width, (unsigned int)height,
+        1 | ((unsigned int)(8 * pixelBytes) << 16), 0,
+        (unsigned int)imageSize, 2835, 2835, 0, 0
+    };
+
+    // "BM" followed by thirteen little-endian 32-bit words. The planes and
+    // bits fields are two 16-bit words packed into one.
+    buffer[0] = 'B';
+    buffer[1] = 'M';
+    for (int f = 0; f < 13; f++) {
+        for (int b = 0; b < 4; b++) {
+            buffer[2 + 4 * f + b] = (unsigned char)(fields[f] >> (8 * b));
+        }
+    }
+}
+
+//
+// generateBMP - Writes a deterministic synthetic 24-bit image: gradients
+// plus hashed texture, so every filter has real work to do. Returns 0 on
+// success.
+//
+static int generateBMP(const char *fileName, int width, int height)
+{
+    FILE *fp = fopen(fileName, "wb");
+    if (!fp) {
+        perror("Error creating benchmark image");
+        return 1;
+    }
+    unsigned char header[BMP_HEADER_SIZE];
+    encodeHeader(header, width, height, 3);
+    fwrite(header, 1, BMP_HEADER_SIZE, fp);
+
+    size_t stride = ((size_t)width * 3 + 3) & ~(size_t)3;
+    unsigned char *row = calloc(1, stride);
+    if (row == NULL) {
+        perror("Memory allocation error");
+        fclose(fp);
+        return 1;
+    }
+    for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+            uint32_t hash = (uint32_t)(i * 73856093u) ^ (uint32_t)(j * 19349663u);
+            hash = (hash ^ (hash >> 13)) * 0x5BD1E995u;
+            for (int c = 0; c < 3; c++) {
+                row[3 * j + c] = (unsigned char)(i * 3 + j * 5 + c * 70 + ((hash >> (8 * c)) & 31));
+            }
+        }
+        fwrite(row, 1, stride, fp);
+    }
+    free(row);
+
+    if (ferror(fp) | fclose(fp)) {
+        perror("Error writing benchmark image");
+        return 1;
+    }
+    return 0;
+}
+
+//
+// benchOperation - Performs the "bench" operation: generates deterministic
+// synthetic images of the sizes in --sizes (megapixels, 1 to 500), runs
+// read, edge and noise on each with --warmup untimed and --reps timed runs,
+// and writes JSON with mean time, variance, MB/s and ns/pixel. Image widths
+// are chosen so that consecutive sizes cycle through row paddings 0 to 3.
+//
+static int benchOperation(const struct Options *opts, struct ThreadPool *pool, int isa)
+{
+    static const char *isaNames[] = { "scalar", "sse2", "avx2", "avx512" };
+    static const char *operations[] = { "read", "edge", "noise" };
+    const char *dir = opts->outDir != NULL ? opts->outDir : ".";
+
+    FILE *json = stdout;
+    if (opts->outFile != NULL) {
+        json = fopen(opts->outFile, "w");
+        if (json == NULL) {
+            perror("Error creating benchmark output");
+            return 1;
+        }
+    }
+    double *times = malloc(opts->reps * sizeof(double));
+    if (times == NULL) {
+        perror("Memory allocation error");
+        return 1;
+    }
+
+    fprintf(json, "{\n  \"threads\": %d,\n  \"isa\": \"%s\",\n  \"reps\": %d,\n"
+            "  \"warmup\": %d,\n  \"results\": [", pool->threads, isaNames[isa],
+            opts->reps, opts->warmup);
+
+    struct Workspace ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.arena.hugePages = opts->hugePages;
+    ws.direct = opts->direct;
+    int status = 0, first = 1, index = 0;
+    char sizes[256];
+    snprintf(sizes, sizeof(sizes), "%s", opts->sizes);
+    for (char *save = NULL, *item = strtok_r(sizes, ",", &save);
+         item != NULL && status == 0; item = strtok_r(NULL, ",", &save), index++) {
+        char *end;
+        double megapixels = strtod(item, &end);
+        if (*end != '\0' || !(megapixels >= 1 && megapixels <= 500)) {
+            fprintf(stderr, "Benchmark sizes must be from 1 to 500 megapixels: %s\n", item);
+            status = 1;
+            break;
+        }
+
+        // Use a 4:3 image, nudging the width so that padding = index % 4
+        // (a width of 4k needs no padding, 4k+1 needs 1, 4k+2 needs 2 and
+        // 4k+3 needs 3).
+        int width = (int)sqrt(megapixels * 1e6 * 4 / 3) & ~3;
+        width += index % 4;
+        int height = (int)(megapixels * 1e6 / width);
+        int padding = (4 - (width * 3) % 4) % 4;
+
+        char inputFile[4096], outputFile[4096];
+        snprintf(inputFile, sizeof(inputFile), "%s/bench-%d.bmp", dir, index);
+        snprintf(outputFile, sizeof(outputFile), "%s/bench-%d-out.bmp", dir, index);
+        fprintf(stderr, "Generating %d x %d (padding %d)...\n", width, height, padding);
+        if (generateBMP(inputFile, width, height) != 0) {
+            status = 1;
+            break;
+        }
+        double bytes = BMP_HEADER_SIZE + (double)(width * 3 + padding) * height;
+        double pixels = (double)width * height;
+
+        for (int op = 0; op < 3 && status == 0; op++) {
+            for (int run = 0; run < opts->warmup + opts->reps; run++) {
+                double start = monotonicSeconds();
+                struct Options readOpts = *opts;
+                readOpts.format = DUMP_TEXT;
+                readOpts.regionX = readOpts.regionY = 0;
+                readOpts.regionW = readOpts.regionH = -1;
+                readOpts.stats = STATS_OFF;
+                if (op == 0) {
+                    status = readOperation(inputFile, "/dev/null", &readOpts);
+                }
+                else if (op == 1) {
+                    status = edgeFile(inputFile, outputFile, pool, &ws);
+                }
+                else {
+                    status = noiseFile(inputFile, outputFile, opts->seed,
+                                       NOISE_DEFAULT_STDDEV, pool, &ws);
+                }
+                if (status != 0) {
+                    break;
+                }
+                if (run >= opts->warmup) {
+                    times[run - opts->warmup] = monotonicSeconds() - start;
+                }
+            }
+            if (status != 0) {
+                break;
+            }
+
+            // Mean, sample variance and minimum of the timed runs.
+            double mean = 0, variance = 0, best = times[0];
+            for (int r = 0; r < opts->reps; r++) {
+                mean += times[r] / opts->reps;
+                best = times[r] < best ? times[r] : best;
+            }
+            for (int r = 0; r < opts->reps && opts->reps > 1; r++) {
+                variance += (times[r] - mean) * (times[r] - mean) / (opts->reps - 1);
+            }
+            fprintf(stderr, "  %-5s %8.2f MB/s %8.3f ns/pixel\n", operations[op],
+                    bytes / mean / 1e6, mean * 1e9 / pixels);
+            fprintf(json, "%s\n    {\"op\": \"%s\", \"megapixels\": %g, \"width\": %d, "
+                    "\"height\": %d, \"padding\": %d, \"bytes\": %.0f, \"mean_s\": %.6f, "
+                    "\"variance_s2\": %.3e, \"stddev_s\": %.6f, \"min_s\": %.6f, "
+                    "\"mb_per_s\": %.2f, \"ns_per_pixel\": %.4f}",
+                    first ? "" : ",", operations[op], megapixels, width, height, padding,
+                    bytes, mean, variance, sqrt(variance), best, bytes / mean / 1e6,
+                    mean * 1e9 / pixels);
+            first = 0;
+        }
+        remove(inputFile);
+        remove(outputFile);
+    }
+    fprintf(json, "\n  ]\n}\n");
+
+    if (json != stdout) {
+        fclose(json);
+    }
+    freeWorkspace(&ws);
+    free(times);
+    return status;
+}
+
+// Shared state for the batch operation.
+struct BatchJob {
+    char **files;              // Input files, in manifest order
+    int count;                 // Number of input files
+    int edge;                  // 1 for edge, 0 for noise
+    const struct Options *opts;
+    struct ThreadPool **inlinePools; // One single-thread pool per worker
+    struct Workspace *workspaces;    // One workspace per worker
+    int *failed;               // Failure count per worker
+};
+
+//
+// baseName - Returns the file name part of a path.
+//
+static const char *baseName(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+//
+// hashName - FNV-1a hash of a string, used to give every image of a batch
+// its own noise key that does not depend on its position in the list.
+//
+static uint64_t hashName(const char *name)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (; *name != '\0'; name++) {
+        hash = (hash ^ (unsigned char)*name) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+//
+// compareNames - qsort comparison for file names.
+//
+static int compareNames(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//
+// batchOutputName - Names the output of inputFile after it, in --out DIR
+// when given.
+//
+static void batchOutputName(const struct BatchJob *job, const char *inputFile,
+                            char *outFilename, size_t size)
+{
+    const char *suffix = job->edge ? "-edge.bmp" : "-noise.bmp";
+    if (job->opts->outDir != NULL) {
+        char name[512];
+        outputFileName(baseName(inputFile), suffix, name, sizeof(name));
+        snprintf(outFilename, size, "%s/%s", job->opts->outDir, name);
+    }
+    else {
+        outputFileName(inputFile, suffix, outFilename, size);
+    }
+}
+
+//
+// batchCollisions - Checks that no two inputs of a batch write the same
+// output, as x/a.bmp and y/a.bmp would with --out DIR; two workers would
+// otherwise write one file at once and a result would be lost. Returns 0
+// if every output name is distinct, 1 (with a message) otherwise.
+//
+static int batchCollisions(const struct BatchJob *job)
+{
+    char **names = calloc(job->count > 0 ? job->count : 1, sizeof(char *));
+    if (names == NULL) {
+        perror("Memory allocation error");
+        return 1;
+    }
+    int status = 0;
+    for (int i = 0; i < job->count && status == 0; i++) {
+        char outFilename[4096];
+        batchOutputName(job, job->files[i], outFilename, sizeof(outFilename));
+        names[i] = strdup(outFilename);
+        if (names[i] == NULL) {
+            perror("Memory allocation error");
+            status = 1;
+        }
+    }
+    if (status == 0 && job->count > 1) {
+        qsort(names, job->count, sizeof(char *), compareNames);
+        for (int i = 1; i < job->count && status == 0; i++) {
+            if (strcmp(names[i - 1], names[i]) == 0) {
+                fprintf(stderr, "Error: more than one input would be written to %s\n",
+                        names[i]);
+                status = 1;
+            }
+        }
+    }
+    for (int i = 0; i < job->count; i++) {
+        free(names[i]);
+    }
+    free(names);
+    return status;
+}
+
+//
+// batchImage - Processes one image of a batch on the calling worker. Images
+// run one per worker, so each uses a single-thread pool and the worker's
+// own workspace.
+//
+static void batchImage(void *arg, int index, int worker)
+{
+    struct BatchJob *job = arg;
+    const char *inputFile = job->files[index];
+    char outFilename[4096];
+    batchOutputName(job, inputFile, outFilename, sizeof(outFilename));
+
+    struct ThreadPool *pool = job->inlinePools[worker];
+    struct Workspace *ws = &job->workspaces[worker];
+    int status;
+    if (job->edge) {
+        status = edgeFile(inputFile, outFilename, pool, ws);
+    }
+    else {
+        uint64_t seed = job->opts->seed ^ hashName(baseName(inputFile));
+        status = noiseFile(inputFile, outFilename, seed, job->opts->stddev, pool, ws);
+    }
+    if (status != 0) {
+        fprintf(stderr, "Failed: %s\n", inputFile);
+        job->failed[worker]++;
+    }
+}
+
+//
+// addFile - Appends a copy of name to a growable list of file names.
+// Returns 0 on success, 1 on error.
+//
+static int addFile(char ***files, int *count, int *capacity, const char *name)
+{
+    if (*count == *capacity) {
+        int grown = *capacity > 0 ? 2 * *capacity : 64;
+        char **list = realloc(*files, grown * sizeof(char *));
+        if (list == NULL) {
+            perror("Memory allocation error");
+            return 1;
+        }
+        *files = list;
+        *capacity = grown;
+    }
+    (*files)[*count] = strdup(name);
+    if ((*files)[*count] == NULL) {
+        perror("Memory allocation error");
+        return 1;
+    }
+    (*count)++;
+    return 0;
+}
+
+//
+// listFiles - Builds the list of inputs for a batch: every .bmp file in a
+// directory (sorted by name), or every non-empty line of a manifest that
+// does not start with '#'. Returns the number of files, or -1 on error.
+//
+static int listFiles(const char *list, char ***files)
+{
+    int count = 0, capacity = 0;
+    *files = NULL;
+
+    struct stat st;
+    if (stat(list, &st) != 0) {
+        perror("Error opening batch input");
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(list);
+        if (dir == NULL) {
+            perror("Error opening batch directory");
+            return -1;
         }
-        return readOperation(argv[2], argv[3]);
-    }
-    else if (strcmp(argv[1], "edge") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage for edge: %s edge <input.bmp>\n", argv[0]);
-            exit(1);
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char *dot = strrchr(entry->d_name, '.');
+            if (dot == NULL || strcasecmp(dot, ".bmp") != 0) {
+                continue;
+            }
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", list, entry->d_name);
+            if (addFile(files, &count, &capacity, path) != 0) {
+                closedir(dir);
+                return -1;
+            }
         }
-        return edgeOperation(argv[2]);
-    }
-    else if (strcmp(argv[1], "noise") == 0) {
-        if (argc != 3) {
-            fprintf(stderr, "Usage for noise: %s noise <input.bmp>\n", argv[0]);
-            exit(1);
+        closedir(dir);
+        if (count > 0) {
+            qsort(*files, count, sizeof(char *), compareNames);
         }
-        return noiseOperation(argv[2]);
+        return count;
     }
-    else {
-        fprintf(stderr, "Invalid operation: %s\n", argv[1]);
-        exit(1);
+
+    FILE *fp = fopen(list, "r");
+    if (fp == NULL) {
+        perror("Error opening manifest");
+        return -1;
     }
-    return 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if (addFile(files, &count, &capacity, line) != 0) {
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return count;
 }
 
 //
-// readOperation - Performs the "read" operation by reading the BMP header
-// and pixel data then printing the details into an output text file.
+// batchOperation - Runs edge or noise over every image listed in a manifest
+// or directory without prompting. Up to --jobs images are processed at once,
+// each worker reusing its buffers from one image to the next. Reports
+// images/sec and bytes/sec (input plus output) at the end.
 //
-int readOperation(const char *inputFile, const char *outputFile)
+static int batchOperation(const char *list, const char *operation,
+                          const struct Options *opts)
 {
-    // Open the BMP input file in binary mode.
-    FILE *fp = fopen(inputFile, "rb");
-    if (!fp) {
-        perror("Error opening input file");
+    struct BatchJob job;
+    memset(&job, 0, sizeof(job));
+    if (strcmp(operation, "edge") == 0) {
+        job.edge = 1;
+    }
+    else if (strcmp(operation, "noise") != 0) {
+        fprintf(stderr, "Invalid batch operation: %s\n", operation);
+        return 1;
+    }
+    job.opts = opts;
+    if (!job.edge && opts->stddev == 0) {
+        fprintf(stderr, "Batch noise needs --stddev S (%d to %d).\n", NOISE_MIN_STDDEV,
+                NOISE_MAX_STDDEV);
         return 1;
     }
 
-    // Open the output file in text mode.
-    FILE *out = fopen(outputFile, "w");
-    if (!out) {
-        perror("Error opening output file");
-        fclose(fp);
+    job.count = listFiles(list, &job.files);
+    if (job.count < 0) {
+        return 1;
+    }
+    if (batchCollisions(&job) != 0) {
+        for (int i = 0; i < job.count; i++) {
+            free(job.files[i]);
+        }
+        free(job.files);
         return 1;
     }
 
-    // Read the 54-byte BMP header into a buffer.
-    unsigned char headerBuffer[54];
-    if (fread(headerBuffer, 1, 54, fp) != 54) {
-        fprintf(stderr, "Error reading BMP header.\n");
-        fclose(fp);
-        fclose(out);
+    struct ThreadPool *pool = poolCreate(opts->jobs);
+    if (pool == NULL) {
         return 1;
     }
+    int workers = pool->threads;
+    job.inlinePools = calloc(workers, sizeof(struct ThreadPool *));
+    job.workspaces = calloc(workers, sizeof(struct Workspace));
+    job.failed = calloc(workers, sizeof(int));
+    int status = 0;
+    if (job.inlinePools == NULL || job.workspaces == NULL || job.failed == NULL) {
+        perror("Memory allocation error");
+        status = 1;
+    }
+    for (int w = 0; w < workers && status == 0; w++) {
+        job.inlinePools[w] = poolCreate(1);
+        if (job.inlinePools[w] == NULL) {
+            status = 1;
+        }
+        initWorkspace(&job.workspaces[w], opts);
+    }
 
-    // Decode the BMP Header fields from the buffer (little endian)
-    struct Header header;
-    header.type = headerBuffer[0] | (headerBuffer[1] << 8);
-    header.size = headerBuffer[2] | (headerBuffer[3] << 8) |
-                  (headerBuffer[4] << 16) | (headerBuffer[5] << 24);
-    header.reserved1 = headerBuffer[6] | (headerBuffer[7] << 8);
-    header.reserved2 = headerBuffer[8] | (headerBuffer[9] << 8);
-    header.offset = headerBuffer[10] | (headerBuffer[11] << 8) |
-                    (headerBuffer[12] << 16) | (headerBuffer[13] << 24);
+    if (status == 0) {
+        double start = monotonicSeconds();
+        poolRun(pool, job.count, batchImage, &job);
+        double elapsed = monotonicSeconds() - start;
 
-    // Decode the BMP InfoHeader fields
-    struct InfoHeader info;
-    info.size = headerBuffer[14] | (headerBuffer[15] << 8) |
-                (headerBuffer[16] << 16) | (headerBuffer[17] << 24);
-    info.width = headerBuffer[18] | (headerBuffer[19] << 8) |
-                 (headerBuffer[20] << 16) | (headerBuffer[21] << 24);
-    info.height = headerBuffer[22] | (headerBuffer[23] << 8) |
-                  (headerBuffer[24] << 16) | (headerBuffer[25] << 24);
-    info.planes = headerBuffer[26] | (headerBuffer[27] << 8);
-    info.bits = headerBuffer[28] | (headerBuffer[29] << 8);
-    info.compression = headerBuffer[30] | (headerBuffer[31] << 8) |
-                       (headerBuffer[32] << 16) | (headerBuffer[33] << 24);
-    info.imageSize = headerBuffer[34] | (headerBuffer[35] << 8) |
-                     (headerBuffer[36] << 16) | (headerBuffer[37] << 24);
-    info.xResolution = headerBuffer[38] | (headerBuffer[39] << 8) |
-                       (headerBuffer[40] << 16) | (headerBuffer[41] << 24);
-    info.yResolution = headerBuffer[42] | (headerBuffer[43] << 8) |
-                       (headerBuffer[44] << 16) | (headerBuffer[45] << 24);
-    info.colors = headerBuffer[46] | (headerBuffer[47] << 8) |
-                  (headerBuffer[48] << 16) | (headerBuffer[49] << 24);
-    info.importantColors = headerBuffer[50] | (headerBuffer[51] << 8) |
-                           (headerBuffer[52] << 16) | (headerBuffer[53] << 24);
-
-    // Calculate the number of padded bytes per row.
-    int rowSize = info.width * 3; // each pixel is 3 bytes (RGB)
-    int padding = (4 - (rowSize % 4)) % 4;
-
-    // Print the file name and header data to the output file.
-    fprintf(out, "\"%s\"\n", inputFile);
-    // Print the two individual header type bytes (usually 'B' and 'M')
-    fprintf(out, "Header.Type = %c\n", headerBuffer[0]);
-    fprintf(out, "Header.Type = %c\n", headerBuffer[1]);
-    fprintf(out, "Header.Size = %u\n", header.size);
-    fprintf(out, "Header.Offset = %u\n", header.offset);
-    fprintf(out, "InfoHeader.Size = %u\n", info.size);
-    fprintf(out, "InfoHeader.Width = %d\n", info.width);
-    fprintf(out, "InfoHeader.Height = %d\n", info.height);
-    fprintf(out, "InfoHeader.Planes = %u\n", info.planes);
-    fprintf(out, "InfoHeader.Bits = %u\n", info.bits);
-    fprintf(out, "InfoHeader.Compression = %u\n", info.compression);
-    fprintf(out, "InfoHeader.ImageSize = %u\n", info.imageSize);
-    fprintf(out, "InfoHeader.xResolution = %d\n", info.xResolution);
-    fprintf(out, "InfoHeader.yResolution = %d\n", info.yResolution);
-    fprintf(out, "InfoHeader.Colors = %u\n", info.colors);
-    fprintf(out, "InfoHeader.ImportantColors = %u\n", info.importantColors);
-    fprintf(out, "Padding = %d\n", padding);
-
-    // Print out each individual byte of the header.
-    for (int i = 0; i < 54; i++) {
-        fprintf(out, "Byte[%d] = %03d\n", i, headerBuffer[i]);
-    }
-
-    // Read and print the pixel data
-    // Since BMP pixels are stored as rows (with potential padding at the end),
-    // we read one row at a time.
-    int width = info.width;
-    int height = info.height;
-    for (int i = 0; i < height; i++) {
-        // For each pixel in the current row
-        for (int j = 0; j < width; j++) {
-            // Each pixel has 3 bytes, stored in BMP as B, G, R.
-            unsigned char color[3];
-            if (fread(color, 1, 3, fp) != 3) {
-                fprintf(stderr, "Error reading pixel data.\n");
-                fclose(fp);
-                fclose(out);
-                return 1;
-            }
-            // Rearrange into RGB order for printing.
-            fprintf(out, "RGB[%d,%d] = %03d.%03d.%03d\n", i, j, color[2], color[1], color[0]);
+        int failed = 0;
+        unsigned long long bytes = 0;
+        for (int w = 0; w < workers; w++) {
+            failed += job.failed[w];
+            bytes += job.workspaces[w].bytesRead + job.workspaces[w].bytesWritten;
         }
-        // For any padding bytes at the end of the row, read and print them.
-        for (int k = 0; k < padding; k++) {
-            unsigned char padByte;
-            if (fread(&padByte, 1, 1, fp) != 1) {
-                fprintf(stderr, "Error reading padding data.\n");
-                fclose(fp);
-                fclose(out);
-                return 1;
-            }
-            fprintf(out, "Padding[%d] = %03d\n", k, padByte);
+        if (elapsed <= 0) {
+            elapsed = 1e-9;
+        }
+        printf("Processed %d images (%d failed) in %.3f s with %d jobs: "
+               "%.1f images/s, %.1f MB/s\n", job.count - failed, failed, elapsed,
+               workers, (job.count - failed) / elapsed, bytes / elapsed / 1e6);
+        status = failed > 0;
+        if (opts->stats != STATS_OFF) {
+            printStats("batch", job.workspaces, workers, opts->stats);
         }
     }
 
-    fclose(fp);
-    fclose(out);
-    return 0;
+    for (int w = 0; w < workers; w++) {
+        if (job.inlinePools != NULL) {
+            poolDestroy(job.inlinePools[w]);
+        }
+        if (job.workspaces != NULL) {
+            freeWorkspace(&job.workspaces[w]);
+        }
+    }
+    for (int i = 0; i < job.count; i++) {
+        free(job.files[i]);
+    }
+    free(job.files);
+    free(job.inlinePools);
+    free(job.workspaces);
+    free(job.failed);
+    poolDestroy(pool);
+    return status;
 }
 
 //
-// edgeOperation - Performs the "edge" operation by reading the BMP image,
-// applying an edge-detection filter, and writing a new BMP file with "-edge" inserted
-// in the original filename.
+// serveFile - Resolves a request path. "fd:N" names the Nth descriptor
+// passed with the request, reached through /proc/self/fd; anything else
+// is a path. Returns 0 on success, 1 if N is not a passed descriptor.
 //
-int edgeOperation(const char *inputFile)
+static int serveFile(const char *name, const int *fds, int fdCount, char *path,
+                     size_t size)
 {
-    // Open the BMP input file in binary mode.
-    FILE *fp = fopen(inputFile, "rb");
-    if (!fp) {
-        perror("Error opening input file");
-        return 1;
+    if (strncmp(name, "fd:", 3) != 0) {
+        snprintf(path, size, "%s", name);
+        return 0;
     }
-
-    // Read the 54-byte BMP header.
-    unsigned char headerBuffer[54];
-    if (fread(headerBuffer, 1, 54, fp) != 54) {
-        fprintf(stderr, "Error reading BMP header.\n");
-        fclose(fp);
+    char *end;
+    long index = strtol(name + 3, &end, 10);
+    if (*end != '\0' || name[3] == '\0' || index < 0 || index >= fdCount) {
         return 1;
     }
+    snprintf(path, size, "/proc/self/fd/%d", fds[index]);
+    return 0;
+}
 
-    // Decode the InfoHeader fields from the header (bytes 14-53).
-    struct InfoHeader info;
-    info.size = headerBuffer[14] | (headerBuffer[15] << 8) |
-                (headerBuffer[16] << 16) | (headerBuffer[17] << 24);
-    info.width = headerBuffer[18] | (headerBuffer[19] << 8) |
-                 (headerBuffer[20] << 16) | (headerBuffer[21] << 24);
-    info.height = headerBuffer[22] | (headerBuffer[23] << 8) |
-                  (headerBuffer[24] << 16) | (headerBuffer[25] << 24);
-    info.planes = headerBuffer[26] | (headerBuffer[27] << 8);
-    info.bits = headerBuffer[28] | (headerBuffer[29] << 8);
-    info.compression = headerBuffer[30] | (headerBuffer[31] << 8) |
-                       (headerBuffer[32] << 16) | (headerBuffer[33] << 24);
-    info.imageSize = headerBuffer[34] | (headerBuffer[35] << 8) |
-                     (headerBuffer[36] << 16) | (headerBuffer[37] << 24);
-    info.xResolution = headerBuffer[38] | (headerBuffer[39] << 8) |
-                       (headerBuffer[40] << 16) | (headerBuffer[41] << 24);
-    info.yResolution = headerBuffer[42] | (headerBuffer[43] << 8) |
-                       (headerBuffer[44] << 16) | (headerBuffer[45] << 24);
-    info.colors = headerBuffer[46] | (headerBuffer[47] << 8) |
-                  (headerBuffer[48] << 16) | (headerBuffer[49] << 24);
-    info.importantColors = headerBuffer[50] | (headerBuffer[51] << 8) |
-                           (headerBuffer[52] << 16) | (headerBuffer[53] << 24);
-
-    int width = info.width;
-    int height = info.height;
-    int rowSize = width * 3;
-    int padding = (4 - (rowSize % 4)) % 4;
-
-    // Dynamically allocate a 2D array to hold the pixel data.
-    struct PIXEL **pixels = malloc(height * sizeof(struct PIXEL *));
-    if (pixels == NULL) {
-        perror("Memory allocation error");
-        fclose(fp);
-        return 1;
+//
+// serveRequest - Runs one request line on the given worker and formats the
+// reply: "ok" with the total and per-phase seconds, or "error" with a
+// reason (details of I/O errors go to the server's stderr). fds are the
+// descriptors passed with the request.
+//
+static void serveRequest(struct ServeJob *job, int worker, char *line,
+                         const int *fds, int fdCount, char *reply, size_t size)
+{
+    char *save = NULL;
+    char *op = strtok_r(line, " \t", &save);
+    if (op == NULL || strcmp(op, "ping") == 0) {
+        snprintf(reply, size, "ok\n");
+        return;
     }
-    for (int i = 0; i < height; i++) {
-        pixels[i] = malloc(width * sizeof(struct PIXEL));
-        if (pixels[i] == NULL) {
-            perror("Memory allocation error");
-            fclose(fp);
-            return 1;
+    if (strcmp(op, "quit") == 0) {
+        // Wake workers blocked reading idle connections as well as those
+        // blocked in accept. Requests already received still get answers.
+        pthread_mutex_lock(&job->lock);
+        __atomic_store_n(&job->stopping, 1, __ATOMIC_RELAXED);
+        shutdown(job->listener, SHUT_RDWR);
+        for (int w = 0; w < job->workers; w++) {
+            if (job->connections[w] >= 0) {
+                shutdown(job->connections[w], SHUT_RD);
+            }
         }
+        pthread_mutex_unlock(&job->lock);
+        snprintf(reply, size, "ok\n");
+        return;
+    }
+    int edge = strcmp(op, "edge") == 0, noise = strcmp(op, "noise") == 0;
+    if (!edge && !noise && strcmp(op, "conv") != 0) {
+        snprintf(reply, size, "error unknown operation %s\n", op);
+        return;
     }
 
-    // Read the pixel data from the file.
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            unsigned char color[3];
-            if (fread(color, 1, 3, fp) != 3) {
-                fprintf(stderr, "Error reading pixel data.\n");
-                fclose(fp);
-                return 1;
+    char inputFile[4096], outFilename[4096];
+    char *in = strtok_r(NULL, " \t", &save);
+    char *out = strtok_r(NULL, " \t", &save);
+    if (in == NULL || out == NULL) {
+        snprintf(reply, size, "error usage: %s IN OUT [key=value ...]\n", op);
+        return;
+    }
+    if (serveFile(in, fds, fdCount, inputFile, sizeof(inputFile)) != 0 ||
+        serveFile(out, fds, fdCount, outFilename, sizeof(outFilename)) != 0) {
+        snprintf(reply, size, "error no such passed descriptor\n");
+        return;
+    }
+
+    // Parameters default to the server's command line options.
+    double stddev = job->opts->stddev != 0 ? job->opts->stddev : NOISE_DEFAULT_STDDEV;
+    uint64_t seed = job->opts->seed;
+    double scale = job->opts->scale, bias = job->opts->bias;
+    const char *spec = NULL;
+    for (char *arg = strtok_r(NULL, " \t", &save); arg != NULL;
+         arg = strtok_r(NULL, " \t", &save)) {
+        char *value = strchr(arg, '=');
+        char *end = NULL;
+        if (value == NULL) {
+            snprintf(reply, size, "error expected key=value: %s\n", arg);
+            return;
+        }
+        *value++ = '\0';
+        if (strcmp(arg, "stddev") == 0) {
+            stddev = strtod(value, &end);
+            if (!(stddev >= NOISE_MIN_STDDEV && stddev <= NOISE_MAX_STDDEV)) {
+                end = value;
             }
-            // BMP format stores pixels in Blue, Green, Red order.
-            pixels[i][j].blue = color[0];
-            pixels[i][j].green = color[1];
-            pixels[i][j].red = color[2];
         }
-        // Skip over any padding bytes.
-        fseek(fp, padding, SEEK_CUR);
+        else if (strcmp(arg, "seed") == 0) {
+            seed = strtoull(value, &end, 10);
+        }
+        else if (strcmp(arg, "scale") == 0) {
+            scale = strtod(value, &end);
+        }
+        else if (strcmp(arg, "bias") == 0) {
+            bias = strtod(value, &end);
+        }
+        else if (strcmp(arg, "kernel") == 0) {
+            spec = value;
+            end = value + strlen(value);
+        }
+        if (end == NULL || end == value || *end != '\0') {
+            snprintf(reply, size, "error invalid %s\n", arg);
+            return;
+        }
     }
-    fclose(fp);
 
-    // Allocate a new 2D array for the edge-detected pixel data.
-    struct PIXEL **edgePixels = malloc(height * sizeof(struct PIXEL *));
-    if (edgePixels == NULL) {
-        perror("Memory allocation error");
-        return 1;
+    struct ThreadPool *pool = job->inlinePools[worker];
+    struct Workspace *ws = &job->workspaces[worker];
+    double before[PHASES];
+    memcpy(before, ws->seconds, sizeof(before));
+    unsigned long hits = ws->cacheHits;
+    double start = monotonicSeconds();
+    int status;
+    if (edge) {
+        status = edgeFile(inputFile, outFilename, pool, ws);
     }
-    for (int i = 0; i < height; i++) {
-        edgePixels[i] = malloc(width * sizeof(struct PIXEL));
-        if (edgePixels[i] == NULL) {
-            perror("Memory allocation error");
-            return 1;
+    else if (noise) {
+        status = noiseFile(inputFile, outFilename, seed, stddev, pool, ws);
+    }
+    else {
+        struct Kernel kernel;
+        if (spec == NULL) {
+            snprintf(reply, size, "error conv needs kernel=K\n");
+            return;
         }
+        status = parseKernel(spec, scale, bias, &kernel) != 0 ||
+                 convolveFile(inputFile, outFilename, &kernel, pool, ws) != 0;
     }
+    double total = monotonicSeconds() - start;
 
-    // Define the 3x3 edge detection filter matrix.
-    int matrix[3][3] = { {  0, -1,  0 },
-                         { -1,  4, -1 },
-                         {  0, -1,  0 } };
+    if (status != 0) {
+        snprintf(reply, size, "error %s failed\n", op);
+    }
+    else {
+        snprintf(reply, size, "ok total=%.6f decode=%.6f compute=%.6f encode=%.6f%s\n",
+                 total, ws->seconds[PHASE_DECODE] - before[PHASE_DECODE],
+                 ws->seconds[PHASE_COMPUTE] - before[PHASE_COMPUTE],
+                 ws->seconds[PHASE_ENCODE] - before[PHASE_ENCODE],
+                 ws->cacheDir == NULL ? "" : ws->cacheHits > hits ? " cache=hit" : " cache=miss");
+    }
+}
 
-    // Apply the convolution filter to each pixel.
-    // For boundary pixels, simply copy the original value.
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            if (i == 0 || i == height - 1 || j == 0 || j == width - 1) {
-                edgePixels[i][j] = pixels[i][j];
+//
+// serveConnection - Answers the requests on one connection until the client
+// closes it. Each request is one line; descriptors sent with SCM_RIGHTS
+// belong to the next request to end and are closed after it has run.
+//
+static void serveConnection(struct ServeJob *job, int worker, int conn)
+{
+    char line[SERVE_LINE];
+    size_t used = 0;
+    int fds[SERVE_FDS];
+    int fdCount = 0;
+
+    for (;;) {
+        union {
+            struct cmsghdr header;
+            char space[CMSG_SPACE(SERVE_FDS * sizeof(int))];
+        } control;
+        struct iovec iov = { line + used, sizeof(line) - 1 - used };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.space;
+        msg.msg_controllen = sizeof(control.space);
+        ssize_t got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // Keep passed descriptors for the request; close any beyond SERVE_FDS.
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); got > 0 && c != NULL;
+             c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+                continue;
             }
-            else {
-                int sumR = 0, sumG = 0, sumB = 0;
-                // Overlay the 3x3 filter matrix on the current pixel.
-                for (int m = -1; m <= 1; m++) {
-                    for (int n = -1; n <= 1; n++) {
-                        int factor = matrix[m+1][n+1];
-                        sumR += factor * pixels[i + m][j + n].red;
-                        sumG += factor * pixels[i + m][j + n].green;
-                        sumB += factor * pixels[i + m][j + n].blue;
-                    }
+            int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                if (fdCount < SERVE_FDS) {
+                    fds[fdCount++] = fd;
+                }
+                else {
+                    close(fd);
                 }
-                // Clamp the results to the valid range [0, 255].
-                edgePixels[i][j].red   = clamp(sumR);
-                edgePixels[i][j].green = clamp(sumG);
-                edgePixels[i][j].blue  = clamp(sumB);
             }
         }
+        if (got <= 0) {
+            break;
+        }
+        used += got;
+
+        // Run every complete line.
+        char *begin = line, *newline;
+        line[used] = '\0';
+        while ((newline = memchr(begin, '\n', line + used - begin)) != NULL) {
+            *newline = '\0';
+            char reply[256];
+            serveRequest(job, worker, begin, fds, fdCount, reply, sizeof(reply));
+            send(conn, reply, strlen(reply), MSG_NOSIGNAL);
+            for (int i = 0; i < fdCount; i++) {
+                close(fds[i]);
+            }
+            fdCount = 0;
+            begin = newline + 1;
+        }
+        used = line + used - begin;
+        memmove(line, begin, used);
+        if (used == sizeof(line) - 1) {
+            const char *reply = "error request too long\n";
+            send(conn, reply, strlen(reply), MSG_NOSIGNAL);
+            break;
+        }
+    }
+    for (int i = 0; i < fdCount; i++) {
+        close(fds[i]);
     }
+}
 
-    // Create the output filename by inserting "-edge" before the ".bmp" extension.
-    char outFilename[256];
-    strcpy(outFilename, inputFile);
-    char *dot = strrchr(outFilename, '.');
-    if (dot != NULL) {
-        *dot = '\0';
-        strcat(outFilename, "-edge.bmp");
-    } else {
-        strcat(outFilename, "-edge.bmp");
+//
+// serveWorker - Accepts and serves connections until a quit request shuts
+// the listening socket and the open connections down. The connection is
+// published in job->connections under the lock, so quit either sees it or
+// the worker sees stopping.
+//
+static void serveWorker(void *arg, int index, int worker)
+{
+    struct ServeJob *job = arg;
+    (void)index;
+    while (!__atomic_load_n(&job->stopping, __ATOMIC_RELAXED)) {
+        int conn = accept4(job->listener, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (!__atomic_load_n(&job->stopping, __ATOMIC_RELAXED)) {
+                perror("Error accepting connection");
+            }
+            break;
+        }
+        pthread_mutex_lock(&job->lock);
+        job->connections[worker] = conn;
+        if (__atomic_load_n(&job->stopping, __ATOMIC_RELAXED)) {
+            shutdown(conn, SHUT_RD);
+        }
+        pthread_mutex_unlock(&job->lock);
+        serveConnection(job, worker, conn);
+        pthread_mutex_lock(&job->lock);
+        job->connections[worker] = -1;
+        close(conn);
+        pthread_mutex_unlock(&job->lock);
     }
+}
 
-    // Open the output file in binary mode.
-    fp = fopen(outFilename, "wb");
-    if (!fp) {
-        perror("Error creating output file");
+//
+// serveOperation - Runs a job server on the Unix domain socket socketPath,
+// so callers avoid starting a process per image. Up to --jobs connections
+// are served at once, each worker keeping a single-thread pool and a
+// workspace whose arena is allocated and touched up front, so requests for
+// small images make no allocations. Returns when a client sends "quit".
+//
+static int serveOperation(const char *socketPath, const struct Options *opts)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socketPath);
         return 1;
     }
+    strcpy(address.sun_path, socketPath);
 
-    // Write the original BMP header.
-    fwrite(headerBuffer, 1, 54, fp);
+    // Replace a socket left behind by an earlier server, but nothing else.
+    struct stat st;
+    if (lstat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socketPath);
+    }
 
-    // Write the new (edge-detected) pixel data, including proper padding.
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // BMP files store pixel data in Blue, Green, Red order.
-            unsigned char color[3];
-            color[0] = edgePixels[i][j].blue;
-            color[1] = edgePixels[i][j].green;
-            color[2] = edgePixels[i][j].red;
-            fwrite(color, 1, 3, fp);
+    struct ServeJob job;
+    memset(&job, 0, sizeof(job));
+    job.opts = opts;
+    job.listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (job.listener < 0 ||
+        bind(job.listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(job.listener, 128) != 0) {
+        perror("Error creating server socket");
+        if (job.listener >= 0) {
+            close(job.listener);
+        }
+        return 1;
+    }
+
+    struct ThreadPool *pool = poolCreate(opts->jobs);
+    if (pool == NULL) {
+        close(job.listener);
+        unlink(socketPath);
+        return 1;
+    }
+    int workers = pool->threads;
+    job.workers = workers;
+    job.inlinePools = calloc(workers, sizeof(struct ThreadPool *));
+    job.workspaces = calloc(workers, sizeof(struct Workspace));
+    job.connections = malloc(workers * sizeof(int));
+    pthread_mutex_init(&job.lock, NULL);
+    int status = 0;
+    if (job.inlinePools == NULL || job.workspaces == NULL || job.connections == NULL) {
+        perror("Memory allocation error");
+        status = 1;
+    }
+    for (int w = 0; w < workers && job.connections != NULL; w++) {
+        job.connections[w] = -1;
+    }
+    for (int w = 0; w < workers && status == 0; w++) {
+        job.inlinePools[w] = poolCreate(1);
+        if (job.inlinePools[w] == NULL) {
+            status = 1;
+        }
+        initWorkspace(&job.workspaces[w], opts);
+        job.workspaces[w].timed = 1;
+
+        // Grow the arena to SERVE_ARENA_BYTES and fault its pages in now.
+        struct Arena *arena = &job.workspaces[w].arena;
+        if (arenaAlloc(arena, SERVE_ARENA_BYTES) == NULL) {
+            status = 1;
         }
-        // Write the necessary padding bytes (set to 0).
-        unsigned char pad = 0;
-        for (int k = 0; k < padding; k++) {
-            fwrite(&pad, 1, 1, fp);
+        arenaReset(arena);
+        if (arena->base != NULL) {
+            memset(arena->base, 0, arena->size);
         }
     }
-    fclose(fp);
 
-    // Free dynamically allocated memory.
-    for (int i = 0; i < height; i++) {
-        free(pixels[i]);
-        free(edgePixels[i]);
+    if (status == 0) {
+        fprintf(stderr, "Serving on %s with %d workers\n", socketPath, workers);
+        poolRun(pool, workers, serveWorker, &job);
     }
-    free(pixels);
-    free(edgePixels);
 
-    return 0;
+    for (int w = 0; w < workers; w++) {
+        if (job.inlinePools != NULL) {
+            poolDestroy(job.inlinePools[w]);
+        }
+        if (job.workspaces != NULL) {
+            freeWorkspace(&job.workspaces[w]);
+        }
+    }
+    free(job.inlinePools);
+    free(job.workspaces);
+    free(job.connections);
+    pthread_mutex_destroy(&job.lock);
+    poolDestroy(pool);
+    close(job.listener);
+    unlink(socketPath);
+    return status;
 }
 
 //
-// noiseOperation - Performs the "noise" operation by reading the BMP image,
-// adding Gaussian (Box-Muller) noise to each pixel, and writing a new BMP file with "-noise"
-// inserted in the original filename.
+// philox4x32 - Philox4x32-10 counter-based generator (Salmon et al., 2011).
+// Encrypts a 64-bit counter under a 64-bit key and returns four independent
+// uniformly distributed 32-bit words. Any counter can be evaluated directly,
+// so samples can be generated in any order and on any thread.
 //
-int noiseOperation(const char *inputFile)
+static void philox4x32(uint64_t counter, uint64_t seed, uint32_t out[4])
 {
-    // Open the BMP input file in binary mode.
-    FILE *fp = fopen(inputFile, "rb");
-    if (!fp) {
-        perror("Error opening input file");
-        return 1;
+    uint32_t c0 = (uint32_t)counter, c1 = (uint32_t)(counter >> 32), c2 = 0, c3 = 0;
+    uint32_t k0 = (uint32_t)seed, k1 = (uint32_t)(seed >> 32);
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)0xD2511F53u * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57u * c2;
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9u;
+        k1 += 0xBB67AE85u;
     }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
 
-    // Read the 54-byte BMP header.
-    unsigned char headerBuffer[54];
-    if (fread(headerBuffer, 1, 54, fp) != 54) {
-        fprintf(stderr, "Error reading BMP header.\n");
-        fclose(fp);
-        return 1;
-    }
+//
+// noiseRow - Adds Gaussian noise to count colour bytes, where the first
+// colour byte of src is sample number first of the image. Sample s takes
+// its value from Philox block s/4: the block's four words form two pairs of
+// uniforms, and the Box-Muller transform turns each pair into two normals
+// (the cosine and the sine branch), so no output is thrown away. scratch
+// must hold count + 8 doubles.
+//
+// Samples are numbered by colour byte, not by file byte, so a BGRA row
+// (pixelBytes 4) gets exactly the noise of the same row stored as BGR; its
+// alpha bytes are copied unchanged.
+//
+static void noiseRow(const unsigned char *src, unsigned char *dst, int count,
+                     uint64_t first, uint64_t seed, double stddev, double *scratch,
+                     int pixelBytes)
+{
+    const double scale = 1.0 / 4294967296.0;
+    uint64_t block = first / 4;
+    uint64_t lastBlock = (first + count - 1) / 4;
+    int n = 0;
 
-    // Decode the InfoHeader fields from the header.
-    struct InfoHeader info;
-    info.size = headerBuffer[14] | (headerBuffer[15] << 8) |
-                (headerBuffer[16] << 16) | (headerBuffer[17] << 24);
-    info.width = headerBuffer[18] | (headerBuffer[19] << 8) |
-                 (headerBuffer[20] << 16) | (headerBuffer[21] << 24);
-    info.height = headerBuffer[22] | (headerBuffer[23] << 8) |
-                  (headerBuffer[24] << 16) | (headerBuffer[25] << 24);
-    info.planes = headerBuffer[26] | (headerBuffer[27] << 8);
-    info.bits = headerBuffer[28] | (headerBuffer[29] << 8);
-    info.compression = headerBuffer[30] | (headerBuffer[31] << 8) |
-                       (headerBuffer[32] << 16) | (headerBuffer[33] << 24);
-    info.imageSize = headerBuffer[34] | (headerBuffer[35] << 8) |
-                     (headerBuffer[36] << 16) | (headerBuffer[37] << 24);
-    info.xResolution = headerBuffer[38] | (headerBuffer[39] << 8) |
-                       (headerBuffer[40] << 16) | (headerBuffer[41] << 24);
-    info.yResolution = headerBuffer[42] | (headerBuffer[43] << 8) |
-                       (headerBuffer[44] << 16) | (headerBuffer[45] << 24);
-    info.colors = headerBuffer[46] | (headerBuffer[47] << 8) |
-                  (headerBuffer[48] << 16) | (headerBuffer[49] << 24);
-    info.importantColors = headerBuffer[50] | (headerBuffer[51] << 8) |
-                           (headerBuffer[52] << 16) | (headerBuffer[53] << 24);
-
-    int width = info.width;
-    int height = info.height;
-    int rowSize = width * 3;
-    int padding = (4 - (rowSize % 4)) % 4;
-
-    // Dynamically allocate a 2D array to hold the pixel data.
-    struct PIXEL **pixels = malloc(height * sizeof(struct PIXEL *));
-    if (pixels == NULL) {
-        perror("Memory allocation error");
-        fclose(fp);
-        return 1;
+    // Generate whole blocks of four samples covering the row.
+    for (; block <= lastBlock; block++, n += 4) {
+        uint32_t words[4];
+        philox4x32(block, seed, words);
+        for (int p = 0; p < 4; p += 2) {
+            // Uniforms in (0, 1) and [0, 1): log(u1) is always finite.
+            double u1 = (words[p] + 0.5) * scale;
+            double u2 = words[p + 1] * scale;
+            double radius = sqrt(-2.0 * log(u1)) * stddev;
+            double angle = 2 * M_PI * u2;
+            scratch[n + p] = radius * cos(angle);
+            scratch[n + p + 1] = radius * sin(angle);
+        }
     }
-    for (int i = 0; i < height; i++) {
-        pixels[i] = malloc(width * sizeof(struct PIXEL));
-        if (pixels[i] == NULL) {
-            perror("Memory allocation error");
-            fclose(fp);
-            return 1;
+
+    // Add the samples, skipping those that belong to the previous row.
+    const double *noise = scratch + first % 4;
+    if (pixelBytes == 3) {
+        for (int k = 0; k < count; k++) {
+            dst[k] = clamp(src[k] + (int)round(noise[k]));
         }
+        return;
+    }
+    for (int k = 0, p = 0; k < count; k += 3, p += 4) {
+        dst[p] = clamp(src[p] + (int)round(noise[k]));
+        dst[p + 1] = clamp(src[p + 1] + (int)round(noise[k + 1]));
+        dst[p + 2] = clamp(src[p + 2] + (int)round(noise[k + 2]));
+        dst[p + 3] = src[p + 3];
     }
+}
 
-    // Read the pixel data.
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            unsigned char color[3];
-            if (fread(color, 1, 3, fp) != 3) {
-                fprintf(stderr, "Error reading pixel data.\n");
-                fclose(fp);
-                return 1;
-            }
-            // Convert from BMP (B, G, R) to our PIXEL structure (R, G, B).
-            pixels[i][j].blue = color[0];
-            pixels[i][j].green = color[1];
-            pixels[i][j].red = color[2];
+//
+// poolTakeTask - Takes the next task for a worker: first from its own queue,
+// otherwise by stealing the back half of another worker's range. Returns the
+// task index, or -1 when no work is left anywhere.
+//
+static int poolTakeTask(struct ThreadPool *pool, int worker)
+{
+    struct WorkQueue *own = &pool->queues[worker];
+    int index = -1;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->next < own->end) {
+        index = own->next++;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (index >= 0) {
+        return index;
+    }
+
+    // Our range is empty: look for a victim, starting with our neighbour.
+    for (int k = 1; k < pool->threads; k++) {
+        struct WorkQueue *victim = &pool->queues[(worker + k) % pool->threads];
+        int first = 0, last = 0;
+        pthread_mutex_lock(&victim->lock);
+        int remaining = victim->end - victim->next;
+        if (remaining > 0) {
+            last = victim->end;
+            first = last - (remaining + 1) / 2;
+            victim->end = first;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (last > first) {
+            // Run the first stolen task now and keep the rest as our range.
+            pthread_mutex_lock(&own->lock);
+            own->next = first + 1;
+            own->end = last;
+            pthread_mutex_unlock(&own->lock);
+            return first;
         }
-        fseek(fp, padding, SEEK_CUR);
     }
-    fclose(fp);
+    return -1;
+}
 
-    // Prompt the user for the standard deviation (from 5 to 20) for the Gaussian noise.
-    double stddev;
-    printf("Enter standard deviation for noise (5 to 20): ");
-    scanf("%lf", &stddev);
-    if (stddev < 5 || stddev > 20) {
-        printf("Standard deviation out of range. Setting to 5.\n");
-        stddev = 5;
+//
+// poolWork - Runs tasks of the current job until none are left.
+//
+static void poolWork(struct ThreadPool *pool, int worker)
+{
+    int index;
+    while ((index = poolTakeTask(pool, worker)) >= 0) {
+        pool->task(pool->arg, index, worker);
     }
+}
 
-    // Add Gaussian noise to each pixel using the Box-Muller transform.
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Generate noise for each color and add it to the original value.
-            int newRed   = pixels[i][j].red   + (int)round(generateGaussian(0, stddev));
-            int newGreen = pixels[i][j].green + (int)round(generateGaussian(0, stddev));
-            int newBlue  = pixels[i][j].blue  + (int)round(generateGaussian(0, stddev));
+//
+// poolThread - Main loop of a helper thread: wait for a job, work on it,
+// report completion.
+//
+static void *poolThread(void *arg)
+{
+    struct WorkQueue *queue = arg;
+    struct ThreadPool *pool = queue->pool;
+    int worker = queue->worker;
+
+    unsigned long seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
 
-            // Clamp the values to the valid range.
-            pixels[i][j].red   = clamp(newRed);
-            pixels[i][j].green = clamp(newGreen);
-            pixels[i][j].blue  = clamp(newBlue);
+        poolWork(pool, worker);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0) {
+            pthread_cond_signal(&pool->done);
         }
     }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
 
-    // Create the output filename by inserting "-noise" before ".bmp"
-    char outFilename[256];
-    strcpy(outFilename, inputFile);
-    char *dot = strrchr(outFilename, '.');
-    if (dot != NULL) {
-        *dot = '\0';
-        strcat(outFilename, "-noise.bmp");
+//
+// poolCreate - Creates a pool of the given number of workers (the caller of
+// poolRun counts as one of them). Returns NULL on error.
+//
+struct ThreadPool *poolCreate(int threads)
+{
+    struct ThreadPool *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        perror("Memory allocation error");
+        return NULL;
     }
-    else {
-        strcat(outFilename, "-noise.bmp");
+    pool->threads = threads;
+    pool->queues = calloc(threads, sizeof(struct WorkQueue));
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    if (pool->queues == NULL || pool->workers == NULL) {
+        perror("Memory allocation error");
+        free(pool->queues);
+        free(pool->workers);
+        free(pool);
+        return NULL;
     }
-
-    // Open the output file in binary mode.
-    fp = fopen(outFilename, "wb");
-    if (!fp) {
-        perror("Error creating output file");
-        return 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (int i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool->queues[i].lock, NULL);
+        pool->queues[i].pool = pool;
+        pool->queues[i].worker = i;
     }
 
-    // Write the header to the output file.
-    fwrite(headerBuffer, 1, 54, fp);
-
-    // Write the noisy pixel data with the appropriate row padding.
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            // Write pixel in BMP order: Blue, Green, Red.
-            unsigned char color[3];
-            color[0] = pixels[i][j].blue;
-            color[1] = pixels[i][j].green;
-            color[2] = pixels[i][j].red;
-            fwrite(color, 1, 3, fp);
+    // Start the helper threads; if one cannot be created, run with fewer.
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool->workers[i], NULL, poolThread, &pool->queues[i]) != 0) {
+            pool->threads = i;
+            break;
         }
-        // Write padding bytes (0s).
-        unsigned char pad = 0;
-        for (int k = 0; k < padding; k++) {
-            fwrite(&pad, 1, 1, fp);
+    }
+    return pool;
+}
+
+//
+// poolRun - Runs task(arg, i, worker) for every i in [0, count) and returns
+// when all tasks have finished. Tasks are dealt out as contiguous ranges,
+// one per worker; a worker that runs out steals from the others.
+//
+static void poolRun(struct ThreadPool *pool, int count, PoolTask task, void *arg)
+{
+    if (count <= 0) {
+        return;
+    }
+    int threads = pool->threads;
+    if (threads == 1) {
+        for (int i = 0; i < count; i++) {
+            task(arg, i, 0);
         }
+        return;
     }
-    fclose(fp);
 
-    // Free allocated memory.
-    for (int i = 0; i < height; i++) {
-        free(pixels[i]);
+    for (int w = 0; w < threads; w++) {
+        pool->queues[w].next = (int)((long long)count * w / threads);
+        pool->queues[w].end = (int)((long long)count * (w + 1) / threads);
     }
-    free(pixels);
 
-    return 0;
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->active = threads - 1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    poolWork(pool, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
 }
 
 //
-// generateGaussian - Uses the Box-Muller transform to generate a Gaussian-
-// distributed random number with the given mean and standard deviation.
+// poolDestroy - Stops the helper threads and frees the pool.
 //
-double generateGaussian(double mean, double stddev)
+void poolDestroy(struct ThreadPool *pool)
 {
-    // Generate two uniformly distributed random numbers in (0,1)
-    double u1 = (rand() + 1.0) / (RAND_MAX + 1.0);
-    double u2 = (rand() + 1.0) / (RAND_MAX + 1.0);
-    // Apply Box-Muller transform
-    double z0 = sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
-    return z0 * stddev + mean;
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 1; i < pool->threads; i++) {
+        pthread_join(pool->workers[i], NULL);
+    }
+    for (int i = 0; i < pool->threads; i++) {
+        pthread_mutex_destroy(&pool->queues[i].lock);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+    free(pool->queues);
+    free(pool->workers);
+    free(pool);
 }
 
 //
 // clamp - Clamps an integer value to the range [0, 255] and returns it as an unsigned char.
 //
-unsigned char clamp(int value)
+static unsigned char clamp(int value)
 {
     if (value < 0)
         return 0;